@@ -0,0 +1,1372 @@
+/*
+ * Copyright (c) 2018 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Throughput benchmark: configurable key size, key count, operation mix
+ * (including the YCSB A-F style workloads), uniform or Zipfian key choice
+ * and the number of threads.  Compares thmap against the baselines built
+ * here: a hash table protected by a single mutex and a sharded (i.e. lock
+ * striped) hash table.  Prints CSV, one line per backend and thread count.
+ *
+ * Notes on the workloads:
+ *
+ * - The update is a replace: thmap_del() followed by thmap_put() for
+ *   thmap (there is no in-place update), an in-place store for the
+ *   hash tables.
+ *
+ * - There are no ordered scans in a hash map, so the YCSB-E "scan" is a
+ *   lookup of a short range (1 to SCAN_MAXLEN) of the consecutive key IDs.
+ *
+ * - The Zipfian generator is the one used by YCSB (Gray et al., "Quickly
+ *   generating billion-record synthetic databases"); the ranks are then
+ *   scrambled so that the popular keys are spread across the key space.
+ *
+ * The memory staged for G/C by thmap is reclaimed periodically, once all
+ * worker threads have passed a quiescent state (the end of an operation).
+ *
+ * Latency mode (-r rate): an open-loop load generator.  Each thread issues
+ * the operations at a fixed rate (its share of the total), regardless of
+ * how long the previous ones took.  The latency is measured from the time
+ * the operation was scheduled to start rather than from the time it was
+ * actually issued, i.e. a stall is charged to every operation it delayed
+ * (correcting the coordinated omission).  The latencies are recorded in
+ * the per-thread log-linear (HDR style) histograms, separately for get,
+ * put and del, and reported as percentiles.
+ *
+ * Hardware counter mode (-p): the workers run the get, del and put phases
+ * (lookups using the configured key choice, then deletion and re-insertion
+ * of each thread's share of the keys), with the per-thread perf_event_open
+ * counters enabled only for the duration of a phase.  Reports the cycles,
+ * instructions, L1D/LLC/dTLB read misses and branch misses per operation.
+ * The counters which are not available (e.g. due to the permissions or in
+ * a virtual machine) are reported as empty fields.  Comparing the "thmap"
+ * and "thmap-huge" (THMAP_HUGEPAGE) backends with a large number of keys
+ * measures the dTLB miss reduction by the huge page backed nodes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "thmap.h"
+#include "utils.h"
+
+#define	MIN_KEYLEN	8
+#define	MAX_KEYLEN	512
+#define	MAX_THREADS	1024
+#define	SCAN_MAXLEN	16
+#define	GC_INTERVAL_MS	10
+#define	SPIN_NS		(50 * 1000)
+
+#ifndef __arraycount
+#define	__arraycount(a)	(sizeof(a) / sizeof(a[0]))
+#endif
+
+/*
+ * Operations and workloads.
+ */
+
+typedef enum {
+	OP_GET, OP_UPDATE, OP_INSERT, OP_DEL, OP_SCAN, OP_RMW, OP_COUNT
+} bench_op_t;
+
+typedef struct {
+	const char *	name;
+	unsigned	pct[OP_COUNT];
+	bool		latest;		// prefer the recently inserted keys
+} workload_t;
+
+static const workload_t		workloads[] = {
+	/*	     GET UPD INS DEL SCAN RMW */
+	{ "A",	{ 50, 50,  0,  0,  0,  0 }, false },	// update heavy
+	{ "B",	{ 95,  5,  0,  0,  0,  0 }, false },	// read mostly
+	{ "C",	{ 100, 0,  0,  0,  0,  0 }, false },	// read only
+	{ "D",	{ 95,  0,  5,  0,  0,  0 }, true },	// read latest
+	{ "E",	{ 0,   0,  5,  0, 95,  0 }, false },	// short ranges
+	{ "F",	{ 50,  0,  0,  0,  0, 50 }, false },	// read-modify-write
+};
+
+/*
+ * Latency classes: the operations are accounted as the map operations
+ * they mostly consist of.
+ */
+
+typedef enum { LAT_GET, LAT_PUT, LAT_DEL, LAT_COUNT } lat_class_t;
+
+static const char *		lat_names[LAT_COUNT] = { "get", "put", "del" };
+
+static const lat_class_t	op_lat_class[OP_COUNT] = {
+	[OP_GET] = LAT_GET,	[OP_UPDATE] = LAT_PUT,
+	[OP_INSERT] = LAT_PUT,	[OP_DEL] = LAT_DEL,
+	[OP_SCAN] = LAT_GET,	[OP_RMW] = LAT_PUT,
+};
+
+/*
+ * Log-linear histogram of the nanosecond values: the values below
+ * 2^HIST_SUB_BITS are recorded exactly, then every power-of-two range
+ * is split into 2^HIST_SUB_BITS linear buckets (~3% precision).
+ */
+
+#define	HIST_SUB_BITS	5
+#define	HIST_SUB	(1U << HIST_SUB_BITS)
+#define	HIST_SIZE	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+	uint64_t	count;
+	uint64_t	sum;
+	uint64_t	max;
+	uint64_t	buckets[HIST_SIZE];
+} hist_t;
+
+/*
+ * Hardware performance counters.
+ */
+
+typedef enum {
+	PMC_CYCLES, PMC_INSNS, PMC_L1D, PMC_LLC, PMC_DTLB, PMC_BRANCH,
+	PMC_COUNT
+} pmc_t;
+
+#if defined(__linux__)
+#define	PMC_CACHE(c)	((c) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+			(PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+	uint32_t	type;
+	uint64_t	config;
+} pmc_events[PMC_COUNT] = {
+	[PMC_CYCLES] =	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[PMC_INSNS] =	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[PMC_L1D] =	{ PERF_TYPE_HW_CACHE, PMC_CACHE(PERF_COUNT_HW_CACHE_L1D) },
+	[PMC_LLC] =	{ PERF_TYPE_HW_CACHE, PMC_CACHE(PERF_COUNT_HW_CACHE_LL) },
+	[PMC_DTLB] =	{ PERF_TYPE_HW_CACHE, PMC_CACHE(PERF_COUNT_HW_CACHE_DTLB) },
+	[PMC_BRANCH] =	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+#endif
+
+/*
+ * Backends.
+ */
+
+typedef struct {
+	const char *	name;
+	void *		(*create)(void);
+	void		(*destroy)(void *);
+	void *		(*get)(void *, const void *, size_t);
+	void *		(*put)(void *, const void *, size_t, void *);
+	void *		(*del)(void *, const void *, size_t);
+	void		(*update)(void *, const void *, size_t, void *);
+	void *		(*stage_gc)(void *);
+	void		(*gc)(void *, void *);
+} backend_t;
+
+/*
+ * Per-thread state.  The quiescent state counter is advanced at the end
+ * of every operation.
+ */
+
+typedef struct {
+	atomic_uint_fast64_t	qs;
+	uint64_t		nops;
+	uint64_t		rnd;
+	uint64_t		first;
+	uint64_t		last;
+	hist_t *		hist;	// LAT_COUNT histograms
+	int			pmc_fd[PMC_COUNT];
+	uint64_t		pmc[LAT_COUNT][PMC_COUNT];
+	uint64_t		pmc_ops[LAT_COUNT];
+	uint8_t			key[MAX_KEYLEN];
+} __aligned(CACHE_LINE_SIZE) worker_t;
+
+typedef struct {
+	uint64_t	n;
+	double		theta;
+	double		alpha;
+	double		zetan;
+	double		eta;
+	double		half_pow;
+} zipf_t;
+
+static const backend_t *	backend;
+static void *			map;
+static worker_t *		workers;
+static unsigned			nworkers;
+static pthread_barrier_t	barrier;
+static atomic_bool		stop;
+static atomic_uint_fast64_t	nitems;
+
+static unsigned			keylen = MIN_KEYLEN;
+static uint64_t			nkeys = 1000 * 1000;
+static unsigned			nseconds = 3;
+static unsigned			nshards = 64;
+static double			zipf_theta = 0;
+static zipf_t			zipf;
+static workload_t		workload;
+static unsigned			op_cdf[OP_COUNT];
+static uint64_t			rate;
+static bool			pmc_mode;
+static int			pmc_errno;
+
+///////////////////////////////////////////////////////////////////////////
+
+/*
+ * RANDOM NUMBERS AND KEY CHOICE.
+ */
+
+static uint64_t
+rnd_next(worker_t *w)
+{
+	/* xorshift64* */
+	uint64_t x = w->rnd;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	w->rnd = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+static double
+rnd_double(worker_t *w)
+{
+	return (rnd_next(w) >> 11) * 0x1.0p-53;
+}
+
+static uint64_t
+mix64(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+static void
+zipf_init(zipf_t *z, uint64_t n, double theta)
+{
+	double zeta2 = 0;
+
+	z->n = n;
+	z->theta = theta;
+	z->zetan = 0;
+	for (uint64_t i = 1; i <= n; i++) {
+		z->zetan += 1.0 / pow((double)i, theta);
+		if (i == 2) {
+			zeta2 = z->zetan;
+		}
+	}
+	z->alpha = 1.0 / (1.0 - theta);
+	z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+	z->half_pow = 1.0 + pow(0.5, theta);
+}
+
+static uint64_t
+zipf_next(const zipf_t *z, double u)
+{
+	const double uz = u * z->zetan;
+	uint64_t r;
+
+	if (uz < 1.0) {
+		return 0;
+	}
+	if (uz < z->half_pow) {
+		return 1;
+	}
+	r = (uint64_t)(z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+	return MIN(r, z->n - 1);
+}
+
+/*
+ * key_choose: pick a key ID out of the current key space.
+ */
+static uint64_t
+key_choose(worker_t *w)
+{
+	const uint64_t n = atomic_load_relaxed(&nitems);
+	uint64_t r;
+
+	if (zipf_theta == 0) {
+		return rnd_next(w) % n;
+	}
+	r = zipf_next(&zipf, rnd_double(w));
+	if (workload.latest) {
+		/* Rank zero is the most recently inserted key. */
+		return n - 1 - (r % n);
+	}
+	return mix64(r) % n;
+}
+
+static const void *
+key_make(worker_t *w, uint64_t id)
+{
+	memcpy(w->key, &id, sizeof(id));
+	return w->key;
+}
+
+static void *
+key_val(uint64_t id)
+{
+	return (void *)(uintptr_t)(id + 1);
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+/*
+ * LATENCY HISTOGRAMS.
+ */
+
+static unsigned
+hist_index(uint64_t v)
+{
+	unsigned msb;
+
+	if (v < HIST_SUB) {
+		return v;
+	}
+	msb = 63 - __builtin_clzll(v);
+	return ((msb - HIST_SUB_BITS) << HIST_SUB_BITS) +
+	    (v >> (msb - HIST_SUB_BITS));
+}
+
+/*
+ * hist_value: the highest value recorded in the given bucket.
+ */
+static uint64_t
+hist_value(unsigned idx)
+{
+	const unsigned q = (idx + 1) >> HIST_SUB_BITS;
+	const uint64_t r = (idx + 1) & (HIST_SUB - 1);
+
+	if (q <= 1) {
+		return idx;
+	}
+	return ((HIST_SUB + r) << (q - 1)) - 1;
+}
+
+static void
+hist_record(hist_t *h, uint64_t v)
+{
+	h->buckets[hist_index(v)]++;
+	h->count++;
+	h->sum += v;
+	h->max = MAX(h->max, v);
+}
+
+static void
+hist_merge(hist_t *dst, const hist_t *src)
+{
+	for (unsigned i = 0; i < HIST_SIZE; i++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+	dst->count += src->count;
+	dst->sum += src->sum;
+	dst->max = MAX(dst->max, src->max);
+}
+
+static uint64_t
+hist_percentile(const hist_t *h, double pct)
+{
+	const uint64_t target = MAX((uint64_t)ceil(h->count * pct / 100), 1);
+	uint64_t n = 0;
+
+	for (unsigned i = 0; i < HIST_SIZE; i++) {
+		if ((n += h->buckets[i]) >= target) {
+			return MIN(hist_value(i), h->max);
+		}
+	}
+	return h->max;
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+/*
+ * HARDWARE PERFORMANCE COUNTERS.
+ *
+ * Per-thread counting (user space only) of the calling thread.
+ */
+
+static void
+pmc_open(worker_t *w)
+{
+	for (unsigned i = 0; i < PMC_COUNT; i++) {
+#if defined(__linux__)
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = pmc_events[i].type;
+		attr.config = pmc_events[i].config;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+		    PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		w->pmc_fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+		w->pmc_fd[i] = -1;
+		errno = ENOTSUP;
+#endif
+		if (w->pmc_fd[i] < 0) {
+			pmc_errno = errno;
+		}
+	}
+}
+
+static void
+pmc_close(worker_t *w)
+{
+	for (unsigned i = 0; i < PMC_COUNT; i++) {
+		if (w->pmc_fd[i] >= 0) {
+			close(w->pmc_fd[i]);
+		}
+	}
+}
+
+static void
+pmc_start(worker_t *w)
+{
+#if defined(__linux__)
+	for (unsigned i = 0; i < PMC_COUNT; i++) {
+		if (w->pmc_fd[i] >= 0) {
+			ioctl(w->pmc_fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(w->pmc_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+#else
+	(void)w;
+#endif
+}
+
+/*
+ * pmc_stop: stop the counters and account the values to the given
+ * operation class, scaling them if the counters were multiplexed.
+ */
+static void
+pmc_stop(worker_t *w, lat_class_t c, uint64_t nops)
+{
+#if defined(__linux__)
+	for (unsigned i = 0; i < PMC_COUNT; i++) {
+		uint64_t val[3]; // value, time enabled, time running
+
+		if (w->pmc_fd[i] < 0) {
+			continue;
+		}
+		ioctl(w->pmc_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(w->pmc_fd[i], val, sizeof(val)) != sizeof(val)) {
+			continue;
+		}
+		if (val[2] && val[2] < val[1]) {
+			val[0] = (double)val[0] * val[1] / val[2];
+		}
+		w->pmc[c][i] += val[0];
+	}
+#endif
+	w->pmc_ops[c] += nops;
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+/*
+ * BASELINE: HASH TABLE (SINGLE MUTEX OR SHARDED).
+ *
+ * Chaining, with the bucket count fixed at the creation time (sized for
+ * the initial key count).  Keys are copied, as thmap does by default.
+ */
+
+typedef struct hent {
+	struct hent *	next;
+	void *		val;
+	uint32_t	hash;
+	uint32_t	len;
+	uint8_t		key[];
+} hent_t;
+
+typedef struct {
+	pthread_mutex_t	lock;
+	hent_t **	buckets;
+	uint64_t	mask;
+} __aligned(CACHE_LINE_SIZE) hshard_t;
+
+typedef struct {
+	hshard_t *	shards;
+	unsigned	nshards;
+} htable_t;
+
+static htable_t *
+htable_create(unsigned n)
+{
+	uint64_t nbuckets = 16;
+	htable_t *ht;
+
+	while (nbuckets < nkeys / n) {
+		nbuckets <<= 1;
+	}
+	ht = calloc(1, sizeof(htable_t));
+	ht->shards = aligned_alloc(CACHE_LINE_SIZE, n * sizeof(hshard_t));
+	if (ht->shards == NULL) {
+		err(EXIT_FAILURE, "aligned_alloc");
+	}
+	ht->nshards = n;
+
+	for (unsigned i = 0; i < n; i++) {
+		hshard_t *hs = &ht->shards[i];
+
+		pthread_mutex_init(&hs->lock, NULL);
+		hs->buckets = calloc(nbuckets, sizeof(hent_t *));
+		if (hs->buckets == NULL) {
+			err(EXIT_FAILURE, "calloc");
+		}
+		hs->mask = nbuckets - 1;
+	}
+	return ht;
+}
+
+static void
+htable_destroy(void *arg)
+{
+	htable_t *ht = arg;
+
+	for (unsigned i = 0; i < ht->nshards; i++) {
+		hshard_t *hs = &ht->shards[i];
+
+		for (uint64_t b = 0; b <= hs->mask; b++) {
+			hent_t *he = hs->buckets[b];
+
+			while (he) {
+				hent_t *next = he->next;
+				free(he);
+				he = next;
+			}
+		}
+		pthread_mutex_destroy(&hs->lock);
+		free(hs->buckets);
+	}
+	free(ht->shards);
+	free(ht);
+}
+
+/*
+ * htable_lookup: find the shard and return the pointer to the link
+ * referencing the entry (or the NULL link at the end of the chain).
+ * The caller must hold the shard lock.
+ */
+static hent_t **
+htable_lookup(hshard_t *hs, uint32_t hash, const void *key, size_t len)
+{
+	hent_t **linkp = &hs->buckets[hash & hs->mask];
+	hent_t *he;
+
+	while ((he = *linkp) != NULL) {
+		if (he->hash == hash && he->len == len &&
+		    memcmp(he->key, key, len) == 0) {
+			break;
+		}
+		linkp = &he->next;
+	}
+	return linkp;
+}
+
+static hshard_t *
+htable_shard(htable_t *ht, uint32_t hash)
+{
+	/* Use the high bits; the low bits select the bucket. */
+	return &ht->shards[(hash >> 16) % ht->nshards];
+}
+
+static void *
+htable_get(void *arg, const void *key, size_t len)
+{
+	const uint32_t hash = murmurhash3(key, len, 0);
+	hshard_t *hs = htable_shard(arg, hash);
+	hent_t *he;
+	void *val;
+
+	pthread_mutex_lock(&hs->lock);
+	he = *htable_lookup(hs, hash, key, len);
+	val = he ? he->val : NULL;
+	pthread_mutex_unlock(&hs->lock);
+	return val;
+}
+
+static void *
+htable_insert(void *arg, const void *key, size_t len, void *val, bool replace)
+{
+	const uint32_t hash = murmurhash3(key, len, 0);
+	hshard_t *hs = htable_shard(arg, hash);
+	hent_t **linkp, *he;
+
+	pthread_mutex_lock(&hs->lock);
+	linkp = htable_lookup(hs, hash, key, len);
+	if ((he = *linkp) != NULL) {
+		if (replace) {
+			he->val = val;
+		}
+		val = he->val;
+		pthread_mutex_unlock(&hs->lock);
+		return val;
+	}
+	if ((he = malloc(offsetof(hent_t, key[len]))) == NULL) {
+		pthread_mutex_unlock(&hs->lock);
+		return NULL;
+	}
+	he->next = NULL;
+	he->val = val;
+	he->hash = hash;
+	he->len = len;
+	memcpy(he->key, key, len);
+	*linkp = he;
+	pthread_mutex_unlock(&hs->lock);
+	return val;
+}
+
+static void *
+htable_put(void *arg, const void *key, size_t len, void *val)
+{
+	return htable_insert(arg, key, len, val, false);
+}
+
+static void
+htable_update(void *arg, const void *key, size_t len, void *val)
+{
+	(void)htable_insert(arg, key, len, val, true);
+}
+
+static void *
+htable_del(void *arg, const void *key, size_t len)
+{
+	const uint32_t hash = murmurhash3(key, len, 0);
+	hshard_t *hs = htable_shard(arg, hash);
+	hent_t **linkp, *he;
+	void *val = NULL;
+
+	pthread_mutex_lock(&hs->lock);
+	linkp = htable_lookup(hs, hash, key, len);
+	if ((he = *linkp) != NULL) {
+		*linkp = he->next;
+		val = he->val;
+		free(he);
+	}
+	pthread_mutex_unlock(&hs->lock);
+	return val;
+}
+
+static void *
+mutex_create(void)
+{
+	return htable_create(1);
+}
+
+static void *
+sharded_create(void)
+{
+	return htable_create(nshards);
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+/*
+ * THMAP BACKEND.
+ */
+
+static void *
+bthmap_create(void)
+{
+	return thmap_create(0, NULL, 0);
+}
+
+static void *
+bthmap_huge_create(void)
+{
+	return thmap_create(0, NULL, THMAP_HUGEPAGE);
+}
+
+static void
+bthmap_destroy(void *arg)
+{
+	const uint64_t n = atomic_load_relaxed(&nitems);
+	uint8_t key[MAX_KEYLEN];
+
+	/* The map must be empty: delete all keys which may be present. */
+	memset(key, 0xa5, sizeof(key));
+	for (uint64_t id = 0; id < n; id++) {
+		memcpy(key, &id, sizeof(id));
+		thmap_del(arg, key, keylen);
+	}
+	thmap_destroy(arg);
+}
+
+static void *
+bthmap_get(void *arg, const void *key, size_t len)
+{
+	return thmap_get(arg, key, len);
+}
+
+static void *
+bthmap_put(void *arg, const void *key, size_t len, void *val)
+{
+	return thmap_put(arg, key, len, val);
+}
+
+static void *
+bthmap_del(void *arg, const void *key, size_t len)
+{
+	return thmap_del(arg, key, len);
+}
+
+static void
+bthmap_update(void *arg, const void *key, size_t len, void *val)
+{
+	(void)thmap_del(arg, key, len);
+	(void)thmap_put(arg, key, len, val);
+}
+
+static void *
+bthmap_stage_gc(void *arg)
+{
+	return thmap_stage_gc(arg);
+}
+
+static void
+bthmap_gc(void *arg, void *ref)
+{
+	thmap_gc(arg, ref);
+}
+
+static const backend_t		backends[] = {
+	{
+		"thmap", bthmap_create, bthmap_destroy,
+		bthmap_get, bthmap_put, bthmap_del, bthmap_update,
+		bthmap_stage_gc, bthmap_gc,
+	}, {
+		"thmap-huge", bthmap_huge_create, bthmap_destroy,
+		bthmap_get, bthmap_put, bthmap_del, bthmap_update,
+		bthmap_stage_gc, bthmap_gc,
+	}, {
+		"mutex", mutex_create, htable_destroy,
+		htable_get, htable_put, htable_del, htable_update,
+		NULL, NULL,
+	}, {
+		"sharded", sharded_create, htable_destroy,
+		htable_get, htable_put, htable_del, htable_update,
+		NULL, NULL,
+	},
+};
+
+///////////////////////////////////////////////////////////////////////////
+
+/*
+ * WORKERS.
+ */
+
+static bench_op_t
+op_choose(worker_t *w)
+{
+	const unsigned r = rnd_next(w) % 100;
+	unsigned op = 0;
+
+	while (r >= op_cdf[op]) {
+		op++;
+	}
+	return (bench_op_t)op;
+}
+
+static void
+bench_op(worker_t *w, bench_op_t op)
+{
+	uint64_t id, n, len;
+
+	switch (op) {
+	case OP_GET:
+		id = key_choose(w);
+		(void)backend->get(map, key_make(w, id), keylen);
+		break;
+	case OP_UPDATE:
+		id = key_choose(w);
+		backend->update(map, key_make(w, id), keylen, key_val(id));
+		break;
+	case OP_INSERT:
+		id = atomic_fetch_add(&nitems, 1);
+		(void)backend->put(map, key_make(w, id), keylen, key_val(id));
+		break;
+	case OP_DEL:
+		id = key_choose(w);
+		(void)backend->del(map, key_make(w, id), keylen);
+		break;
+	case OP_SCAN:
+		id = key_choose(w);
+		len = 1 + rnd_next(w) % SCAN_MAXLEN;
+		n = atomic_load_relaxed(&nitems);
+		while (len--) {
+			(void)backend->get(map, key_make(w, id), keylen);
+			id = (id + 1) % n;
+		}
+		break;
+	case OP_RMW:
+		id = key_choose(w);
+		(void)backend->get(map, key_make(w, id), keylen);
+		backend->update(map, w->key, keylen, key_val(id));
+		break;
+	default:
+		abort();
+	}
+}
+
+static uint64_t
+clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * wait_until: sleep until shortly before the given time, then spin
+ * (the sleep alone would add its wake-up latency to the measurement).
+ */
+static void
+wait_until(uint64_t t)
+{
+	uint64_t now;
+
+	if ((now = clock_ns()) >= t) {
+		return;
+	}
+	if (t - now > SPIN_NS) {
+		const uint64_t when = t - SPIN_NS;
+		const struct timespec ts = {
+			.tv_sec = when / 1000000000ULL,
+			.tv_nsec = when % 1000000000ULL
+		};
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+	while (clock_ns() < t) {
+		/* Yield to the other threads, in case of oversubscription. */
+		sched_yield();
+	}
+}
+
+/*
+ * run_open_loop: issue the operations at the fixed rate, recording the
+ * latency from the scheduled start time of each operation.
+ */
+static uint64_t
+run_open_loop(worker_t *w)
+{
+	const uint64_t interval = 1000000000ULL * nworkers / rate;
+	uint64_t n = 0, next;
+
+	/* Stagger the threads evenly within the interval. */
+	next = clock_ns() + (w - workers) * interval / nworkers;
+
+	while (!atomic_load_relaxed(&stop)) {
+		const bench_op_t op = op_choose(w);
+
+		wait_until(next);
+		bench_op(w, op);
+		hist_record(&w->hist[op_lat_class[op]], clock_ns() - next);
+		atomic_store_explicit(&w->qs, ++n, memory_order_release);
+		next += interval;
+	}
+	return n;
+}
+
+/*
+ * run_pmc_phases: the lookup, deletion and re-insertion phases, each
+ * measured using the hardware counters and separated by the barriers
+ * (the main thread performs the G/C in between).
+ */
+static void
+run_pmc_phases(worker_t *w)
+{
+	static const lat_class_t phases[] = { LAT_GET, LAT_DEL, LAT_PUT };
+	const uint64_t n = w->last - w->first;
+
+	pmc_open(w);
+	for (unsigned p = 0; p < __arraycount(phases); p++) {
+		const lat_class_t c = phases[p];
+
+		pthread_barrier_wait(&barrier);
+		pmc_start(w);
+		for (uint64_t id = w->first; id < w->last; id++) {
+			switch (c) {
+			case LAT_GET:
+				(void)backend->get(map,
+				    key_make(w, key_choose(w)), keylen);
+				break;
+			case LAT_DEL:
+				(void)backend->del(map,
+				    key_make(w, id), keylen);
+				break;
+			case LAT_PUT:
+				(void)backend->put(map,
+				    key_make(w, id), keylen, key_val(id));
+				break;
+			default:
+				abort();
+			}
+		}
+		pmc_stop(w, c, n);
+		pthread_barrier_wait(&barrier);
+	}
+	pmc_close(w);
+	w->nops = 3 * n;
+}
+
+static void *
+bench_worker(void *arg)
+{
+	worker_t *w = arg;
+	uint64_t n = 0;
+
+	/* Pre-load this thread's share of the keys. */
+	for (uint64_t id = w->first; id < w->last; id++) {
+		backend->put(map, key_make(w, id), keylen, key_val(id));
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (rate) {
+		w->nops = run_open_loop(w);
+		pthread_exit(NULL);
+	}
+	if (pmc_mode) {
+		run_pmc_phases(w);
+		pthread_exit(NULL);
+	}
+	while (!atomic_load_relaxed(&stop)) {
+		bench_op(w, op_choose(w));
+		atomic_store_explicit(&w->qs, ++n, memory_order_release);
+	}
+	w->nops = n;
+	pthread_exit(NULL);
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+/*
+ * DRIVER.
+ */
+
+static double
+clock_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * wait_quiescent: wait until every worker completes at least one
+ * operation, i.e. no operation started before the call is in progress.
+ */
+static void
+wait_quiescent(unsigned nthreads)
+{
+	uint64_t snap[MAX_THREADS];
+
+	atomic_thread_fence(memory_order_seq_cst);
+	for (unsigned i = 0; i < nthreads; i++) {
+		snap[i] = atomic_load_explicit(&workers[i].qs,
+		    memory_order_acquire);
+	}
+	for (unsigned i = 0; i < nthreads; i++) {
+		while (atomic_load_explicit(&workers[i].qs,
+		    memory_order_acquire) == snap[i]) {
+			sched_yield();
+		}
+	}
+}
+
+/*
+ * run_timed: let the workers run for the configured duration; meanwhile,
+ * periodically reclaim the memory staged for G/C.
+ */
+static void
+run_timed(unsigned nthreads, double deadline)
+{
+	const struct timespec tick = {
+		.tv_sec = 0, .tv_nsec = GC_INTERVAL_MS * 1000 * 1000
+	};
+
+	while (clock_now() < deadline) {
+		void *ref;
+
+		nanosleep(&tick, NULL);
+		if (backend->stage_gc == NULL) {
+			continue;
+		}
+		if ((ref = backend->stage_gc(map)) != NULL) {
+			wait_quiescent(nthreads);
+			backend->gc(map, ref);
+		}
+	}
+}
+
+static void
+report_latency(double ops)
+{
+	static const double pcts[] = { 50, 90, 99, 99.9, 99.99 };
+
+	for (unsigned c = 0; c < LAT_COUNT; c++) {
+		hist_t *h = calloc(1, sizeof(hist_t));
+
+		if (h == NULL) {
+			err(EXIT_FAILURE, "calloc");
+		}
+		for (unsigned i = 0; i < nworkers; i++) {
+			hist_merge(h, &workers[i].hist[c]);
+		}
+		if (h->count == 0) {
+			free(h);
+			continue;
+		}
+		printf("%s,%s,%s,%u,%" PRIu64 ",%u,%" PRIu64 ",%.0f,%s,%"
+		    PRIu64 ",%.2f", backend->name, workload.name,
+		    zipf_theta ? "zipf" : "uniform", keylen, nkeys, nworkers,
+		    rate, ops, lat_names[c], h->count,
+		    (double)h->sum / h->count / 1000);
+		for (unsigned i = 0; i < __arraycount(pcts); i++) {
+			printf(",%.2f", hist_percentile(h, pcts[i]) / 1000.0);
+		}
+		printf(",%.2f\n", h->max / 1000.0);
+		free(h);
+	}
+}
+
+static void
+report_pmc(void)
+{
+	static const lat_class_t order[] = { LAT_GET, LAT_PUT, LAT_DEL };
+	static bool warned = false;
+
+	if (pmc_errno && !warned) {
+		warnx("some or all hardware counters are not available: %s",
+		    strerror(pmc_errno));
+		warned = true;
+	}
+	for (unsigned k = 0; k < __arraycount(order); k++) {
+		const lat_class_t c = order[k];
+		uint64_t nops = 0;
+
+		for (unsigned i = 0; i < nworkers; i++) {
+			nops += workers[i].pmc_ops[c];
+		}
+		printf("%s,%u,%" PRIu64 ",%u,%s,%" PRIu64, backend->name,
+		    keylen, nkeys, nworkers, lat_names[c], nops);
+
+		for (unsigned e = 0; e < PMC_COUNT; e++) {
+			uint64_t val = 0;
+
+			if (workers[0].pmc_fd[e] < 0 || nops == 0) {
+				printf(",");
+				continue;
+			}
+			for (unsigned i = 0; i < nworkers; i++) {
+				val += workers[i].pmc[c][e];
+			}
+			printf(",%.2f", (double)val / nops);
+		}
+		printf("\n");
+	}
+}
+
+/*
+ * run_pmc_main: the main thread's side of the run_pmc_phases(); the
+ * workers are parked on the barrier after each phase, therefore it is
+ * safe to perform the G/C.
+ */
+static void
+run_pmc_main(void)
+{
+	for (unsigned p = 0; p < 3; p++) {
+		pthread_barrier_wait(&barrier);
+		pthread_barrier_wait(&barrier);
+		if (backend->stage_gc) {
+			backend->gc(map, backend->stage_gc(map));
+		}
+	}
+}
+
+static double
+run_bench(unsigned nthreads)
+{
+	pthread_t *thr;
+	uint64_t total = 0;
+	double start, elapsed;
+
+	map = backend->create();
+	if (map == NULL) {
+		err(EXIT_FAILURE, "%s: create", backend->name);
+	}
+	thr = calloc(nthreads, sizeof(pthread_t));
+	workers = aligned_alloc(CACHE_LINE_SIZE, nthreads * sizeof(worker_t));
+	if (thr == NULL || workers == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	nworkers = nthreads;
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	atomic_store_relaxed(&stop, false);
+	atomic_store_relaxed(&nitems, nkeys);
+
+	for (unsigned i = 0; i < nthreads; i++) {
+		worker_t *w = &workers[i];
+
+		memset(w, 0, sizeof(worker_t));
+		memset(w->key, 0xa5, sizeof(w->key));
+		w->rnd = mix64(i + 1);
+		w->first = nkeys * i / nthreads;
+		w->last = nkeys * (i + 1) / nthreads;
+		if (rate && (w->hist = calloc(LAT_COUNT,
+		    sizeof(hist_t))) == NULL) {
+			err(EXIT_FAILURE, "calloc");
+		}
+
+		if ((errno = pthread_create(&thr[i], NULL,
+		    bench_worker, w)) != 0) {
+			err(EXIT_FAILURE, "pthread_create");
+		}
+	}
+
+	/* Wait for the pre-load to complete and start the clock. */
+	pthread_barrier_wait(&barrier);
+	start = clock_now();
+	if (pmc_mode) {
+		run_pmc_main();
+	} else {
+		run_timed(nthreads, start + nseconds);
+	}
+	atomic_store_relaxed(&stop, true);
+
+	for (unsigned i = 0; i < nthreads; i++) {
+		pthread_join(thr[i], NULL);
+		total += workers[i].nops;
+	}
+	elapsed = clock_now() - start;
+	if (rate) {
+		report_latency(total / elapsed);
+	}
+	if (pmc_mode) {
+		report_pmc();
+	}
+
+	pthread_barrier_destroy(&barrier);
+	backend->destroy(map);
+	for (unsigned i = 0; i < nthreads; i++) {
+		free(workers[i].hist);
+	}
+	free(workers);
+	free(thr);
+
+	return total / elapsed;
+}
+
+static void
+set_workload(const char *name)
+{
+	for (unsigned i = 0; i < __arraycount(workloads); i++) {
+		if (strcasecmp(workloads[i].name, name) == 0) {
+			workload = workloads[i];
+			return;
+		}
+	}
+	errx(EXIT_FAILURE, "unknown workload '%s'", name);
+}
+
+/*
+ * set_mix: custom workload given as the "get:update:del" percentages.
+ */
+static void
+set_mix(const char *mix)
+{
+	unsigned g, u, d;
+
+	if (sscanf(mix, "%u:%u:%u", &g, &u, &d) != 3 || g + u + d != 100) {
+		errx(EXIT_FAILURE, "invalid mix '%s'", mix);
+	}
+	memset(&workload, 0, sizeof(workload));
+	workload.name = mix;
+	workload.pct[OP_GET] = g;
+	workload.pct[OP_UPDATE] = u;
+	workload.pct[OP_DEL] = d;
+}
+
+static unsigned
+parse_list(char *list, const char **items, unsigned max)
+{
+	char *saveptr = NULL, *s;
+	unsigned n = 0;
+
+	for (s = strtok_r(list, ",", &saveptr); s;
+	    s = strtok_r(NULL, ",", &saveptr)) {
+		if (n == max) {
+			errx(EXIT_FAILURE, "too many list items");
+		}
+		items[n++] = s;
+	}
+	return n;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+	    "Usage: %s [-b backends] [-t threads] [-k keylen] [-n nkeys]\n"
+	    "\t[-w workload | -m get:update:del] [-z theta] [-d seconds]\n"
+	    "\t[-s nshards] [-r rate | -p]\n\n"
+	    "\t-b\tcomma-separated list of: thmap, thmap-huge, mutex, sharded\n"
+	    "\t\t(default: thmap, mutex, sharded)\n"
+	    "\t-t\tcomma-separated list of the thread counts\n"
+	    "\t\t(default: powers of two up to the number of CPUs)\n"
+	    "\t-k\tkey length in bytes, %u to %u (default %u)\n"
+	    "\t-n\tnumber of the pre-loaded keys (default %" PRIu64 ")\n"
+	    "\t-w\tYCSB-style workload: A to F (default A)\n"
+	    "\t-m\tcustom operation mix, in percent\n"
+	    "\t-z\tZipfian key choice with the given theta, e.g. 0.99\n"
+	    "\t\t(default: uniform)\n"
+	    "\t-d\tduration of each run in seconds (default %u)\n"
+	    "\t-s\tnumber of shards of the sharded table (default %u)\n"
+	    "\t-r\topen-loop latency mode: total operations per second\n"
+	    "\t-p\thardware counters per get/put/del operation\n",
+	    prog, MIN_KEYLEN, MAX_KEYLEN, keylen, nkeys, nseconds, nshards);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *bnames[__arraycount(backends)], *tnames[MAX_THREADS];
+	char defbackends[] = "thmap,mutex,sharded", *blist = defbackends;
+	char deftlist[256], *tlist = deftlist;
+	unsigned nbackends, ntlist, ncpu, op = 0, len = 0;
+	int ch;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	for (unsigned n = 1; n < ncpu; n *= 2) {
+		len += sprintf(deftlist + len, "%u,", n);
+	}
+	sprintf(deftlist + len, "%u", ncpu);
+	set_workload("A");
+
+	while ((ch = getopt(argc, argv, "b:t:k:n:w:m:z:d:s:r:p")) != -1) {
+		switch (ch) {
+		case 'b':
+			blist = optarg;
+			break;
+		case 't':
+			tlist = optarg;
+			break;
+		case 'k':
+			keylen = atoi(optarg);
+			break;
+		case 'n':
+			nkeys = strtoull(optarg, NULL, 10);
+			break;
+		case 'w':
+			set_workload(optarg);
+			break;
+		case 'm':
+			set_mix(optarg);
+			break;
+		case 'z':
+			zipf_theta = atof(optarg);
+			break;
+		case 'd':
+			nseconds = atoi(optarg);
+			break;
+		case 's':
+			nshards = atoi(optarg);
+			break;
+		case 'r':
+			rate = strtoull(optarg, NULL, 10);
+			break;
+		case 'p':
+			pmc_mode = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (keylen < MIN_KEYLEN || keylen > MAX_KEYLEN || !nkeys ||
+	    !nseconds || !nshards || zipf_theta < 0 || zipf_theta >= 1 ||
+	    (rate && pmc_mode)) {
+		usage(argv[0]);
+	}
+	nbackends = parse_list(blist, bnames, __arraycount(bnames));
+	ntlist = parse_list(tlist, tnames, __arraycount(tnames));
+
+	for (unsigned i = 0; i < OP_COUNT; i++) {
+		op += workload.pct[i];
+		op_cdf[i] = op;
+	}
+	if (zipf_theta != 0) {
+		zipf_init(&zipf, nkeys, zipf_theta);
+	}
+
+	if (pmc_mode) {
+		puts("backend,keylen,nkeys,threads,op,count,cycles,"
+		    "instructions,l1d_misses,llc_misses,dtlb_misses,"
+		    "branch_misses");
+	} else if (rate) {
+		puts("backend,workload,dist,keylen,nkeys,threads,rate,"
+		    "ops/sec,op,count,mean_us,p50_us,p90_us,p99_us,"
+		    "p99.9_us,p99.99_us,max_us");
+	} else {
+		puts("backend,workload,dist,keylen,nkeys,threads,"
+		    "ops/sec,speedup");
+	}
+	for (unsigned b = 0; b < nbackends; b++) {
+		double base = 0;
+
+		backend = NULL;
+		for (unsigned i = 0; i < __arraycount(backends); i++) {
+			if (strcmp(backends[i].name, bnames[b]) == 0)
+				backend = &backends[i];
+		}
+		if (backend == NULL) {
+			errx(EXIT_FAILURE, "unknown backend '%s'", bnames[b]);
+		}
+		for (unsigned t = 0; t < ntlist; t++) {
+			const unsigned nthreads = atoi(tnames[t]);
+			double ops;
+
+			if (nthreads == 0 || nthreads > MAX_THREADS) {
+				errx(EXIT_FAILURE, "invalid thread count");
+			}
+			ops = run_bench(nthreads);
+			if (rate || pmc_mode) {
+				continue;
+			}
+			if (base == 0) {
+				base = ops;
+			}
+			printf("%s,%s,%s,%u,%" PRIu64 ",%u,%.0f,%.2f\n",
+			    backend->name, workload.name,
+			    zipf_theta ? "zipf" : "uniform", keylen, nkeys,
+			    nthreads, ops, ops / base);
+			fflush(stdout);
+		}
+	}
+	return 0;
+}
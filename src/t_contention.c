@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2018 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Lock contention benchmark: many writers hammering a small set of keys
+ * (hence a few hot intermediate nodes), by default with more threads than
+ * CPUs.  Compares the spinning node locks against THMAP_PARKLOCK.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <err.h>
+
+#include "thmap.h"
+#include "utils.h"
+
+static thmap_t *		map;
+static pthread_barrier_t	barrier;
+static atomic_bool		stop;
+
+static unsigned			nworkers;
+static unsigned			nkeys = 64;
+static unsigned			nseconds = 3;
+
+static uint64_t *		nops;
+
+static unsigned long
+fast_random(void)
+{
+	static __thread uint32_t fast_random_seed = 5381;
+	uint32_t x = fast_random_seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	fast_random_seed = x;
+	return x;
+}
+
+static void *
+contend_writers(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	uint64_t n = 0;
+
+	pthread_barrier_wait(&barrier);
+	while (!atomic_load_relaxed(&stop)) {
+		const uint64_t key = fast_random() % nkeys;
+		void *keyval = (void *)(uintptr_t)(key + 1);
+
+		if (fast_random() & 1) {
+			thmap_put(map, &key, sizeof(key), keyval);
+		} else {
+			thmap_del(map, &key, sizeof(key));
+		}
+		n++;
+	}
+	nops[id] = n;
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static void
+run_bench(const char *name, unsigned flags)
+{
+	pthread_t *thr;
+	uint64_t total = 0;
+
+	map = thmap_create(0, NULL, flags);
+	if (map == NULL) {
+		err(EXIT_FAILURE, "thmap_create");
+	}
+	thr = calloc(nworkers, sizeof(pthread_t));
+	nops = calloc(nworkers, sizeof(uint64_t));
+	pthread_barrier_init(&barrier, NULL, nworkers + 1);
+	atomic_store_relaxed(&stop, false);
+
+	for (unsigned i = 0; i < nworkers; i++) {
+		if ((errno = pthread_create(&thr[i], NULL,
+		    contend_writers, (void *)(uintptr_t)i)) != 0) {
+			err(EXIT_FAILURE, "pthread_create");
+		}
+	}
+	pthread_barrier_wait(&barrier);
+	sleep(nseconds);
+	atomic_store_relaxed(&stop, true);
+
+	for (unsigned i = 0; i < nworkers; i++) {
+		pthread_join(thr[i], NULL);
+		total += nops[i];
+	}
+	printf("%s,%u,%u,%" PRIu64 "\n", name, nworkers, nkeys,
+	    total / nseconds);
+
+	for (uint64_t key = 0; key < nkeys; key++) {
+		thmap_del(map, &key, sizeof(key));
+	}
+	pthread_barrier_destroy(&barrier);
+	thmap_destroy(map);
+	free(nops);
+	free(thr);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+	    "Usage: %s [-t nthreads] [-k nkeys] [-d seconds]\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch;
+
+	/* By default, oversubscribe the CPUs four times. */
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN) * 4;
+
+	while ((ch = getopt(argc, argv, "t:k:d:")) != -1) {
+		switch (ch) {
+		case 't':
+			nworkers = atoi(optarg);
+			break;
+		case 'k':
+			nkeys = atoi(optarg);
+			break;
+		case 'd':
+			nseconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!nworkers || !nkeys || !nseconds) {
+		usage(argv[0]);
+	}
+
+	puts("lock,threads,keys,ops/sec");
+	run_bench("spin", 0);
+	run_bench("park", THMAP_PARKLOCK);
+	return 0;
+}
@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2018 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cinttypes>
+#include <cassert>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdexcept>
+
+#include "thmap.hpp"
+
+struct point {
+	uint32_t	x;
+	uint32_t	y;
+};
+
+struct pair_value {
+	uint64_t	a;
+	uint64_t	b;
+};
+
+static_assert(thmapxx::value_codec<int>::is_inline);
+static_assert(thmapxx::value_codec<const char *>::is_pointer);
+static_assert(thmapxx::value_codec<uint64_t>::is_leaf);
+static_assert(thmapxx::value_codec<double>::is_leaf);
+static_assert(thmapxx::value_codec<pair_value>::is_leaf);
+static_assert(thmapxx::value_codec<std::string>::is_boxed);
+static_assert(thmapxx::is_fixed_key_v<point>);
+static_assert(!thmapxx::is_fixed_key_v<std::string>);
+
+static void
+test_inline(void)
+{
+	thmapxx::map<uint64_t, int> m;
+
+	assert(!m.get(1));
+	assert(m.put(1, 0) == 0);
+	assert(m.put(1, 5) == 0);	// already present
+	assert(m.get(1) == 0);		// zero is stored, not "missing"
+	assert(m.put(2, -7) == -7);
+	assert(m.get(2) == -7);
+	assert(m.contains(2));
+	assert(m.size() == 2 && m.size(true) == 2);
+
+	assert(m.erase(1) == 0);
+	assert(!m.erase(1));
+	assert(!m.get(1));
+	assert(m.get(2) == -7);
+}
+
+static void
+test_leaf(void)
+{
+	thmapxx::map<uint32_t, uint64_t> m;
+	thmapxx::map<uint32_t, double> d;
+
+	/* Pointer-sized values, including zero, with no boxing. */
+	assert(m.put(1, 0) == 0);
+	assert(m.put(2, UINT64_MAX) == UINT64_MAX);
+	assert(m.put(2, 5) == UINT64_MAX);	// already present
+	assert(m.get(1) == 0 && m.get(2) == UINT64_MAX);
+	assert(m.erase(2) == UINT64_MAX);
+	assert(!m.get(2));
+
+	assert(d.put(1, -0.5) == -0.5);
+	assert(d.get(1) == -0.5);
+	d.for_each([](uint32_t key, double val) {
+		assert(key == 1 && val == -0.5);
+	});
+}
+
+static void
+test_struct(void)
+{
+	thmapxx::map<point, pair_value> m;
+
+	for (uint32_t i = 0; i < 1000; i++) {
+		const point p = { i, i * 2 };
+		const pair_value v = { i, UINT64_MAX - i };
+
+		assert(m.put(p, v).a == i);
+	}
+	for (uint32_t i = 0; i < 1000; i++) {
+		const point p = { i, i * 2 };
+		auto v = m.get(p);
+
+		assert(v && v->a == i && v->b == UINT64_MAX - i);
+		if (i & 1) {
+			assert(m.erase(p)->b == UINT64_MAX - i);
+		}
+	}
+	m.gc(m.stage_gc());
+	for (uint32_t i = 0; i < 1000; i++) {
+		const point p = { i, i * 2 };
+		assert(m.contains(p) == !(i & 1));
+	}
+	/* The remaining entries are reclaimed by the destructor. */
+}
+
+static void
+test_strings(void)
+{
+	static const char *vals[] = { "zero", "one", "two" };
+	thmapxx::map<std::string, const char *> m;
+	unsigned n = 0;
+
+	for (unsigned i = 0; i < 3; i++) {
+		assert(m.put("key-" + std::to_string(i), vals[i]) == vals[i]);
+	}
+	assert(m.get("key-1") == vals[1]);
+	assert(!m.get("key-3"));
+
+	m.for_each([&](const std::string &key, const char *val) {
+		assert(key == std::string("key-") + (val == vals[0] ? "0" :
+		    val == vals[1] ? "1" : "2"));
+		n++;
+	});
+	assert(n == 3);
+
+	m.clear();
+	assert(!m.get("key-0"));
+	n = 0;
+	m.for_each([&](const std::string &, const char *) { n++; });
+	assert(n == 0);
+}
+
+static void
+test_move(void)
+{
+	thmapxx::map<uint32_t, std::string> m1;
+
+	m1.put(1, "one");
+	thmapxx::map<uint32_t, std::string> m2(std::move(m1));
+	assert(m1.native_handle() == nullptr);
+	assert(m2.get(1) == "one");
+
+	thmapxx::map<uint32_t, std::string> m3;
+	m3.put(2, "two");
+	m3 = std::move(m2);
+	assert(m3.get(1) == "one");
+	assert(!m3.get(2));
+}
+
+#if defined(THMAPXX_COROUTINES)
+
+using async_map = thmapxx::map<uint32_t, uint32_t *>;
+
+/*
+ * A "request handler" composing two lookups.
+ */
+static thmapxx::task<unsigned>
+sum_pair(const async_map &m, uint32_t a, uint32_t b)
+{
+	auto va = co_await m.get_async(a);
+	auto vb = co_await m.get_async(b);
+	co_return (va ? **va : 0) + (vb ? **vb : 0);
+}
+
+static thmapxx::task<>
+throw_after(const async_map &m)
+{
+	(void)co_await m.get_async(0);
+	throw std::runtime_error("test");
+}
+
+static void
+test_coroutines(void)
+{
+	constexpr unsigned nitems = 4096, ntasks = 32;
+	static uint32_t vals[nitems];
+	thmapxx::scheduler sched;
+	async_map m;
+
+	for (uint32_t i = 0; i < nitems; i++) {
+		vals[i] = i;
+		if (i % 4) {
+			m.put(i, &vals[i]);
+		}
+	}
+
+	/* Interleave the independent lookups. */
+	for (uint32_t i = 0; i < nitems; i += ntasks) {
+		std::vector<thmapxx::task<std::optional<uint32_t *>>> tasks;
+
+		for (uint32_t j = 0; j < ntasks; j++) {
+			tasks.push_back(m.get_async(i + j));
+		}
+		for (auto &t : tasks) {
+			sched.spawn(t);
+		}
+		assert(sched.pending() == ntasks);
+		sched.run();
+		assert(sched.pending() == 0);
+
+		for (uint32_t j = 0; j < ntasks; j++) {
+			auto v = tasks[j].result();
+			assert(v.has_value() == (((i + j) % 4) != 0));
+			assert(!v || **v == i + j);
+		}
+	}
+
+	/* Nested tasks. */
+	std::vector<thmapxx::task<unsigned>> sums;
+	for (uint32_t i = 0; i < ntasks; i++) {
+		sums.push_back(sum_pair(m, i, i + 1));
+	}
+	for (auto &t : sums) {
+		sched.spawn(t);
+	}
+	sched.run();
+	for (uint32_t i = 0; i < ntasks; i++) {
+		const unsigned a = (i % 4) ? i : 0;
+		const unsigned b = ((i + 1) % 4) ? i + 1 : 0;
+		assert(sums[i].result() == a + b);
+	}
+
+	/* Exceptions propagate to the result. */
+	auto t = throw_after(m);
+	sched.spawn(t);
+	sched.run();
+	try {
+		t.result();
+		assert(false);
+	} catch (const std::runtime_error &) {
+	}
+	m.clear();
+}
+
+#endif
+
+int
+main(void)
+{
+	test_inline();
+	test_leaf();
+	test_struct();
+	test_strings();
+	test_move();
+#if defined(THMAPXX_COROUTINES)
+	test_coroutines();
+#endif
+	puts("ok");
+	return 0;
+}
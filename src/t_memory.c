@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2018 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Memory efficiency benchmark: builds the maps for a range of key lengths
+ * and key counts, using the counting allocation functions, and reports
+ * the bytes per key:
+ *
+ * - inodes, leaves, keys: the memory requested for the intermediate nodes,
+ *   the leaves and the key copies (as per thmap_memory_usage);
+ * - root: the root level;
+ * - overhead: the allocator overhead, i.e. the difference between the
+ *   usable size of the allocations plus the chunk header and the requested
+ *   size (malloc_usable_size(3); the header size is a glibc estimate).
+ *   Without glibc, the usable size is taken to be the requested size;
+ * - total: the sum of the above;
+ * - minimum: the theoretical minimum, i.e. the key and the value pointer;
+ * - heap, frag: the memory held by malloc since the start of the run and
+ *   the percentage of it which is free (fragmentation), if mallinfo2(3)
+ *   is available.
+ *
+ * Each configuration runs in a separate process, so that it starts with
+ * a fresh heap, and is measured after the build, after the insert/delete
+ * churn (deleting a random fraction of the keys and inserting the same
+ * number of new ones, repeatedly) and after thmap_compact().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <err.h>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#define	HAVE_MALLOC_USABLE_SIZE
+#if __GLIBC_PREREQ(2, 33)
+#define	HAVE_MALLINFO2
+#endif
+#endif
+
+#include "thmap.h"
+#include "utils.h"
+
+#define	MIN_KEYLEN	8
+#define	MAX_KEYLEN	512
+#define	MAX_LIST	32
+#define	MALLOC_HDR	sizeof(size_t)
+
+static uint64_t		alloc_bytes;
+static uint64_t		alloc_usable;
+static uint64_t		alloc_count;
+
+#if defined(HAVE_MALLINFO2)
+static struct mallinfo2	heap_base;
+#endif
+
+static unsigned		churn_rounds = 4;
+static unsigned		churn_pct = 50;
+
+static size_t
+usable_size(void *p, size_t len)
+{
+#if defined(HAVE_MALLOC_USABLE_SIZE)
+	(void)len;
+	return malloc_usable_size(p);
+#else
+	(void)p;
+	return len;
+#endif
+}
+
+static uintptr_t
+alloc_count_wrapper(size_t len)
+{
+	void *p = malloc(len);
+
+	if (p) {
+		alloc_bytes += len;
+		alloc_usable += usable_size(p, len);
+		alloc_count++;
+	}
+	return (uintptr_t)p;
+}
+
+static void
+free_count_wrapper(uintptr_t addr, size_t len)
+{
+	void *p = (void *)addr;
+
+	alloc_bytes -= len;
+	alloc_usable -= usable_size(p, len);
+	alloc_count--;
+	free(p);
+}
+
+static const thmap_ops_t thmap_count_ops = {
+	.alloc = alloc_count_wrapper,
+	.free = free_count_wrapper
+};
+
+static uint64_t
+fast_random(void)
+{
+	static uint64_t fast_random_seed = 5381;
+	uint64_t x = fast_random_seed;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	fast_random_seed = x;
+	return x;
+}
+
+static const void *
+key_make(uint8_t *key, uint64_t id)
+{
+	memcpy(key, &id, sizeof(id));
+	return key;
+}
+
+static void
+report(thmap_t *map, unsigned keylen, uint64_t nkeys, const char *phase)
+{
+	const double n = nkeys;
+	thmap_memusage_t mu;
+	uint64_t used, root, overhead;
+
+	used = thmap_memory_usage(map, &mu);
+	root = alloc_bytes - used;
+	overhead = alloc_usable + alloc_count * MALLOC_HDR - alloc_bytes;
+
+	printf("%u,%" PRIu64 ",%s,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f",
+	    keylen, nkeys, phase, mu.inodes / n, mu.leaves / n, mu.keys / n,
+	    root / n, overhead / n, (alloc_bytes + overhead) / n,
+	    (double)(keylen + sizeof(void *)));
+#if defined(HAVE_MALLINFO2)
+	{
+		const struct mallinfo2 mi = mallinfo2();
+		const double heap = (double)(mi.arena + mi.hblkhd) -
+		    (double)(heap_base.arena + heap_base.hblkhd);
+		const double nfree = (double)mi.fordblks - heap_base.fordblks;
+
+		printf(",%.1f,%.1f\n", heap / n,
+		    heap > 0 ? 100.0 * MAX(nfree, 0) / heap : 0);
+	}
+#else
+	printf(",,\n");
+#endif
+}
+
+static void
+run_config(unsigned keylen, uint64_t nkeys)
+{
+	void *val = (void *)(uintptr_t)0x1;
+	uint8_t key[MAX_KEYLEN];
+	uint64_t *ids, next_id = 0;
+	thmap_t *map;
+
+	memset(key, 0xa5, sizeof(key));
+	if ((ids = malloc(nkeys * sizeof(uint64_t))) == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+#if defined(HAVE_MALLINFO2)
+	heap_base = mallinfo2();
+#endif
+	map = thmap_create(0, &thmap_count_ops, 0);
+	if (map == NULL) {
+		err(EXIT_FAILURE, "thmap_create");
+	}
+
+	/* Build. */
+	for (uint64_t i = 0; i < nkeys; i++) {
+		ids[i] = next_id++;
+		thmap_put(map, key_make(key, ids[i]), keylen, val);
+	}
+	report(map, keylen, nkeys, "build");
+
+	/* Churn: replace a random fraction of the keys. */
+	for (unsigned r = 0; r < churn_rounds; r++) {
+		const uint64_t n = nkeys * churn_pct / 100;
+
+		for (uint64_t i = 0; i < n; i++) {
+			const uint64_t slot = fast_random() % nkeys;
+
+			thmap_del(map, key_make(key, ids[slot]), keylen);
+			ids[slot] = next_id++;
+			thmap_put(map, key_make(key, ids[slot]), keylen, val);
+		}
+		thmap_gc(map, thmap_stage_gc(map));
+	}
+	report(map, keylen, nkeys, "churn");
+
+	/* Compaction (the old structure is reclaimed). */
+	if (thmap_compact(map) == 0) {
+		thmap_gc(map, thmap_stage_gc(map));
+		report(map, keylen, nkeys, "compact");
+	}
+
+	for (uint64_t i = 0; i < nkeys; i++) {
+		thmap_del(map, key_make(key, ids[i]), keylen);
+	}
+	thmap_gc(map, thmap_stage_gc(map));
+	thmap_destroy(map);
+	free(ids);
+}
+
+static unsigned
+parse_list(char *list, uint64_t *items)
+{
+	char *saveptr = NULL, *s;
+	unsigned n = 0;
+
+	for (s = strtok_r(list, ",", &saveptr); s;
+	    s = strtok_r(NULL, ",", &saveptr)) {
+		if (n == MAX_LIST) {
+			errx(EXIT_FAILURE, "too many list items");
+		}
+		items[n++] = strtoull(s, NULL, 10);
+	}
+	return n;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+	    "Usage: %s [-k keylens] [-n nkeys] [-c rounds] [-f percent]\n\n"
+	    "\t-k\tcomma-separated list of the key lengths, %u to %u\n"
+	    "\t-n\tcomma-separated list of the key counts\n"
+	    "\t-c\tnumber of the churn rounds (default %u)\n"
+	    "\t-f\tpercentage of the keys replaced per round (default %u)\n",
+	    prog, MIN_KEYLEN, MAX_KEYLEN, churn_rounds, churn_pct);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	char defkeylens[] = "8,16,32,64,128,256,512";
+	char defnkeys[] = "1000,100000,1000000";
+	char *klist = defkeylens, *nlist = defnkeys;
+	uint64_t keylens[MAX_LIST], nkeys[MAX_LIST];
+	unsigned nkl, nnk;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "k:n:c:f:")) != -1) {
+		switch (ch) {
+		case 'k':
+			klist = optarg;
+			break;
+		case 'n':
+			nlist = optarg;
+			break;
+		case 'c':
+			churn_rounds = atoi(optarg);
+			break;
+		case 'f':
+			churn_pct = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	nkl = parse_list(klist, keylens);
+	nnk = parse_list(nlist, nkeys);
+	if (churn_pct > 100) {
+		usage(argv[0]);
+	}
+	for (unsigned i = 0; i < nkl; i++) {
+		if (keylens[i] < MIN_KEYLEN || keylens[i] > MAX_KEYLEN) {
+			usage(argv[0]);
+		}
+	}
+
+	puts("keylen,nkeys,phase,inodes,leaves,keys,root,overhead,total,"
+	    "minimum,heap,frag_pct");
+	for (unsigned i = 0; i < nkl; i++) {
+		for (unsigned j = 0; j < nnk; j++) {
+			pid_t pid;
+			int status;
+
+			if (nkeys[j] == 0) {
+				continue;
+			}
+			fflush(stdout);
+			if ((pid = fork()) == -1) {
+				err(EXIT_FAILURE, "fork");
+			}
+			if (pid == 0) {
+				run_config(keylens[i], nkeys[j]);
+				fflush(stdout);
+				_exit(EXIT_SUCCESS);
+			}
+			if (waitpid(pid, &status, 0) == -1 ||
+			    !WIFEXITED(status) || WEXITSTATUS(status)) {
+				errx(EXIT_FAILURE, "run failed");
+			}
+		}
+	}
+	return 0;
+}
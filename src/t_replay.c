@@ -0,0 +1,387 @@
+/*
+ * Copyright (c) 2018 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Trace replay benchmark: re-runs the operations captured by the
+ * thmap_trace wrapper library against thmap, using N threads, either at
+ * full speed or with the original pacing.
+ *
+ * - The operations of a traced thread are replayed in their order by the
+ *   same replay thread (the traced thread ID modulo N).
+ *
+ * - With the original pacing (-p), each operation is issued at its
+ *   original time offset since the start of the trace; the lag behind
+ *   the schedule is reported.
+ *
+ * - The map state at the start of the capture is unknown, so the replay
+ *   starts with an empty map, optionally pre-loaded with all keys which
+ *   appear in the trace (-l).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+
+#include "thmap.h"
+#include "utils.h"
+#include "trace.h"
+
+#define	MAX_THREADS	1024
+#define	GC_INTERVAL_MS	10
+
+typedef struct {
+	uint64_t	ts;	// time since the start of the trace (ns)
+	uint64_t	seq;
+	uint32_t	tid;
+	uint32_t	len;
+	unsigned	op;
+	const uint8_t *	key;
+} trace_rec_t;
+
+typedef struct {
+	atomic_uint_fast64_t	qs;
+	atomic_bool		done;
+	trace_rec_t *		recs;
+	uint64_t		nrecs;
+	uint64_t		nops[TRACE_OP_DEL + 1];
+	uint64_t		max_lag;
+} __aligned(CACHE_LINE_SIZE) replayer_t;
+
+static thmap_t *		map;
+static pthread_barrier_t	barrier;
+static replayer_t *		replayers;
+static unsigned			nworkers;
+static bool			paced;
+static uint64_t			start_ns;
+
+static uint64_t
+clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+rec_cmp(const void *p1, const void *p2)
+{
+	const trace_rec_t *r1 = p1, *r2 = p2;
+
+	if (r1->ts != r2->ts) {
+		return r1->ts < r2->ts ? -1 : 1;
+	}
+	return r1->seq < r2->seq ? -1 : (r1->seq > r2->seq);
+}
+
+/*
+ * trace_load: map the trace file and decode the records, sorted by time
+ * (the keys point into the mapping).
+ */
+static trace_rec_t *
+trace_load(const char *path, uint64_t *nrecsp)
+{
+	const uint8_t *p, *end;
+	trace_rec_t *recs = NULL;
+	uint64_t nrecs = 0, cap = 0, tbase = UINT64_MAX;
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		err(EXIT_FAILURE, "%s", path);
+	}
+	if ((size_t)st.st_size < TRACE_MAGIC_LEN) {
+		errx(EXIT_FAILURE, "%s: not a trace file", path);
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(EXIT_FAILURE, "mmap");
+	}
+	close(fd);
+	end = p + st.st_size;
+
+	if (memcmp(p, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+		errx(EXIT_FAILURE, "%s: not a trace file", path);
+	}
+	p += TRACE_MAGIC_LEN;
+
+	while (p < end) {
+		const uint8_t *cend;
+		trace_chunk_t hdr;
+		uint64_t ts;
+
+		if ((size_t)(end - p) < sizeof(hdr)) {
+			errx(EXIT_FAILURE, "truncated chunk header");
+		}
+		memcpy(&hdr, p, sizeof(hdr));
+		p += sizeof(hdr);
+		if ((size_t)(end - p) < hdr.len) {
+			errx(EXIT_FAILURE, "truncated chunk");
+		}
+		cend = p + hdr.len;
+		ts = hdr.base;
+		tbase = MIN(tbase, hdr.base);
+
+		while (p < cend) {
+			uint64_t delta, len;
+			trace_rec_t *r;
+			size_t n;
+
+			if ((n = trace_getv(p, cend, &delta)) == 0 ||
+			    p + n >= cend) {
+				errx(EXIT_FAILURE, "malformed record");
+			}
+			p += n;
+			if (nrecs == cap) {
+				cap = cap ? cap * 2 : 1024;
+				recs = realloc(recs, cap * sizeof(trace_rec_t));
+				if (recs == NULL) {
+					err(EXIT_FAILURE, "realloc");
+				}
+			}
+			r = &recs[nrecs];
+			r->op = *p++;
+			if ((n = trace_getv(p, cend, &len)) == 0 ||
+			    len > (uint64_t)(cend - p - n) ||
+			    r->op < TRACE_OP_GET || r->op > TRACE_OP_DEL) {
+				errx(EXIT_FAILURE, "malformed record");
+			}
+			p += n;
+			ts += delta;
+			r->ts = ts;
+			r->seq = nrecs++;
+			r->tid = hdr.tid;
+			r->len = len;
+			r->key = p;
+			p += len;
+		}
+	}
+	for (uint64_t i = 0; i < nrecs; i++) {
+		recs[i].ts -= tbase;
+	}
+	qsort(recs, nrecs, sizeof(trace_rec_t), rec_cmp);
+	*nrecsp = nrecs;
+	return recs;
+}
+
+static void *
+replay_worker(void *arg)
+{
+	replayer_t *rp = arg;
+	void *val = (void *)(uintptr_t)0x1;
+
+	pthread_barrier_wait(&barrier);
+	for (uint64_t i = 0; i < rp->nrecs; i++) {
+		const trace_rec_t *r = &rp->recs[i];
+
+		if (paced) {
+			const uint64_t t = start_ns + r->ts;
+			uint64_t now;
+
+			while ((now = clock_ns()) < t) {
+				sched_yield();
+			}
+			rp->max_lag = MAX(rp->max_lag, now - t);
+		}
+		switch (r->op) {
+		case TRACE_OP_GET:
+			(void)thmap_get(map, r->key, r->len);
+			break;
+		case TRACE_OP_PUT:
+			(void)thmap_put(map, r->key, r->len, val);
+			break;
+		case TRACE_OP_DEL:
+			(void)thmap_del(map, r->key, r->len);
+			break;
+		}
+		rp->nops[r->op]++;
+		atomic_store_explicit(&rp->qs, i + 1, memory_order_release);
+	}
+	atomic_store_explicit(&rp->done, true, memory_order_release);
+	pthread_exit(NULL);
+	return NULL;
+}
+
+/*
+ * run_gc: while the workers are running, periodically reclaim the memory
+ * staged for G/C once every worker passes a quiescent state (completes
+ * an operation) or finishes.
+ */
+static void
+run_gc(void)
+{
+	const struct timespec tick = {
+		.tv_sec = 0, .tv_nsec = GC_INTERVAL_MS * 1000 * 1000
+	};
+	uint64_t snap[MAX_THREADS];
+	bool running = true;
+
+	while (running) {
+		void *ref;
+
+		nanosleep(&tick, NULL);
+		ref = thmap_stage_gc(map);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		running = false;
+		for (unsigned i = 0; i < nworkers; i++) {
+			snap[i] = atomic_load_explicit(&replayers[i].qs,
+			    memory_order_acquire);
+		}
+		for (unsigned i = 0; i < nworkers; i++) {
+			replayer_t *rp = &replayers[i];
+
+			while (atomic_load_explicit(&rp->qs,
+			    memory_order_acquire) == snap[i] &&
+			    !atomic_load_explicit(&rp->done,
+			    memory_order_acquire)) {
+				sched_yield();
+			}
+			running |= !atomic_load_relaxed(&rp->done);
+		}
+		thmap_gc(map, ref);
+	}
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+	    "Usage: %s [-t nthreads] [-p] [-l] [-f flags] tracefile\n\n"
+	    "\t-t\tnumber of the replay threads (default: number of CPUs)\n"
+	    "\t-p\treplay with the original pacing (default: full speed)\n"
+	    "\t-l\tpre-load the map with all keys in the trace\n"
+	    "\t-f\tthmap_create() flags, e.g. 0x4 for THMAP_PARKLOCK\n",
+	    prog);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	trace_rec_t *recs;
+	pthread_t *thr;
+	uint64_t nrecs, nops[TRACE_OP_DEL + 1] = { 0 }, max_lag = 0;
+	unsigned flags = 0;
+	bool preload = false;
+	double elapsed;
+	int ch;
+
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((ch = getopt(argc, argv, "t:plf:")) != -1) {
+		switch (ch) {
+		case 't':
+			nworkers = atoi(optarg);
+			break;
+		case 'p':
+			paced = true;
+			break;
+		case 'l':
+			preload = true;
+			break;
+		case 'f':
+			flags = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind + 1 != argc || !nworkers || nworkers > MAX_THREADS ||
+	    (flags & THMAP_NOCOPY)) {
+		usage(argv[0]);
+	}
+	recs = trace_load(argv[optind], &nrecs);
+
+	/*
+	 * Distribute the records to the replay threads, preserving the
+	 * order.
+	 */
+	replayers = aligned_alloc(CACHE_LINE_SIZE,
+	    nworkers * sizeof(replayer_t));
+	thr = calloc(nworkers, sizeof(pthread_t));
+	if (replayers == NULL || thr == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	memset(replayers, 0, nworkers * sizeof(replayer_t));
+	for (uint64_t i = 0; i < nrecs; i++) {
+		replayers[recs[i].tid % nworkers].nrecs++;
+	}
+	for (unsigned i = 0; i < nworkers; i++) {
+		replayer_t *rp = &replayers[i];
+
+		rp->recs = malloc(MAX(rp->nrecs, 1) * sizeof(trace_rec_t));
+		if (rp->recs == NULL) {
+			err(EXIT_FAILURE, "malloc");
+		}
+		rp->nrecs = 0;
+	}
+	for (uint64_t i = 0; i < nrecs; i++) {
+		replayer_t *rp = &replayers[recs[i].tid % nworkers];
+		rp->recs[rp->nrecs++] = recs[i];
+	}
+
+	if ((map = thmap_create(0, NULL, flags)) == NULL) {
+		err(EXIT_FAILURE, "thmap_create");
+	}
+	if (preload) {
+		for (uint64_t i = 0; i < nrecs; i++) {
+			thmap_put(map, recs[i].key, recs[i].len,
+			    (void *)(uintptr_t)0x1);
+		}
+	}
+
+	pthread_barrier_init(&barrier, NULL, nworkers + 1);
+	for (unsigned i = 0; i < nworkers; i++) {
+		if ((errno = pthread_create(&thr[i], NULL,
+		    replay_worker, &replayers[i])) != 0) {
+			err(EXIT_FAILURE, "pthread_create");
+		}
+	}
+	start_ns = clock_ns();
+	pthread_barrier_wait(&barrier);
+	run_gc();
+
+	for (unsigned i = 0; i < nworkers; i++) {
+		replayer_t *rp = &replayers[i];
+
+		pthread_join(thr[i], NULL);
+		for (unsigned op = TRACE_OP_GET; op <= TRACE_OP_DEL; op++) {
+			nops[op] += rp->nops[op];
+		}
+		max_lag = MAX(max_lag, rp->max_lag);
+		free(rp->recs);
+	}
+	elapsed = (clock_ns() - start_ns) / 1e9;
+	pthread_barrier_destroy(&barrier);
+
+	puts("threads,mode,ops,get,put,del,seconds,ops/sec,max_lag_us");
+	printf("%u,%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+	    ",%.3f,%.0f,%.2f\n", nworkers, paced ? "paced" : "full",
+	    nrecs, nops[TRACE_OP_GET], nops[TRACE_OP_PUT], nops[TRACE_OP_DEL],
+	    elapsed, nrecs / elapsed, max_lag / 1000.0);
+
+	/* The map must be empty before the destruction. */
+	for (uint64_t i = 0; i < nrecs; i++) {
+		thmap_del(map, recs[i].key, recs[i].len);
+	}
+	thmap_destroy(map);
+	free(replayers);
+	free(thr);
+	free(recs);
+	return 0;
+}
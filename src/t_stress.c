@@ -7,8 +7,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <pthread.h>
 #include <time.h>
 #include <limits.h>
@@ -24,6 +26,14 @@
 static thmap_t *		map;
 static pthread_barrier_t	barrier;
 static unsigned			nworkers;
+static size_t			map_vlen;
+
+#define	NUMA_TEST_NODES		4
+#define	NUMA_TEST_TOPOLOGY	"0;1;2;3"
+
+#define	CACHE_TEST_ITEMS	64
+
+static void *			(*worker_func)(void *);
 
 static uint64_t			c_keys[4];
 static unsigned			thmap_alloc_count;
@@ -248,14 +258,425 @@ fuzz_multi_512(void *arg)
 	return fuzz_multi(arg, 0x1ff);
 }
 
+/*
+ * Arena allocating top-down (and never reusing the memory), so that each
+ * new allocation has a lower address and every relocation attempt of the
+ * defragmentation succeeds.
+ */
+#define	ARENA_SIZE	(1UL << 30)
+
+static uintptr_t		arena_base;
+static _Atomic uintptr_t	arena_top;
+
+static uintptr_t
+alloc_arena_wrapper(size_t len)
+{
+	len = roundup2(len, sizeof(void *));
+	return atomic_fetch_sub(&arena_top, len) - len;
+}
+
 static void
-run_test(void *func(void *))
+free_arena_wrapper(uintptr_t addr, size_t len)
+{
+	CHECK_TRUE(addr >= arena_base && addr + len <= arena_base + ARENA_SIZE);
+}
+
+static const thmap_ops_t thmap_arena_ops = {
+	.alloc = alloc_arena_wrapper,
+	.free = free_arena_wrapper
+};
+
+static void
+arena_init(void)
+{
+	void *p = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+
+	if (p == MAP_FAILED) {
+		err(EXIT_FAILURE, "mmap");
+	}
+	arena_base = (uintptr_t)p;
+	arena_top = arena_base + ARENA_SIZE;
+}
+
+static void
+arena_fini(void)
+{
+	munmap((void *)arena_base, ARENA_SIZE);
+}
+
+static void *
+fuzz_defrag(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 200 * 1000;
+
+	pthread_barrier_wait(&barrier);
+	while (n--) {
+		uint64_t key = fast_random() & 0x1ff;
+		void *keyval = (void *)(uintptr_t)key;
+		void *val;
+
+		/*
+		 * The primary thread also performs the defragmentation
+		 * and walks the structure.
+		 */
+		if (id == 0 && (n & 0x3) == 0) {
+			thmap_defrag(map, 4);
+		}
+		if (id == 0 && (n & 0x3ff) == 0) {
+			thmap_structure_t st;
+
+			thmap_stat_structure(map, &st);
+			CHECK_TRUE(st.leaves <= 0x200);
+		}
+
+		switch (fast_random() & 3) {
+		case 0:
+		case 1: // ~50% lookups
+			val = thmap_get(map, &key, sizeof(key));
+			CHECK_TRUE(!val || val == keyval);
+			break;
+		case 2:
+			val = thmap_put(map, &key, sizeof(key), keyval);
+			CHECK_TRUE(val == keyval);
+			break;
+		case 3:
+			val = thmap_del(map, &key, sizeof(key));
+			CHECK_TRUE(!val || val == keyval);
+			break;
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) for (uint64_t key = 0; key <= 0x1ff; key++) {
+		thmap_del(map, &key, sizeof(key));
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+/*
+ * fuzz_counters: concurrent increments of the inline counters, with the
+ * defragmentation relocating them; no increment may be lost.
+ */
+static void *
+fuzz_counters(void *arg)
+{
+	const unsigned id = (uintptr_t)arg, nops = 100 * 1000;
+	int64_t val, total = 0;
+
+	pthread_barrier_wait(&barrier);
+	for (unsigned n = 0; n < nops; n++) {
+		uint64_t key = fast_random() & 0x3f;
+
+		if (id == 0 && (n & 0x7) == 0) {
+			thmap_defrag(map, 4);
+		}
+		CHECK_TRUE(thmap_add(map, &key, sizeof(key), 1, &val) == 0);
+		CHECK_TRUE(val > 0);
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) {
+		for (uint64_t key = 0; key <= 0x3f; key++) {
+			if (thmap_get_copy(map, &key, sizeof(key), &val) == 0) {
+				total += val;
+				thmap_del(map, &key, sizeof(key));
+			}
+		}
+		CHECK_TRUE(total == (int64_t)nworkers * nops);
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+/*
+ * fuzz_ttl: the entries with a short TTL, while the primary thread
+ * advances the time and runs the sweeper.
+ */
+static _Atomic uint64_t		ttl_clock;
+
+static void *
+fuzz_ttl(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 200 * 1000;
+
+	pthread_barrier_wait(&barrier);
+	while (n--) {
+		uint64_t key = fast_random() & 0x1ff;
+		void *keyval = (void *)(uintptr_t)key;
+		uint64_t expire;
+		void *val;
+
+		if (id == 0 && (n & 0x3) == 0) {
+			const uint64_t now = atomic_load_relaxed(&ttl_clock);
+
+			atomic_store_relaxed(&ttl_clock, now + 1);
+			thmap_expire(map, now + 1, 8);
+		}
+
+		switch (fast_random() & 3) {
+		case 0:
+		case 1: // ~50% lookups
+			val = thmap_get(map, &key, sizeof(key));
+			CHECK_TRUE(!val || val == keyval);
+			break;
+		case 2:
+			expire = atomic_load_relaxed(&ttl_clock) +
+			    (fast_random() & 0xff) + 1;
+			val = thmap_put_ttl(map, &key, sizeof(key),
+			    keyval, expire);
+			CHECK_TRUE(val == keyval);
+			break;
+		case 3:
+			val = thmap_del(map, &key, sizeof(key));
+			CHECK_TRUE(!val || val == keyval);
+			break;
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) for (uint64_t key = 0; key <= 0x1ff; key++) {
+		thmap_del(map, &key, sizeof(key));
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+/*
+ * fuzz_snapshot: the primary thread takes the snapshots, while the other
+ * workers keep changing the map, and verifies that they do not change.
+ */
+#define	SNAP_KEYS	0x200
+
+typedef struct {
+	thmap_snapshot_t *	snap;
+	uint8_t			seen[SNAP_KEYS];
+	unsigned		count;
+} snap_check_t;
+
+static void
+snap_walk(const void *key, size_t len, void *val, void *arg)
+{
+	snap_check_t *sc = arg;
+	uint64_t k;
+
+	CHECK_TRUE(len == sizeof(k));
+	memcpy(&k, key, sizeof(k));
+	CHECK_TRUE(k < SNAP_KEYS && val == (void *)(uintptr_t)k);
+	CHECK_TRUE(sc->seen[k]++ == 0);
+	sc->count++;
+}
+
+static void
+snap_verify(snap_check_t *sc)
+{
+	snap_check_t check;
+
+	memset(&check, 0, sizeof(check));
+	thmap_snapshot_walk(sc->snap, snap_walk, &check);
+	CHECK_TRUE(check.count == sc->count);
+	CHECK_TRUE(memcmp(check.seen, sc->seen, sizeof(check.seen)) == 0);
+
+	for (uint64_t key = 0; key < SNAP_KEYS; key++) {
+		void *val = thmap_snapshot_get(sc->snap, &key, sizeof(key));
+		void *keyval = sc->seen[key] ? (void *)(uintptr_t)key : NULL;
+
+		CHECK_TRUE(val == keyval);
+	}
+}
+
+static void *
+fuzz_snapshot(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	snap_check_t snaps[2];
+	unsigned n = 200 * 1000, cur = 0;
+
+	memset(snaps, 0, sizeof(snaps));
+	pthread_barrier_wait(&barrier);
+	while (n--) {
+		uint64_t key = fast_random() & (SNAP_KEYS - 1);
+		void *keyval = (void *)(uintptr_t)key;
+		void *val;
+
+		/*
+		 * The primary thread keeps two snapshots: it verifies
+		 * and replaces the older one.
+		 */
+		if (id == 0 && (n & 0xff) == 0) {
+			snap_check_t *sc = &snaps[cur];
+
+			if (sc->snap) {
+				snap_verify(sc);
+				thmap_snapshot_release(sc->snap);
+				memset(sc, 0, sizeof(snap_check_t));
+			}
+			sc->snap = thmap_snapshot_take(map);
+			CHECK_TRUE(sc->snap != NULL);
+			thmap_snapshot_walk(sc->snap, snap_walk, sc);
+			cur ^= 1;
+		}
+
+		switch (fast_random() & 3) {
+		case 0:
+		case 1: // ~50% lookups
+			val = thmap_get(map, &key, sizeof(key));
+			CHECK_TRUE(!val || val == keyval);
+			break;
+		case 2:
+			val = thmap_put(map, &key, sizeof(key), keyval);
+			CHECK_TRUE(val == keyval);
+			break;
+		case 3:
+			val = thmap_del(map, &key, sizeof(key));
+			CHECK_TRUE(!val || val == keyval);
+			break;
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) {
+		for (unsigned i = 0; i < 2; i++) {
+			if (snaps[i].snap) {
+				snap_verify(&snaps[i]);
+				thmap_snapshot_release(snaps[i].snap);
+			}
+		}
+		for (uint64_t key = 0; key < SNAP_KEYS; key++) {
+			thmap_del(map, &key, sizeof(key));
+		}
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+/*
+ * fuzz_singlewriter: the primary thread is the only writer, also
+ * performing the defragmentation, while the others look up and walk.
+ */
+static void
+walk_check(const void *key, size_t len, void *val, void *arg)
+{
+	uint64_t k;
+
+	(void)arg;
+	CHECK_TRUE(len == sizeof(k));
+	memcpy(&k, key, sizeof(k));
+	CHECK_TRUE(val == (void *)(uintptr_t)k);
+}
+
+static void *
+fuzz_singlewriter(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 1000 * 1000;
+
+	pthread_barrier_wait(&barrier);
+	while (n--) {
+		uint64_t key = fast_random() & 0x1ff;
+		void *keyval = (void *)(uintptr_t)key;
+		void *val;
+
+		if (id != 0) {
+			if ((n & 0xfff) == 0) {
+				thmap_walk(map, walk_check, NULL);
+			}
+			val = thmap_get(map, &key, sizeof(key));
+			CHECK_TRUE(!val || val == keyval);
+			continue;
+		}
+		if ((n & 0x3) == 0) {
+			thmap_defrag(map, 4);
+		}
+		if (fast_random() & 1) {
+			val = thmap_put(map, &key, sizeof(key), keyval);
+			CHECK_TRUE(val == keyval);
+		} else {
+			val = thmap_del(map, &key, sizeof(key));
+			CHECK_TRUE(!val || val == keyval);
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (id == 0) for (uint64_t key = 0; key <= 0x1ff; key++) {
+		thmap_del(map, &key, sizeof(key));
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+/*
+ * fuzz_own_keys: each thread inserts and deletes its own keys, checking
+ * that a lookup right after observes the completed update (the keys of
+ * all threads share the root-level slots, which are repeatedly created
+ * and collapsed concurrently).
+ */
+static void *
+fuzz_own_keys(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+	unsigned n = 1 * 1000 * 1000;
+
+	pthread_barrier_wait(&barrier);
+	while (n--) {
+		uint64_t key = ((uint64_t)(fast_random() & 0x7) << 16) | id;
+		void *keyval = (void *)(uintptr_t)(key + 1);
+		void *val;
+
+		if (fast_random() & 1) {
+			val = thmap_put(map, &key, sizeof(key), keyval);
+			CHECK_TRUE(val == keyval);
+			val = thmap_get(map, &key, sizeof(key));
+			CHECK_TRUE(val == keyval);
+		} else {
+			(void)thmap_del(map, &key, sizeof(key));
+			val = thmap_get(map, &key, sizeof(key));
+			CHECK_TRUE(val == NULL);
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	for (uint64_t k = 0; k < 8; k++) {
+		uint64_t key = (k << 16) | id;
+		thmap_del(map, &key, sizeof(key));
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+/*
+ * numa_worker: spread the workers across the (fake) NUMA nodes.
+ */
+static void *
+numa_worker(void *arg)
+{
+	const unsigned id = (uintptr_t)arg;
+
+	thmap_numa_setnode(id % NUMA_TEST_NODES);
+	return worker_func(arg);
+}
+
+static void
+run_test_ops(void *func(void *), const thmap_ops_t *ops, unsigned flags)
 {
 	pthread_t *thr;
 
 	puts(".");
-	map = thmap_create(0, NULL, 0);
+	map = map_vlen ? thmap_create_vlen(0, ops, flags, map_vlen) :
+	    thmap_create(0, ops, flags);
+	CHECK_TRUE(map != NULL);
+	if (flags & THMAP_CACHE) {
+		CHECK_TRUE(thmap_setcache(map, CACHE_TEST_ITEMS, 0) == 0);
+	}
 	nworkers = sysconf(_SC_NPROCESSORS_CONF) + 1;
+	if (flags & THMAP_NUMA) {
+		nworkers = MAX(nworkers, NUMA_TEST_NODES);
+		worker_func = func;
+		func = numa_worker;
+	}
 
 	thr = malloc(sizeof(pthread_t) * nworkers);
 	pthread_barrier_init(&barrier, NULL, nworkers);
@@ -270,10 +691,42 @@ run_test(void *func(void *))
 		pthread_join(thr[i], NULL);
 	}
 	pthread_barrier_destroy(&barrier);
+
+	if (getenv("THMAP_STATS")) {
+		thmap_stats_t s;
+
+		thmap_stats(map, &s);
+		printf("restarts %" PRIu64 ", retries %" PRIu64
+		    ", root CAS fails %" PRIu64 ", lock spins %" PRIu64
+		    ", lock parks %" PRIu64 ", splits %" PRIu64
+		    ", collapses %" PRIu64 ", relocations %" PRIu64
+		    ", evictions %" PRIu64 ", expirations %" PRIu64 "\n",
+		    s.restarts, s.retries, s.root_cas_fails, s.lock_spins,
+		    s.lock_parks, s.splits, s.collapses, s.relocations,
+		    s.evictions, s.expirations);
+	}
+	/* The primary thread has deleted all keys. */
+	CHECK_TRUE(thmap_count(map, 0) == 0);
+	CHECK_TRUE(thmap_count(map, THMAP_COUNT_EXACT) == 0);
+
+	if (flags & (THMAP_LOCKFREE | THMAP_SNAPSHOT | THMAP_SINGLEWRITER)) {
+		/*
+		 * All levels collapsed once the keys are deleted (and the
+		 * objects retired to the snapshots got staged).
+		 */
+		thmap_gc(map, thmap_stage_gc(map));
+		CHECK_TRUE(thmap_memory_usage(map, NULL) == 0);
+	}
 	thmap_destroy(map);
 	free(thr);
 }
 
+static void
+run_test(void *func(void *))
+{
+	run_test_ops(func, NULL, 0);
+}
+
 int
 main(void)
 {
@@ -283,6 +736,70 @@ main(void)
 	run_test(fuzz_multi_collision);
 	run_test(fuzz_multi_128);
 	run_test(fuzz_multi_512);
+
+	/* Inline counters. */
+	map_vlen = sizeof(int64_t);
+	run_test(fuzz_counters);
+	run_test_ops(fuzz_counters, NULL, THMAP_PARKLOCK);
+	map_vlen = 0;
+
+	/* Cache mode: the inserts evict concurrently with the lookups. */
+	run_test_ops(fuzz_multi_512, NULL, THMAP_CACHE);
+	run_test_ops(fuzz_multi_collision, NULL, THMAP_CACHE);
+
+	/* TTL mode: lazy expiration and the sweeper. */
+	run_test_ops(fuzz_ttl, NULL, THMAP_TTL);
+	run_test_ops(fuzz_ttl, NULL, THMAP_TTL | THMAP_CACHE);
+
+	/* Lock-free writers: the CAS on the slots, with helping. */
+	run_test_ops(fuzz_root_collision, NULL, THMAP_LOCKFREE);
+	run_test_ops(fuzz_l0_collision, NULL, THMAP_LOCKFREE);
+	run_test_ops(fuzz_multi_collision, NULL, THMAP_LOCKFREE);
+	run_test_ops(fuzz_multi_128, NULL, THMAP_LOCKFREE);
+	run_test_ops(fuzz_multi_512, NULL, THMAP_LOCKFREE);
+	map_vlen = sizeof(int64_t);
+	run_test_ops(fuzz_counters, NULL, THMAP_LOCKFREE);
+	map_vlen = 0;
+
+	/* Snapshots: the path copying concurrently with the writers. */
+	run_test_ops(fuzz_snapshot, NULL, THMAP_SNAPSHOT);
+	run_test_ops(fuzz_snapshot, NULL, THMAP_SNAPSHOT | THMAP_PARKLOCK);
+	run_test_ops(fuzz_multi_collision, NULL, THMAP_SNAPSHOT);
+	map_vlen = sizeof(int64_t);
+	run_test_ops(fuzz_counters, NULL, THMAP_SNAPSHOT);
+	map_vlen = 0;
+
+	/* Parking node locks. */
+	run_test_ops(fuzz_multi_collision, NULL, THMAP_PARKLOCK);
+	run_test_ops(fuzz_multi_128, NULL, THMAP_PARKLOCK);
+
+	arena_init();
+	run_test_ops(fuzz_defrag, &thmap_arena_ops, 0);
+	run_test_ops(fuzz_defrag, &thmap_arena_ops, THMAP_PARKLOCK);
+	arena_fini();
+
+	/* Single writer: no writer locking, with the concurrent readers. */
+	arena_init();
+	run_test_ops(fuzz_singlewriter, &thmap_arena_ops, THMAP_SINGLEWRITER);
+	arena_fini();
+	run_test_ops(fuzz_singlewriter, NULL,
+	    THMAP_SINGLEWRITER | THMAP_CACHE);
+
+	/* Huge page arenas: the concurrent allocation and reuse. */
+	run_test_ops(fuzz_multi_128, NULL, THMAP_HUGEPAGE);
+	run_test_ops(fuzz_multi_collision, NULL,
+	    THMAP_HUGEPAGE | THMAP_LOCKFREE);
+	run_test_ops(fuzz_defrag, NULL, THMAP_HUGEPAGE);
+
+	/* NUMA mode with the per-node root replicas (fake topology). */
+	setenv("THMAP_NUMA_TOPOLOGY", NUMA_TEST_TOPOLOGY, 1);
+	run_test_ops(fuzz_multi_collision, NULL, THMAP_NUMA);
+	run_test_ops(fuzz_multi_128, NULL, THMAP_NUMA);
+	run_test_ops(fuzz_own_keys, NULL, THMAP_NUMA);
+	arena_init();
+	run_test_ops(fuzz_defrag, &thmap_arena_ops, THMAP_NUMA);
+	arena_fini();
+	unsetenv("THMAP_NUMA_TOPOLOGY");
 	puts("ok");
 	return 0;
 }
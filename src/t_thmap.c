@@ -7,6 +7,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <inttypes.h>
 #include <assert.h>
@@ -292,6 +293,1533 @@ test_mem(void)
 	assert(space_allocated == 0);
 }
 
+static void
+test_compact(void)
+{
+	const unsigned nitems = 64 * 1024;
+	thmap_t *hmap;
+	void *ret;
+	int error;
+
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+
+	/* Empty map. */
+	error = thmap_compact(hmap);
+	assert(error == 0);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	for (unsigned i = 0; i < nitems; i += 2) {
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+
+	/* Compact twice: the first region must get released. */
+	for (unsigned n = 0; n < 2; n++) {
+		error = thmap_compact(hmap);
+		assert(error == 0);
+		thmap_gc(hmap, thmap_stage_gc(hmap));
+
+		for (unsigned i = 0; i < nitems; i++) {
+			ret = thmap_get(hmap, &i, sizeof(int));
+			assert(ret == ((i & 1) ? NUM2PTR(i) : NULL));
+		}
+	}
+
+	/* The compacted map must remain fully functional. */
+	for (unsigned i = 0; i < nitems; i += 2) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+}
+
+static void
+test_compact_mem(void)
+{
+	uintptr_t baseptr = (uintptr_t)(void *)space - space_off;
+	const unsigned nitems = 128;
+	thmap_t *hmap;
+	void *ret;
+	int error;
+
+	hmap = thmap_create(baseptr, &thmap_test_ops, 0);
+	assert(hmap != NULL);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	error = thmap_compact(hmap);
+	assert(error == 0);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_get(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+	thmap_destroy(hmap);
+
+	/* All space, including the region, must be freed. */
+	assert(space_allocated == 0);
+}
+
+static void
+test_defrag(void)
+{
+	const unsigned nitems = 64 * 1024;
+	thmap_t *hmap;
+	void *ret;
+
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+
+	/* Empty map: a single pass. */
+	while (thmap_defrag(hmap, 1))
+		;
+
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	for (unsigned i = 0; i < nitems; i++) {
+		if (i % 4) {
+			ret = thmap_del(hmap, &i, sizeof(int));
+			assert(ret == NUM2PTR(i));
+		}
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+
+	/*
+	 * Run a few passes in small steps, interleaving with the inserts
+	 * and deletes, and validate the map.
+	 */
+	for (unsigned n = 0; n < 3; n++) {
+		unsigned k = n;
+
+		while (thmap_defrag(hmap, 7)) {
+			k = (k + 12345) % nitems;
+			if (k % 4 == 0) {
+				continue;
+			}
+			ret = thmap_put(hmap, &k, sizeof(int), NUM2PTR(k));
+			assert(ret == NUM2PTR(k));
+			ret = thmap_del(hmap, &k, sizeof(int));
+			assert(ret == NUM2PTR(k));
+		}
+		thmap_gc(hmap, thmap_stage_gc(hmap));
+
+		for (unsigned i = 0; i < nitems; i++) {
+			ret = thmap_get(hmap, &i, sizeof(int));
+			assert(ret == ((i % 4) ? NULL : NUM2PTR(i)));
+		}
+	}
+
+	for (unsigned i = 0; i < nitems; i += 4) {
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+}
+
+static void
+test_stats(void)
+{
+	const unsigned nitems = 1024;
+	thmap_stats_t stats;
+	thmap_t *hmap;
+	void *ret;
+
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+
+	thmap_stats(hmap, &stats);
+	assert(stats.splits == 0 && stats.collapses == 0);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	thmap_stats(hmap, &stats);
+	assert(stats.splits > 0 && stats.collapses == 0);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+	thmap_stats(hmap, &stats);
+
+	/* All levels must be collapsed, including the top ones. */
+	assert(stats.collapses > stats.splits);
+
+	/* No contention in a single thread. */
+	assert(stats.restarts == 0 && stats.retries == 0);
+	assert(stats.root_cas_fails == 0);
+	assert(stats.lock_spins == 0 && stats.lock_parks == 0);
+
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+}
+
+static void
+test_stat_structure(void)
+{
+	const unsigned nitems = 64 * 1024;
+	thmap_structure_t st;
+	uint64_t n = 0, slots = 0, inodes = 0;
+	thmap_t *hmap;
+	void *ret;
+
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+
+	thmap_stat_structure(hmap, &st);
+	assert(st.inodes == 0 && st.leaves == 0 && st.bytes_per_entry == 0);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	thmap_stat_structure(hmap, &st);
+	assert(st.leaves == nitems);
+	assert(st.key_bytes == nitems * sizeof(int));
+	assert(st.level_inodes[0] > 0 && st.level_inodes[0] <= 64);
+	assert(st.bytes_per_entry > sizeof(int));
+
+	for (unsigned i = 0; i < THMAP_STAT_LEVELS; i++) {
+		n += st.depth[i];
+		slots += st.level_slots[i];
+		inodes += st.level_inodes[i];
+	}
+	assert(n == st.leaves);
+	assert(inodes == st.inodes);
+
+	/* Each slot points either to a leaf or a non-top node. */
+	assert(slots == st.leaves + st.inodes - st.level_inodes[0]);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+	thmap_stat_structure(hmap, &st);
+	assert(st.inodes == 0 && st.leaves == 0);
+
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+}
+
+static void
+test_memory_usage(void)
+{
+	const unsigned nitems = 16 * 1024;
+	thmap_memusage_t usage;
+	thmap_structure_t st;
+	thmap_t *hmap;
+	unsigned i, n;
+	size_t total;
+	void *ret;
+
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+	assert(thmap_memory_usage(hmap, NULL) == 0);
+
+	for (i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	total = thmap_memory_usage(hmap, &usage);
+	assert(usage.keys == nitems * sizeof(int));
+	assert(usage.gc == 0);
+	assert(total == usage.inodes + usage.leaves + usage.keys);
+
+	/* Must match the structure (which also accounts the root level). */
+	thmap_stat_structure(hmap, &st);
+	assert(st.total_bytes == total + 64 * sizeof(void *));
+
+	/* Deletions move the memory to G/C, until it is reclaimed. */
+	for (i = 0; i < nitems / 2; i++) {
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+	assert(thmap_memory_usage(hmap, &usage) == total);
+	assert(usage.gc > 0);
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	total = thmap_memory_usage(hmap, &usage);
+	assert(usage.gc == 0);
+	assert(usage.keys == (nitems / 2) * sizeof(int));
+
+	/* Compaction: the same amount once the old nodes are reclaimed. */
+	assert(thmap_compact(hmap) == 0);
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	assert(thmap_memory_usage(hmap, NULL) == total);
+
+	/*
+	 * Set the limit: the inserts must eventually fail, while the
+	 * existing entries remain accessible.
+	 */
+	thmap_setlimit(hmap, total + 4096);
+	for (i = 0, n = 0; i < nitems / 2; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NULL || ret == NUM2PTR(i));
+		n += (ret != NULL);
+	}
+	assert(n > 0 && n < nitems / 2);
+	assert(thmap_memory_usage(hmap, NULL) <= total + 4096);
+	for (i = nitems / 2; i < nitems; i++) {
+		ret = thmap_get(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+
+	/* Lift the limit. */
+	thmap_setlimit(hmap, 0);
+	for (i = 0; i < nitems / 2; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+
+	for (i = 0; i < nitems; i++) {
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	assert(thmap_memory_usage(hmap, NULL) == 0);
+	thmap_destroy(hmap);
+}
+
+static void
+walk_count(const void *key, size_t len, void *val, void *arg)
+{
+	unsigned *seen = arg, i;
+
+	assert(len == sizeof(int));
+	memcpy(&i, key, sizeof(int));
+	assert(val == NUM2PTR(i));
+	seen[i]++;
+}
+
+static void
+test_count(void)
+{
+	const unsigned nitems = 16 * 1024;
+	thmap_t *hmap, *dst;
+	void *ret;
+
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+	assert(thmap_count(hmap, 0) == 0);
+	assert(thmap_count(hmap, THMAP_COUNT_EXACT) == 0);
+
+	/* The duplicates and the missing keys do not count. */
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(0x55));
+		assert(ret == NUM2PTR(i));
+	}
+	assert(thmap_count(hmap, 0) == nitems);
+	for (unsigned i = 0; i < nitems; i += 2) {
+		assert(thmap_del(hmap, &i, sizeof(int)) == NUM2PTR(i));
+		assert(thmap_del(hmap, &i, sizeof(int)) == NULL);
+	}
+	assert(thmap_count(hmap, 0) == nitems / 2);
+	assert(thmap_count(hmap, THMAP_COUNT_EXACT) == nitems / 2);
+
+	/* The split moves the entries with the subtree. */
+	dst = thmap_create(0, NULL, 0);
+	assert(dst != NULL);
+	for (unsigned p = 0; p < 32; p++) {
+		assert(thmap_split(hmap, p, dst) == 0);
+	}
+	assert(thmap_count(dst, 0) == thmap_count(dst, THMAP_COUNT_EXACT));
+	assert(thmap_count(hmap, 0) + thmap_count(dst, 0) == nitems / 2);
+	assert(thmap_merge(hmap, dst, NULL, NULL) == 0);
+	assert(thmap_count(hmap, 0) == nitems / 2);
+
+	for (unsigned i = 1; i < nitems; i += 2) {
+		assert(thmap_del(hmap, &i, sizeof(int)) == NUM2PTR(i));
+		(void)thmap_del(dst, &i, sizeof(int));
+	}
+	assert(thmap_count(hmap, 0) == 0 && thmap_count(dst, 0) == 0);
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_gc(dst, thmap_stage_gc(dst));
+	thmap_destroy(hmap);
+	thmap_destroy(dst);
+
+	/* Lock-free writers; the exact count from a snapshot. */
+	for (unsigned m = 0; m < 2; m++) {
+		const unsigned flags = m ? THMAP_SNAPSHOT : THMAP_LOCKFREE;
+
+		hmap = thmap_create(0, NULL, flags);
+		assert(hmap != NULL);
+		for (unsigned i = 0; i < nitems; i++) {
+			ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+			assert(ret == NUM2PTR(i));
+		}
+		assert(thmap_count(hmap, 0) == nitems);
+		assert(thmap_count(hmap, THMAP_COUNT_EXACT) == nitems);
+		for (unsigned i = 0; i < nitems; i++) {
+			assert(thmap_del(hmap, &i, sizeof(int)) == NUM2PTR(i));
+		}
+		assert(thmap_count(hmap, 0) == 0);
+		thmap_gc(hmap, thmap_stage_gc(hmap));
+		thmap_destroy(hmap);
+	}
+}
+
+static void
+test_walk(void)
+{
+	const unsigned nitems = 16 * 1024;
+	unsigned *seen;
+	thmap_t *hmap;
+	void *ret;
+
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+
+	seen = calloc(nitems, sizeof(unsigned));
+	assert(seen != NULL);
+	thmap_walk(hmap, walk_count, seen);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	for (unsigned i = 0; i < nitems; i += 2) {
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+
+	/* Each remaining entry must be visited exactly once. */
+	thmap_walk(hmap, walk_count, seen);
+	for (unsigned i = 0; i < nitems; i++) {
+		assert(seen[i] == (i & 1));
+	}
+
+	for (unsigned i = 1; i < nitems; i += 2) {
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+	free(seen);
+}
+
+static void
+test_lookup_steps(void)
+{
+	const unsigned nitems = 64 * 1024, ngroup = 16;
+	thmap_lookup_t lk[ngroup];
+	unsigned keys[ngroup];
+	thmap_t *hmap;
+	void *ret;
+
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+
+	/* Empty map. */
+	keys[0] = 0;
+	thmap_lookup_start(hmap, &lk[0], &keys[0], sizeof(int));
+	while (thmap_lookup_step(hmap, &lk[0]))
+		continue;
+	assert(lk[0].val == NULL);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	for (unsigned i = 0; i < nitems; i += 3) {
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+
+	/*
+	 * Interleave the groups of lookups (including the deleted and
+	 * missing keys), stepping them in the round-robin fashion.
+	 */
+	for (unsigned i = 0; i < nitems + ngroup; i += ngroup) {
+		unsigned pending = ngroup;
+
+		for (unsigned j = 0; j < ngroup; j++) {
+			keys[j] = i + j;
+			thmap_lookup_start(hmap, &lk[j], &keys[j], sizeof(int));
+		}
+		while (pending) {
+			pending = 0;
+			for (unsigned j = 0; j < ngroup; j++) {
+				pending += thmap_lookup_step(hmap, &lk[j]);
+			}
+		}
+		for (unsigned j = 0; j < ngroup; j++) {
+			const unsigned k = keys[j];
+			const bool present = k < nitems && (k % 3) != 0;
+
+			assert(lk[j].val == (present ? NUM2PTR(k) : NULL));
+			assert(lk[j].val == thmap_get(hmap, &k, sizeof(int)));
+		}
+	}
+
+	/* Different key length with the same bytes. */
+	keys[0] = 1;
+	thmap_lookup_start(hmap, &lk[0], &keys[0], sizeof(short));
+	while (thmap_lookup_step(hmap, &lk[0]))
+		continue;
+	assert(lk[0].val == NULL);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		if (i % 3) {
+			ret = thmap_del(hmap, &i, sizeof(int));
+			assert(ret == NUM2PTR(i));
+		}
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+}
+
+#define	NUMA_NODES	4
+
+static unsigned		numa_allocs[NUMA_NODES];
+
+static uintptr_t
+alloc_node_wrapper(size_t len, unsigned node)
+{
+	assert(node < NUMA_NODES);
+	numa_allocs[node]++;
+	return (uintptr_t)malloc(len);
+}
+
+static uintptr_t
+alloc_nonode_wrapper(size_t len)
+{
+	return (uintptr_t)malloc(len);
+}
+
+static void
+free_node_wrapper(uintptr_t addr, size_t len)
+{
+	free((void *)addr); (void)len;
+}
+
+static void
+test_numa(void)
+{
+	static const thmap_ops_t numa_ops = {
+		.alloc = alloc_nonode_wrapper,
+		.free = free_node_wrapper,
+		.alloc_node = alloc_node_wrapper
+	};
+	const unsigned nitems = 16 * 1024;
+	thmap_t *hmap;
+	void *ret;
+
+	/* Invalid topology and the incompatible flags. */
+	setenv("THMAP_NUMA_TOPOLOGY", "0-x", 1);
+	assert(thmap_create(0, NULL, THMAP_NUMA) == NULL);
+	setenv("THMAP_NUMA_TOPOLOGY", "0;1;2;3", 1);
+	assert(thmap_create(0, NULL, THMAP_NUMA | THMAP_SETROOT) == NULL);
+	assert(thmap_create(4096, NULL, THMAP_NUMA) == NULL);
+
+	hmap = thmap_create(0, &numa_ops, THMAP_NUMA);
+	assert(hmap != NULL);
+
+	/* Insert on node 1: the nodes are allocated there. */
+	thmap_numa_setnode(1);
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	assert(numa_allocs[1] > 0);
+	assert(numa_allocs[0] == 0 && numa_allocs[2] == 0);
+
+	/* Visible through the replicas of every node. */
+	for (unsigned n = 0; n < NUMA_NODES; n++) {
+		thmap_numa_setnode(n);
+		for (unsigned i = 0; i < nitems; i++) {
+			ret = thmap_get(hmap, &i, sizeof(int));
+			assert(ret == NUM2PTR(i));
+		}
+	}
+
+	/* Compaction replaces all root-level slots. */
+	assert(thmap_compact(hmap) == 0);
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	for (unsigned n = 0; n < NUMA_NODES; n++) {
+		thmap_numa_setnode(n);
+		for (unsigned i = 0; i < nitems; i += 7) {
+			ret = thmap_get(hmap, &i, sizeof(int));
+			assert(ret == NUM2PTR(i));
+		}
+	}
+
+	/* Delete on node 2: the emptied root-level slots are cleared. */
+	thmap_numa_setnode(2);
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_del(hmap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	for (unsigned n = 0; n < NUMA_NODES; n++) {
+		thmap_numa_setnode(n);
+		for (unsigned i = 0; i < nitems; i += 7) {
+			ret = thmap_get(hmap, &i, sizeof(int));
+			assert(ret == NULL);
+		}
+	}
+
+	thmap_destroy(hmap);
+	thmap_numa_setnode(-1);
+	unsetenv("THMAP_NUMA_TOPOLOGY");
+}
+
+static void
+test_split(void)
+{
+	const unsigned nitems = 16 * 1024;
+	thmap_t *src, *dst, *other;
+	size_t total;
+	uintptr_t subtree;
+	void *ret;
+
+	src = thmap_create(0, NULL, 0);
+	assert(src != NULL);
+	dst = thmap_create(0, NULL, 0);
+	assert(dst != NULL);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(src, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	/* Churn: the levels get created and collapsed. */
+	for (unsigned i = nitems; i < 2 * nitems; i++) {
+		ret = thmap_put(src, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	for (unsigned i = nitems; i < 2 * nitems; i++) {
+		ret = thmap_del(src, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+	thmap_gc(src, thmap_stage_gc(src));
+	total = thmap_memory_usage(src, NULL);
+
+	/* Move the lower half of the prefixes. */
+	for (unsigned p = 0; p < 32; p++) {
+		assert(thmap_split(src, p, dst) == 0);
+	}
+	assert(thmap_split(src, 64, dst) == -1);
+	for (unsigned i = 0; i < nitems; i++) {
+		const bool moved = thmap_prefix(&i, sizeof(int)) < 32;
+
+		ret = thmap_get(moved ? dst : src, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+		ret = thmap_get(moved ? src : dst, &i, sizeof(int));
+		assert(ret == NULL);
+	}
+	assert(thmap_memory_usage(src, NULL) + thmap_memory_usage(dst, NULL)
+	    == total);
+	assert(thmap_memory_usage(dst, NULL) > 0);
+	assert(thmap_count(src, 0) + thmap_count(dst, 0) == nitems);
+	assert(thmap_count(dst, 0) == thmap_count(dst, THMAP_COUNT_EXACT));
+
+	/* Detach and graft back; a populated prefix cannot be grafted. */
+	assert(thmap_detach(dst, 0, &subtree) == 0);
+	assert(subtree != 0);
+	assert(thmap_graft(src, 40, subtree) == -1);
+	assert(thmap_graft(src, 0, subtree) == 0);
+	assert(thmap_detach(dst, 0, &subtree) == 0 && subtree == 0);
+	assert(thmap_split(src, 1, dst) == -1);
+
+	/* The maps using different key copying modes are incompatible. */
+	other = thmap_create(0, NULL, THMAP_NOCOPY);
+	assert(other != NULL);
+	assert(thmap_split(src, 40, other) == -1);
+	thmap_destroy(other);
+
+	/* As are the maps with different leaf layouts, in both directions. */
+	other = thmap_create(0, NULL, THMAP_CACHE);
+	assert(other != NULL);
+	assert(thmap_split(src, 40, other) == -1);
+	assert(thmap_split(other, 40, src) == -1);
+	assert(thmap_detach(src, 40, &subtree) == 0);
+	assert(subtree != 0);
+	assert(thmap_graft(other, 40, subtree) == -1);
+	assert(thmap_graft(src, 40, subtree) == 0);
+	thmap_destroy(other);
+
+	other = thmap_create(0, NULL, THMAP_TTL);
+	assert(other != NULL);
+	assert(thmap_split(src, 40, other) == -1);
+	thmap_destroy(other);
+
+	/* The moved entries are managed by the destination. */
+	for (unsigned i = 0; i < nitems; i++) {
+		const bool moved = thmap_prefix(&i, sizeof(int)) < 32 &&
+		    thmap_prefix(&i, sizeof(int)) != 0;
+
+		ret = thmap_del(moved ? dst : src, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+	thmap_gc(src, thmap_stage_gc(src));
+	thmap_gc(dst, thmap_stage_gc(dst));
+	assert(thmap_memory_usage(src, NULL) == 0);
+	assert(thmap_memory_usage(dst, NULL) == 0);
+
+	/* Compacted maps cannot be split. */
+	ret = thmap_put(src, "x", 1, NUM2PTR(1));
+	assert(thmap_compact(src) == 0);
+	assert(thmap_split(src, thmap_prefix("x", 1), dst) == -1);
+	ret = thmap_del(src, "x", 1);
+	assert(ret == NUM2PTR(1));
+
+	thmap_destroy(src);
+	thmap_destroy(dst);
+}
+
+typedef struct {
+	unsigned	aonly;
+	unsigned	bonly;
+	unsigned	differ;
+} diff_count_t;
+
+static void
+diff_count(const void *key, size_t len, void *aval, void *bval, void *arg)
+{
+	diff_count_t *dc = arg;
+	unsigned i;
+
+	assert(len == sizeof(int));
+	memcpy(&i, key, sizeof(int));
+	assert(aval != bval);
+	assert(!aval || aval == NUM2PTR(i));
+	assert(!bval || bval == NUM2PTR(i) || bval == NUM2PTR(i + 1));
+	dc->aonly += (bval == NULL);
+	dc->bonly += (aval == NULL);
+	dc->differ += (aval && bval);
+}
+
+static void *
+merge_max(const void *key, size_t len, void *dval, void *sval, void *arg)
+{
+	(void)key; (void)len; (void)arg;
+	return (uintptr_t)sval > (uintptr_t)dval ? sval : dval;
+}
+
+static void
+test_merge_diff(void)
+{
+	const unsigned nitems = 16 * 1024, nconflicts = 100;
+	const unsigned first = nitems / 2 + 1, last = nitems + nitems / 2;
+	diff_count_t dc;
+	thmap_t *a, *b;
+	void *ret;
+
+	a = thmap_create(0, NULL, 0);
+	assert(a != NULL);
+	b = thmap_create(0, NULL, 0);
+	assert(b != NULL);
+
+	/*
+	 * The maps overlap by a half; some of the common keys have
+	 * different values.  Note: the keys start from 1, so that all
+	 * values are non-NULL.
+	 */
+	for (unsigned i = 1; i <= nitems; i++) {
+		ret = thmap_put(a, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+	}
+	for (unsigned i = first; i <= last; i++) {
+		void *val = NUM2PTR(i < first + nconflicts ? i + 1 : i);
+
+		ret = thmap_put(b, &i, sizeof(int), val);
+		assert(ret == val);
+	}
+
+	memset(&dc, 0, sizeof(dc));
+	thmap_diff(a, a, diff_count, &dc);
+	assert(dc.aonly == 0 && dc.bonly == 0 && dc.differ == 0);
+
+	thmap_diff(a, b, diff_count, &dc);
+	assert(dc.aonly == nitems / 2);
+	assert(dc.bonly == nitems / 2);
+	assert(dc.differ == nconflicts);
+
+	/* Per prefix: the same in total. */
+	memset(&dc, 0, sizeof(dc));
+	for (unsigned p = 0; p < 64; p++) {
+		assert(thmap_diff_prefix(a, b, p, diff_count, &dc) == 0);
+	}
+	assert(thmap_diff_prefix(a, b, 64, diff_count, &dc) == -1);
+	assert(dc.aonly == nitems / 2 && dc.bonly == nitems / 2);
+	assert(dc.differ == nconflicts);
+
+	/* Merge: the union, with the conflicts resolved to the source. */
+	assert(thmap_merge(a, b, merge_max, NULL) == 0);
+	for (unsigned i = 1; i <= last; i++) {
+		const bool moved = i >= first && i < first + nconflicts;
+
+		ret = thmap_get(a, &i, sizeof(int));
+		assert(ret == NUM2PTR(moved ? i + 1 : i));
+	}
+	memset(&dc, 0, sizeof(dc));
+	thmap_diff(a, b, diff_count, &dc);
+	assert(dc.aonly == nitems / 2 && dc.bonly == 0 && dc.differ == 0);
+
+	/* Merging again changes nothing; no function keeps the destination. */
+	assert(thmap_merge(b, a, NULL, NULL) == 0);
+	memset(&dc, 0, sizeof(dc));
+	thmap_diff(a, b, diff_count, &dc);
+	assert(dc.aonly == 0 && dc.bonly == 0 && dc.differ == 0);
+
+	for (unsigned i = 1; i <= last; i++) {
+		ret = thmap_del(a, &i, sizeof(int));
+		assert(ret != NULL);
+		ret = thmap_del(b, &i, sizeof(int));
+		assert(ret != NULL);
+	}
+	thmap_gc(a, thmap_stage_gc(a));
+	thmap_gc(b, thmap_stage_gc(b));
+	thmap_destroy(a);
+	thmap_destroy(b);
+}
+
+typedef struct {
+	uint64_t	a;
+	uint64_t	b;
+} ival_t;
+
+static void *
+merge_first(const void *key, size_t len, void *dval, void *sval, void *arg)
+{
+	(void)key; (void)len; (void)dval; (void)arg;
+	return sval;
+}
+
+static void
+test_inline_values(void)
+{
+	const unsigned nitems = 16 * 1024;
+	thmap_memusage_t mu;
+	thmap_t *set, *hmap, *other, *pmap;
+	const ival_t *v;
+	ival_t iv;
+
+	/*
+	 * Set mode: the values are non-NULL tokens.
+	 */
+	set = thmap_create_vlen(0, NULL, 0, 0);
+	assert(set != NULL);
+	for (unsigned i = 0; i < nitems; i++) {
+		assert(thmap_put(set, &i, sizeof(int), NULL) != NULL);
+	}
+	for (unsigned i = 0; i < nitems; i++) {
+		assert(thmap_get(set, &i, sizeof(int)) != NULL);
+		assert(thmap_get_copy(set, &i, sizeof(int), &iv) == 0);
+	}
+	thmap_memory_usage(set, &mu);
+	assert(mu.leaves == nitems * 2 * sizeof(void *));
+	for (unsigned i = 0; i < nitems; i++) {
+		assert(thmap_del(set, &i, sizeof(int)) != NULL);
+		assert(thmap_get(set, &i, sizeof(int)) == NULL);
+	}
+	thmap_gc(set, thmap_stage_gc(set));
+	thmap_destroy(set);
+
+	/*
+	 * Fixed-size values stored in the leaves.
+	 */
+	hmap = thmap_create_vlen(0, NULL, 0, sizeof(ival_t));
+	assert(hmap != NULL);
+	for (unsigned i = 0; i < nitems; i++) {
+		iv.a = i;
+		iv.b = ~(uint64_t)i;
+		v = thmap_put(hmap, &i, sizeof(int), &iv);
+		assert(v != NULL && v != &iv);
+		assert(v->a == i && v->b == ~(uint64_t)i);
+
+		/* Duplicate: the stored value is not changed. */
+		iv.a = 0;
+		assert(thmap_put(hmap, &i, sizeof(int), &iv) == v);
+		assert(v->a == i);
+	}
+	for (unsigned i = 0; i < nitems; i++) {
+		if (i % 2) {
+			v = thmap_del(hmap, &i, sizeof(int));
+			assert(v && v->a == i);
+		}
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+
+	/* Compaction and defragmentation relocate the values. */
+	assert(thmap_compact(hmap) == 0);
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	while (thmap_defrag(hmap, 64))
+		;
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	for (unsigned i = 0; i < nitems; i++) {
+		const int found = thmap_get_copy(hmap, &i, sizeof(int), &iv);
+
+		if (i % 2) {
+			assert(found == -1);
+			continue;
+		}
+		assert(found == 0);
+		assert(iv.a == i && iv.b == ~(uint64_t)i);
+	}
+
+	/*
+	 * Diff and merge compare the values by contents; the conflicts
+	 * replace the leaves.  Different value modes are rejected.
+	 */
+	other = thmap_create_vlen(0, NULL, 0, sizeof(ival_t));
+	assert(other != NULL);
+	for (unsigned i = 0; i < nitems; i += 2) {
+		iv.a = i;
+		iv.b = (i % 4) ? 0 : ~(uint64_t)i;
+		assert(thmap_put(other, &i, sizeof(int), &iv) != NULL);
+	}
+	pmap = thmap_create(0, NULL, 0);
+	assert(pmap != NULL);
+	assert(thmap_diff(hmap, pmap, diff_count, NULL) == -1);
+	assert(thmap_merge(hmap, pmap, NULL, NULL) == -1);
+	thmap_destroy(pmap);
+
+	assert(thmap_merge(hmap, other, merge_first, NULL) == 0);
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	for (unsigned i = 0; i < nitems; i += 2) {
+		v = thmap_get(hmap, &i, sizeof(int));
+		assert(v && v->a == i);
+		assert(v->b == ((i % 4) ? 0 : ~(uint64_t)i));
+	}
+
+	for (unsigned i = 0; i < nitems; i += 2) {
+		assert(thmap_del(hmap, &i, sizeof(int)) != NULL);
+		assert(thmap_del(other, &i, sizeof(int)) != NULL);
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_gc(other, thmap_stage_gc(other));
+	assert(thmap_memory_usage(hmap, NULL) == 0);
+	thmap_destroy(hmap);
+	thmap_destroy(other);
+}
+
+static void
+test_counters(void)
+{
+	const unsigned nkeys = 1000, nrounds = 10;
+	thmap_t *hmap;
+	int64_t val;
+
+	/* Only the maps storing the 64-bit values inline. */
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+	assert(thmap_add(hmap, "x", 1, 1, NULL) == -1);
+	thmap_destroy(hmap);
+
+	hmap = thmap_create_vlen(0, NULL, 0, sizeof(int64_t));
+	assert(hmap != NULL);
+	for (unsigned r = 0; r < nrounds; r++) {
+		for (unsigned i = 0; i < nkeys; i++) {
+			assert(thmap_add(hmap, &i, sizeof(int), i, &val) == 0);
+			assert(val == (int64_t)i * (r + 1));
+		}
+	}
+	for (unsigned i = 0; i < nkeys; i++) {
+		const int64_t *cnt = thmap_get(hmap, &i, sizeof(int));
+		const int64_t delta = -(int64_t)i;
+
+		assert(cnt && *cnt == (int64_t)i * nrounds);
+		assert(thmap_add(hmap, &i, sizeof(int), delta, NULL) == 0);
+		assert(*cnt == (int64_t)i * (nrounds - 1));
+	}
+
+	/* The counters survive the relocation. */
+	while (thmap_defrag(hmap, 16))
+		;
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	for (unsigned i = 0; i < nkeys; i++) {
+		assert(thmap_get_copy(hmap, &i, sizeof(int), &val) == 0);
+		assert(val == (int64_t)i * (nrounds - 1));
+		assert(thmap_del(hmap, &i, sizeof(int)) != NULL);
+	}
+
+	/* A deleted counter starts over. */
+	assert(thmap_add(hmap, "x", 1, 5, &val) == 0 && val == 5);
+	assert(thmap_del(hmap, "x", 1) != NULL);
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	assert(thmap_memory_usage(hmap, NULL) == 0);
+	thmap_destroy(hmap);
+}
+
+static void
+cache_evicted(const void *key, size_t len, void *val, void *arg)
+{
+	unsigned *nevicted = arg, i;
+
+	assert(len == sizeof(int));
+	memcpy(&i, key, sizeof(int));
+	assert(val == NUM2PTR(i));
+	(*nevicted)++;
+}
+
+static void
+test_cache(void)
+{
+	const unsigned nitems = 64 * 1024, maxitems = 1000, nhot = 100;
+	unsigned nevicted = 0;
+	thmap_structure_t st;
+	thmap_stats_t stats;
+	thmap_t *hmap;
+	void *ret;
+
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+	assert(thmap_setcache(hmap, maxitems, 0) == -1);
+	thmap_destroy(hmap);
+
+	hmap = thmap_create(0, NULL, THMAP_CACHE);
+	assert(hmap != NULL);
+	assert(thmap_setcache(hmap, maxitems, 0) == 0);
+	thmap_setevict(hmap, cache_evicted, &nevicted);
+
+	/*
+	 * Insert many more keys than the cache can hold, keeping a few
+	 * of them hot (note: the keys start from 1, so the values are
+	 * non-NULL).  The hot keys must survive.
+	 */
+	for (unsigned i = 1; i <= nitems; i++) {
+		const unsigned hot = 1 + (i % nhot);
+
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+		if (i > nhot) {
+			ret = thmap_get(hmap, &hot, sizeof(int));
+			assert(ret == NUM2PTR(hot));
+		}
+		if ((i % 1024) == 0) {
+			thmap_gc(hmap, thmap_stage_gc(hmap));
+		}
+	}
+	thmap_stat_structure(hmap, &st);
+	assert(st.leaves <= maxitems + nhot);
+	thmap_stats(hmap, &stats);
+	assert(stats.evictions == nevicted);
+	assert(st.leaves + nevicted == nitems);
+
+	/* The explicit sweep gets the cache within the budget. */
+	while (thmap_cache_evict(hmap, 1024))
+		;
+	thmap_stat_structure(hmap, &st);
+	assert(st.leaves <= maxitems);
+
+	/* A smaller byte budget. */
+	assert(thmap_setcache(hmap, 0,
+	    thmap_memory_usage(hmap, NULL) / 2) == 0);
+	while (thmap_cache_evict(hmap, 1024))
+		;
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_stat_structure(hmap, &st);
+	assert(st.leaves < maxitems);
+
+	for (unsigned i = 1; i <= nitems; i++) {
+		(void)thmap_del(hmap, &i, sizeof(int));
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	assert(thmap_memory_usage(hmap, NULL) == 0);
+	thmap_destroy(hmap);
+}
+
+static void
+walk_total(const void *key, size_t len, void *val, void *arg)
+{
+	unsigned *n = arg;
+
+	(void)key; (void)len; (void)val;
+	(*n)++;
+}
+
+static void
+test_ttl(void)
+{
+	const unsigned nitems = 16 * 1024;
+	unsigned nexpired = 0, n = 0;
+	thmap_stats_t stats;
+	thmap_t *hmap;
+	void *ret;
+
+	hmap = thmap_create(0, NULL, 0);
+	assert(hmap != NULL);
+	assert(thmap_put_ttl(hmap, "x", 1, NUM2PTR(1), 1) == NULL);
+	assert(thmap_expire(hmap, 1, 1) == 0);
+	thmap_destroy(hmap);
+
+	hmap = thmap_create(0, NULL, THMAP_TTL);
+	assert(hmap != NULL);
+	thmap_setevict(hmap, cache_evicted, &nexpired);
+
+	/*
+	 * Key i expires at time i (the keys start from 1, so the values
+	 * are non-NULL); the even keys have no expiry.
+	 */
+	for (unsigned i = 1; i <= nitems; i++) {
+		const uint64_t expire = (i % 2) ? i : 0;
+
+		ret = thmap_put_ttl(hmap, &i, sizeof(int), NUM2PTR(i), expire);
+		assert(ret == NUM2PTR(i));
+	}
+
+	/* Lazy expiration: set the time without sweeping. */
+	assert(thmap_expire(hmap, nitems / 2, 0) == 0);
+	for (unsigned i = 1; i <= nitems; i++) {
+		const bool expired = (i % 2) && i <= nitems / 2;
+
+		ret = thmap_get(hmap, &i, sizeof(int));
+		assert(ret == (expired ? NULL : NUM2PTR(i)));
+	}
+	thmap_walk(hmap, walk_total, &n);
+	assert(n == nitems - nitems / 4);
+
+	/* Extend one entry; re-insert an expired one, replacing it. */
+	n = 1;
+	assert(thmap_setexpire(hmap, &n, sizeof(int), 0) == -1);
+	n = nitems - 1;
+	assert(thmap_setexpire(hmap, &n, sizeof(int), 0) == 0);
+	n = 3;
+	ret = thmap_put_ttl(hmap, &n, sizeof(int), NUM2PTR(n), nitems * 2);
+	assert(ret == NUM2PTR(n));
+	assert(thmap_get(hmap, &n, sizeof(int)) == NUM2PTR(n));
+	assert(nexpired == 1);
+
+	/* Background sweep: remove the expired entries in batches. */
+	while (thmap_expire(hmap, nitems / 2, 64) || nexpired < nitems / 4)
+		;
+	assert(nexpired == nitems / 4);
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+
+	/* Everything else expires now, except the extended entry. */
+	while (nexpired < nitems / 2) {
+		(void)thmap_expire(hmap, UINT64_MAX, 64);
+	}
+	assert(thmap_expire(hmap, UINT64_MAX, 4 * nitems) == 0);
+	thmap_stats(hmap, &stats);
+	assert(stats.expirations == nexpired);
+	n = nitems - 1;
+	assert(thmap_get(hmap, &n, sizeof(int)) == NUM2PTR(n));
+
+	for (unsigned i = 2; i <= nitems; i += 2) {
+		assert(thmap_del(hmap, &i, sizeof(int)) == NUM2PTR(i));
+	}
+	n = nitems - 1;
+	assert(thmap_del(hmap, &n, sizeof(int)) == NUM2PTR(n));
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	assert(thmap_memory_usage(hmap, NULL) == 0);
+	thmap_destroy(hmap);
+}
+
+static void
+test_ttl_merge(void)
+{
+	const unsigned nitems = 1024;
+	diff_count_t dc;
+	thmap_t *a, *b;
+
+	a = thmap_create(0, NULL, THMAP_TTL);
+	assert(a != NULL);
+	b = thmap_create(0, NULL, THMAP_TTL);
+	assert(b != NULL);
+
+	/*
+	 * All keys are in both maps, with different values; the odd keys
+	 * have expired in the destination and the even ones in the source.
+	 */
+	for (unsigned i = 1; i <= nitems; i++) {
+		void *ret;
+
+		ret = thmap_put_ttl(a, &i, sizeof(int), NUM2PTR(i),
+		    (i % 2) ? 1 : 0);
+		assert(ret == NUM2PTR(i));
+		ret = thmap_put_ttl(b, &i, sizeof(int), NUM2PTR(i + 1),
+		    (i % 2) ? 0 : 1);
+		assert(ret == NUM2PTR(i + 1));
+	}
+	assert(thmap_expire(a, 1, 0) == 0);
+	assert(thmap_expire(b, 1, 0) == 0);
+
+	/* The expired entries are absent: no key is in both maps. */
+	memset(&dc, 0, sizeof(dc));
+	assert(thmap_diff(a, b, diff_count, &dc) == 0);
+	assert(dc.aonly == nitems / 2 && dc.bonly == nitems / 2);
+	assert(dc.differ == 0);
+
+	/* The expired destination entries are replaced, not conflicts. */
+	assert(thmap_merge(a, b, NULL, NULL) == 0);
+	for (unsigned i = 1; i <= nitems; i++) {
+		void *ret = thmap_get(a, &i, sizeof(int));
+
+		assert(ret == NUM2PTR((i % 2) ? i + 1 : i));
+	}
+	memset(&dc, 0, sizeof(dc));
+	assert(thmap_diff(a, b, diff_count, &dc) == 0);
+	assert(dc.aonly == nitems / 2 && dc.bonly == 0 && dc.differ == 0);
+
+	while (thmap_expire(a, 1, 1024) || thmap_expire(b, 1, 1024))
+		;
+	for (unsigned i = 1; i <= nitems; i++) {
+		assert(thmap_del(a, &i, sizeof(int)) != NULL);
+		assert(thmap_del(b, &i, sizeof(int)) == ((i % 2) ?
+		    NUM2PTR(i + 1) : NULL));
+	}
+	thmap_gc(a, thmap_stage_gc(a));
+	thmap_gc(b, thmap_stage_gc(b));
+	assert(thmap_memory_usage(a, NULL) == 0);
+	assert(thmap_memory_usage(b, NULL) == 0);
+	thmap_destroy(a);
+	thmap_destroy(b);
+}
+
+static void
+test_lockfree(void)
+{
+	const unsigned nitems = 64 * 1024;
+	thmap_structure_t st;
+	thmap_stats_t stats;
+	uintptr_t subtree;
+	thmap_t *hmap;
+	int64_t val;
+	void *ret;
+
+	/* Not with the modes replacing the entries under the locks. */
+	assert(thmap_create(0, NULL, THMAP_LOCKFREE | THMAP_CACHE) == NULL);
+	assert(thmap_create(0, NULL, THMAP_LOCKFREE | THMAP_TTL) == NULL);
+	assert(thmap_create(0, NULL, THMAP_LOCKFREE | THMAP_NUMA) == NULL);
+
+	hmap = thmap_create(0, NULL, THMAP_LOCKFREE);
+	assert(hmap != NULL);
+	for (unsigned i = 1; i <= nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(0x55));
+		assert(ret == NUM2PTR(i));
+	}
+	for (unsigned i = 1; i <= nitems; i++) {
+		assert(thmap_get(hmap, &i, sizeof(int)) == NUM2PTR(i));
+	}
+
+	/* The operations relying on the node locks are not supported. */
+	assert(thmap_compact(hmap) == -1);
+	assert(thmap_defrag(hmap, 16) == 0);
+	assert(thmap_detach(hmap, 0, &subtree) == -1);
+	assert(thmap_merge(hmap, hmap, NULL, NULL) == -1);
+
+	/* Delete the odd keys, then the rest: the levels collapse. */
+	for (unsigned i = 1; i <= nitems; i += 2) {
+		assert(thmap_del(hmap, &i, sizeof(int)) == NUM2PTR(i));
+		assert(thmap_del(hmap, &i, sizeof(int)) == NULL);
+	}
+	for (unsigned i = 1; i <= nitems; i++) {
+		ret = thmap_get(hmap, &i, sizeof(int));
+		assert(ret == ((i % 2) ? NULL : NUM2PTR(i)));
+	}
+	for (unsigned i = 2; i <= nitems; i += 2) {
+		assert(thmap_del(hmap, &i, sizeof(int)) == NUM2PTR(i));
+	}
+	thmap_stats(hmap, &stats);
+	assert(stats.splits > 0 && stats.collapses > 0);
+	assert(stats.lock_spins == 0);
+
+	thmap_stat_structure(hmap, &st);
+	assert(st.inodes == 0 && st.leaves == 0);
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	assert(thmap_memory_usage(hmap, NULL) == 0);
+	thmap_destroy(hmap);
+
+	/* Counters: the atomic addition in place. */
+	hmap = thmap_create_vlen(0, NULL, THMAP_LOCKFREE, sizeof(int64_t));
+	assert(hmap != NULL);
+	for (unsigned r = 0; r < 2; r++) {
+		for (unsigned i = 0; i < 1000; i++) {
+			assert(thmap_add(hmap, &i, sizeof(int), i, &val) == 0);
+			assert(val == (int64_t)i * (r + 1));
+		}
+	}
+	for (unsigned i = 0; i < 1000; i++) {
+		assert(thmap_get_copy(hmap, &i, sizeof(int), &val) == 0);
+		assert(val == (int64_t)i * 2);
+		assert(thmap_del(hmap, &i, sizeof(int)) != NULL);
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	assert(thmap_memory_usage(hmap, NULL) == 0);
+	thmap_destroy(hmap);
+}
+
+static void
+test_snapshot(void)
+{
+	const unsigned nitems = 16 * 1024;
+	thmap_snapshot_t *snap1, *snap2;
+	uintptr_t subtree;
+	unsigned *seen, n;
+	thmap_t *hmap;
+	int64_t val, *valp;
+
+	/* Not with the modes changing the entries or the root in place. */
+	assert(thmap_create(0, NULL, THMAP_SNAPSHOT | THMAP_LOCKFREE) == NULL);
+	assert(thmap_create(0, NULL, THMAP_SNAPSHOT | THMAP_TTL) == NULL);
+	assert(thmap_create(0, NULL, THMAP_SNAPSHOT | THMAP_SETROOT) == NULL);
+
+	hmap = thmap_create(0, NULL, 0);
+	assert(thmap_snapshot_take(hmap) == NULL);
+	thmap_destroy(hmap);
+
+	hmap = thmap_create(0, NULL, THMAP_SNAPSHOT);
+	assert(hmap != NULL);
+	for (unsigned i = 0; i < nitems; i++) {
+		assert(thmap_put(hmap, &i, sizeof(int), NUM2PTR(i)) ==
+		    NUM2PTR(i));
+	}
+	snap1 = thmap_snapshot_take(hmap);
+	assert(snap1 != NULL);
+
+	/* Change the map: delete the odd keys and add the new ones. */
+	for (unsigned i = 1; i < nitems; i += 2) {
+		assert(thmap_del(hmap, &i, sizeof(int)) == NUM2PTR(i));
+	}
+	for (unsigned i = nitems; i < 2 * nitems; i++) {
+		assert(thmap_put(hmap, &i, sizeof(int), NUM2PTR(i)) ==
+		    NUM2PTR(i));
+	}
+
+	/* The nodes are shared with the snapshot. */
+	assert(thmap_compact(hmap) == -1);
+	assert(thmap_defrag(hmap, 16) == 0);
+	assert(thmap_detach(hmap, 0, &subtree) == -1);
+
+	/* The snapshot sees the map as it was. */
+	seen = calloc(2 * nitems, sizeof(unsigned));
+	assert(seen != NULL);
+	thmap_snapshot_walk(snap1, walk_count, seen);
+	for (unsigned i = 0; i < 2 * nitems; i++) {
+		assert(seen[i] == (i < nitems));
+		assert(thmap_snapshot_get(snap1, &i, sizeof(int)) ==
+		    (i < nitems ? NUM2PTR(i) : NULL));
+		assert(thmap_get(hmap, &i, sizeof(int)) ==
+		    ((i < nitems && (i % 2)) ? NULL : NUM2PTR(i)));
+	}
+	free(seen);
+
+	/* The second snapshot; then empty the map. */
+	snap2 = thmap_snapshot_take(hmap);
+	assert(snap2 != NULL);
+	for (unsigned i = 0; i < 2 * nitems; i++) {
+		(void)thmap_del(hmap, &i, sizeof(int));
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	n = 0;
+	thmap_snapshot_walk(snap1, walk_total, &n);
+	assert(n == nitems);
+	n = 0;
+	thmap_snapshot_walk(snap2, walk_total, &n);
+	assert(n == nitems / 2 + nitems);
+	n = 0;
+	thmap_walk(hmap, walk_total, &n);
+	assert(n == 0);
+
+	/* Release out of order: the memory is reclaimed with the last. */
+	thmap_snapshot_release(snap1);
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	assert(thmap_memory_usage(hmap, NULL) != 0);
+	n = 0;
+	thmap_snapshot_walk(snap2, walk_total, &n);
+	assert(n == nitems / 2 + nitems);
+	thmap_snapshot_release(snap2);
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	assert(thmap_memory_usage(hmap, NULL) == 0);
+	assert(thmap_compact(hmap) == 0);
+	thmap_destroy(hmap);
+
+	/* Counters: the leaves are copied rather than updated in place. */
+	hmap = thmap_create_vlen(0, NULL, THMAP_SNAPSHOT, sizeof(int64_t));
+	assert(hmap != NULL);
+	for (unsigned i = 0; i < 1000; i++) {
+		assert(thmap_add(hmap, &i, sizeof(int), i, NULL) == 0);
+	}
+	snap1 = thmap_snapshot_take(hmap);
+	for (unsigned i = 0; i < 1000; i++) {
+		assert(thmap_add(hmap, &i, sizeof(int), i, &val) == 0);
+		assert(val == (int64_t)i * 2);
+	}
+	for (unsigned i = 0; i < 1000; i++) {
+		valp = thmap_snapshot_get(snap1, &i, sizeof(int));
+		assert(valp && *valp == (int64_t)i);
+		assert(thmap_get_copy(hmap, &i, sizeof(int), &val) == 0);
+		assert(val == (int64_t)i * 2);
+		assert(thmap_del(hmap, &i, sizeof(int)) != NULL);
+	}
+
+	/* Destroying the map releases the remaining snapshots. */
+	(void)thmap_snapshot_take(hmap);
+	thmap_destroy(hmap);
+}
+
+static void
+test_singlewriter(void)
+{
+	const unsigned nitems = 64 * 1024;
+	thmap_snapshot_t *snap;
+	thmap_stats_t stats;
+	thmap_t *hmap;
+	int64_t val;
+	void *ret;
+
+	/* No writer locks to park or to avoid. */
+	assert(thmap_create(0, NULL,
+	    THMAP_SINGLEWRITER | THMAP_PARKLOCK) == NULL);
+	assert(thmap_create(0, NULL,
+	    THMAP_SINGLEWRITER | THMAP_LOCKFREE) == NULL);
+
+	hmap = thmap_create(0, NULL, THMAP_SINGLEWRITER | THMAP_SNAPSHOT);
+	assert(hmap != NULL);
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(i));
+		assert(ret == NUM2PTR(i));
+		ret = thmap_put(hmap, &i, sizeof(int), NUM2PTR(0x55));
+		assert(ret == NUM2PTR(i));
+	}
+	snap = thmap_snapshot_take(hmap);
+	assert(snap != NULL);
+	for (unsigned i = 0; i < nitems; i += 2) {
+		assert(thmap_del(hmap, &i, sizeof(int)) == NUM2PTR(i));
+		assert(thmap_del(hmap, &i, sizeof(int)) == NULL);
+	}
+	for (unsigned i = 0; i < nitems; i++) {
+		ret = thmap_get(hmap, &i, sizeof(int));
+		assert(ret == ((i % 2) ? NUM2PTR(i) : NULL));
+		ret = thmap_snapshot_get(snap, &i, sizeof(int));
+		assert(ret == NUM2PTR(i));
+	}
+	thmap_snapshot_release(snap);
+
+	/* The maintenance is performed by the writer, as well. */
+	while (thmap_defrag(hmap, 64))
+		continue;
+	assert(thmap_compact(hmap) == 0);
+	for (unsigned i = 1; i < nitems; i += 2) {
+		assert(thmap_del(hmap, &i, sizeof(int)) == NUM2PTR(i));
+	}
+	thmap_stats(hmap, &stats);
+	assert(stats.lock_spins == 0 && stats.restarts == 0);
+	assert(stats.root_cas_fails == 0);
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	assert(thmap_memory_usage(hmap, NULL) == 0);
+	thmap_destroy(hmap);
+
+	/* Counters. */
+	hmap = thmap_create_vlen(0, NULL, THMAP_SINGLEWRITER, sizeof(int64_t));
+	assert(hmap != NULL);
+	for (unsigned r = 0; r < 2; r++) {
+		for (unsigned i = 0; i < 1000; i++) {
+			assert(thmap_add(hmap, &i, sizeof(int), i, &val) == 0);
+			assert(val == (int64_t)i * (r + 1));
+		}
+	}
+	for (unsigned i = 0; i < 1000; i++) {
+		assert(thmap_del(hmap, &i, sizeof(int)) != NULL);
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+}
+
+static void
+test_hugepage(void)
+{
+	const unsigned nitems = 256 * 1024;
+	const unsigned flags[] = { 0, THMAP_LOCKFREE, THMAP_SINGLEWRITER };
+	uintptr_t subtree;
+	thmap_t *hmap;
+	void *ret, *big;
+
+	/* The nodes are private to the process and not per NUMA node. */
+	assert(thmap_create(0, NULL, THMAP_HUGEPAGE | THMAP_SETROOT) == NULL);
+	assert(thmap_create(0, NULL, THMAP_HUGEPAGE | THMAP_NUMA) == NULL);
+	assert(thmap_create(0, &thmap_test_ops, THMAP_HUGEPAGE) == NULL);
+	assert(thmap_create(4096, NULL, THMAP_HUGEPAGE) == NULL);
+
+	for (unsigned f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+		hmap = thmap_create(0, NULL, THMAP_HUGEPAGE | flags[f]);
+		assert(hmap != NULL);
+
+		/* Spans several chunks; the second round reuses objects. */
+		for (unsigned r = 0; r < 2; r++) {
+			for (unsigned i = 0; i < nitems; i++) {
+				ret = thmap_put(hmap, &i, sizeof(int),
+				    NUM2PTR(i));
+				assert(ret == NUM2PTR(i));
+			}
+			for (unsigned i = 0; i < nitems; i++) {
+				ret = thmap_get(hmap, &i, sizeof(int));
+				assert(ret == NUM2PTR(i));
+			}
+			if (r == 0) {
+				assert(thmap_detach(hmap, 0, &subtree) == -1);
+				(void)thmap_compact(hmap);
+				while (thmap_defrag(hmap, 64))
+					continue;
+			}
+			for (unsigned i = 0; i < nitems; i++) {
+				ret = thmap_del(hmap, &i, sizeof(int));
+				assert(ret == NUM2PTR(i));
+			}
+			thmap_gc(hmap, thmap_stage_gc(hmap));
+			assert(thmap_memory_usage(hmap, NULL) == 0);
+		}
+		thmap_destroy(hmap);
+	}
+
+	/* The inline values of an odd size. */
+	hmap = thmap_create_vlen(0, NULL, THMAP_HUGEPAGE, 3);
+	assert(hmap != NULL);
+	for (unsigned i = 0; i < 1000; i++) {
+		ret = thmap_put(hmap, &i, sizeof(int), &i);
+		assert(ret && memcmp(ret, &i, 3) == 0);
+	}
+	for (unsigned i = 0; i < 1000; i++) {
+		ret = thmap_get(hmap, &i, sizeof(int));
+		assert(ret && memcmp(ret, &i, 3) == 0);
+		assert(thmap_del(hmap, &i, sizeof(int)) != NULL);
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+
+	/* The leaves must fit a chunk; the large ones take one each. */
+	assert(thmap_create_vlen(0, NULL, THMAP_HUGEPAGE, 3 << 20) == NULL);
+	hmap = thmap_create_vlen(0, NULL, THMAP_HUGEPAGE, 1 << 20);
+	assert(hmap != NULL);
+	big = calloc(1, 1 << 20);
+	assert(big != NULL);
+	for (unsigned i = 0; i < 4; i++) {
+		memset(big, i, 1 << 20);
+		ret = thmap_put(hmap, &i, sizeof(int), big);
+		assert(ret && memcmp(ret, big, 1 << 20) == 0);
+	}
+	for (unsigned i = 0; i < 4; i++) {
+		assert(thmap_del(hmap, &i, sizeof(int)) != NULL);
+	}
+	thmap_gc(hmap, thmap_stage_gc(hmap));
+	thmap_destroy(hmap);
+	free(big);
+}
+
 int
 main(void)
 {
@@ -301,6 +1829,27 @@ main(void)
 	test_longkey();
 	test_random();
 	test_mem();
+	test_compact();
+	test_compact_mem();
+	test_defrag();
+	test_stats();
+	test_stat_structure();
+	test_memory_usage();
+	test_count();
+	test_walk();
+	test_lookup_steps();
+	test_numa();
+	test_split();
+	test_merge_diff();
+	test_inline_values();
+	test_counters();
+	test_cache();
+	test_ttl();
+	test_ttl_merge();
+	test_lockfree();
+	test_snapshot();
+	test_singlewriter();
+	test_hugepage();
 	puts("ok");
 	return 0;
 }
@@ -35,9 +35,13 @@
  *
  * - WRITERS AND LOCKING: Each intermediate node has a spin-lock (which
  *   is implemented using the NODE_LOCKED bit) -- it provides mutual
- *   exclusion amongst concurrent writers.  The lock order for the nodes
+ *   exclusion amongst concurrent writers.  Optionally (THMAP_PARKLOCK),
+ *   the writers spin for a bounded time and then park on the state word
+ *   using futex(2), which is process-shared and thus works with the maps
+ *   in shared memory.  The lock order for the nodes
  *   is "bottom-up" i.e. they are locked as we ascend the trie.  A key
- *   constraint here is that parent pointer never changes.
+ *   constraint here is that parent pointer can only change while both
+ *   the node and its parent are locked (see the relocation below).
  *
  * - DELETES: In addition to writer's locking, the deletion keeps the
  *   intermediate nodes in a valid state and sets the NODE_DELETED flag,
@@ -52,6 +56,19 @@
  *   at becomes empty, is locked and marked as NODE_DELETED (this causes
  *   the insert/delete operations to re-try until the slot is set to NULL).
  *
+ * - RELOCATION: The online defragmentation moves the nodes to the lower
+ *   addresses.  An intermediate node is copied while holding the locks
+ *   of its intermediate children, the node itself and its parent (again,
+ *   in the bottom-up order).  The copy is published in the parent slot
+ *   and the old node is marked with NODE_MOVED: the readers may still
+ *   walk it (it remains a valid, albeit frozen, view), but the writers
+ *   must re-start from the root.  Leaves are simply replaced under the
+ *   parent lock.
+ *
+ * - LOCK-FREE WRITERS: Optionally (THMAP_LOCKFREE), the writers take no
+ *   locks and update the slots using CAS only, helping to complete any
+ *   collapse in progress; see the LOCK-FREE WRITERS section below.
+ *
  * References:
  *
  *	W. Litwin, 1981, Trie Hashing.
@@ -71,6 +88,13 @@
 #include <inttypes.h>
 #include <string.h>
 #include <limits.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
 #include "thmap.h"
 #include "utils.h"
@@ -103,7 +127,8 @@
  *
  * The pointers must be aligned, since pointer tagging is used to
  * differentiate the intermediate nodes from leaves.  We reserve the
- * least significant bit.
+ * least significant bit.  In the lock-free mode, the second bit marks
+ * the frozen slots.
  */
 typedef uintptr_t thmap_ptr_t;
 typedef atomic_uintptr_t atomic_thmap_ptr_t;
@@ -111,6 +136,7 @@ typedef atomic_uintptr_t atomic_thmap_ptr_t;
 #define	THMAP_NULL		((thmap_ptr_t)0)
 
 #define	THMAP_LEAF_BIT		(0x1)
+#define	THMAP_FROZEN_BIT	(0x2)
 
 #define	THMAP_ALIGNED_P(p)	(((uintptr_t)(p) & 3) == 0)
 #define	THMAP_ALIGN(p)		((uintptr_t)(p) & ~(uintptr_t)3)
@@ -126,7 +152,8 @@ typedef atomic_uintptr_t atomic_thmap_ptr_t;
 
 #define	NODE_LOCKED		(1U << 31)		// lock (writers)
 #define	NODE_DELETED		(1U << 30)		// node deleted
-#define	NODE_COUNT(s)		((s) & 0x3fffffff)	// slot count mask
+#define	NODE_MOVED		(1U << 29)		// node relocated
+#define	NODE_COUNT(s)		((s) & 0x1fffffff)	// slot count mask
 
 /*
  * There are two types of nodes:
@@ -136,18 +163,50 @@ typedef atomic_uintptr_t atomic_thmap_ptr_t;
 
 typedef struct {
 	atomic_uint_least32_t	state;
+	atomic_uint_least32_t	waiters;	// parked writers
 	thmap_ptr_t		parent;
 	atomic_thmap_ptr_t	slots[LEVEL_SIZE];
 } thmap_inode_t;
 
-#define	THMAP_INODE_LEN	sizeof(thmap_inode_t)
+#define	THMAP_INODE_LEN(t)	((t)->inode_len)
+
+/*
+ * In the snapshot mode, the intermediate node is followed by the generation
+ * it was created in (see the SNAPSHOTS section).
+ */
+#define	THMAP_INODE_GEN(n)	\
+    ((uint64_t *)((uintptr_t)(n) + sizeof(thmap_inode_t)))
 
 typedef struct {
 	thmap_ptr_t	key;
 	size_t		len;
-	void *		val;
+	void *_Atomic	val;		// might be replaced under the lock
 } thmap_leaf_t;
 
+/*
+ * In the inline value mode (see thmap_create_vlen()), the value of the
+ * given size is stored in place of the value pointer; such leaves are
+ * immutable and replaced as a whole.
+ */
+#define	THMAP_LEAF_LEN(t)	((t)->leaf_len)
+#define	THMAP_LEAF_VAL(l)	\
+    ((void *)((uintptr_t)(l) + offsetof(thmap_leaf_t, val)))
+
+/*
+ * In the cache mode, the leaf is followed by the reference word.
+ */
+#define	THMAP_LEAF_REF(t, l)	\
+    ((atomic_uint *)((uintptr_t)(l) + (t)->ref_off))
+
+/*
+ * In the TTL mode, the expiry time follows (zero means no expiry).
+ */
+#define	THMAP_LEAF_EXP(t, l)	\
+    ((_Atomic uint64_t *)((uintptr_t)(l) + (t)->exp_off))
+
+/* The maximum CLOCK hand steps per insert in the cache mode. */
+#define	CLOCK_STEPS	(4 * LEVEL_SIZE)
+
 typedef struct {
 	unsigned	rslot;		// root-level slot index
 	unsigned	level;		// current level in the tree
@@ -158,9 +217,144 @@ typedef struct {
 typedef struct {
 	uintptr_t	addr;
 	size_t		len;
+	unsigned	type;
 	void *		next;
 } thmap_gc_t;
 
+/*
+ * Snapshot: the copy of the root level taken at the given generation and
+ * the objects removed from the map while it is the newest snapshot.
+ */
+struct thmap_snapshot {
+	thmap_t *		thmap;
+	uint64_t		gen;
+	thmap_gc_t *_Atomic	retired;
+	thmap_snapshot_t *	older;
+	thmap_snapshot_t *	newer;
+	atomic_thmap_ptr_t	root[ROOT_SIZE];
+};
+
+/*
+ * Compacted region: a single allocation holding the nodes which were
+ * re-laid by thmap_compact().  The region is released once all objects
+ * carved from it are reclaimed.
+ */
+typedef struct thmap_region {
+	uintptr_t		addr;
+	size_t			len;
+	size_t			refs;
+	struct thmap_region *	next;
+} thmap_region_t;
+
+/*
+ * Huge page arena: the chunks (linked through their first word), the
+ * unused tail of the current chunk, from which the shards take the slabs,
+ * and the batches of the free objects returned by the shards.
+ */
+typedef struct {
+	atomic_uint		lock;
+	uintptr_t		chunks;
+	uintptr_t		cur;
+	uintptr_t		end;
+	uintptr_t		batches;
+} thmap_hparena_t;
+
+/*
+ * Huge page cache of a shard: the unused tail of the slab and the free
+ * list of the objects (see hp_alloc()).
+ */
+typedef struct {
+	atomic_uint		lock;
+	unsigned		nfree;
+	uintptr_t		cur;
+	uintptr_t		end;
+	uintptr_t		free;
+} thmap_hpcache_t;
+
+/*
+ * Resumable walk position: the root-level slot and the path of slot
+ * indexes (one per level) leading to the current node.
+ */
+#define	THMAP_MAXDEPTH	(64)
+
+typedef struct {
+	unsigned	rslot;
+	unsigned	level;
+	bool		started;
+	uint8_t		path[THMAP_MAXDEPTH];
+} thmap_cursor_t;
+
+/*
+ * Per-thread counter shards: each thread gets assigned a shard, which is
+ * padded to the cache line size, thus avoiding the contended cache lines.
+ * The counters are aggregated on demand.  Note: the shards are a bounded
+ * array, so they are updated atomically (a shard might be shared).
+ */
+#define	THMAP_NSHARDS	(32)
+
+/*
+ * Memory accounting: the live bytes of each object type and the bytes
+ * pending G/C.  The total is also propagated to the global (approximate)
+ * counter in batches, which is used for the fast limit checks.
+ */
+#define	MEM_INODE	0
+#define	MEM_LEAF	1
+#define	MEM_KEY		2
+#define	MEM_GC		3
+#define	MEM_NTYPES	4
+
+#define	MEM_BATCH	(64 * 1024)
+
+/*
+ * The batch is scaled down for a small limit, so that the lag of the
+ * global counter stays within a fraction (1 / MEM_SLACK) of the limit.
+ */
+#define	MEM_SLACK	8
+#define	MEM_BATCH_LEN(limit)	((int64_t)((limit) ? MIN((size_t)MEM_BATCH, \
+    (limit) / (MEM_SLACK * THMAP_NSHARDS)) : MEM_BATCH))
+
+/*
+ * Per root-level slot accounting: the entries, the intermediate nodes and
+ * the key bytes of the subtree, so that they can be moved together with
+ * it (see thmap_detach()).  Maintained by the lock-based writers.  Kept
+ * per map rather than per shard, to keep the fixed size of the map small;
+ * the writers of a prefix share its counters.
+ */
+typedef struct {
+	atomic_int_fast64_t	items;
+	atomic_int_fast64_t	inodes;
+	atomic_int_fast64_t	key_bytes;
+} thmap_slotacct_t;
+
+typedef struct {
+	atomic_uint_fast64_t	restarts;
+	atomic_uint_fast64_t	retries;
+	atomic_uint_fast64_t	root_cas_fails;
+	atomic_uint_fast64_t	lock_spins;
+	atomic_uint_fast64_t	lock_parks;
+	atomic_uint_fast64_t	splits;
+	atomic_uint_fast64_t	collapses;
+	atomic_uint_fast64_t	relocations;
+	atomic_uint_fast64_t	evictions;
+	atomic_uint_fast64_t	expirations;
+	/* Snapshot mode: the writers in progress (see snap_enter()). */
+	atomic_uint		writers;
+	/* The entries inserted minus deleted (see thmap_count()). */
+	atomic_int_fast64_t	nitems;
+	/* Memory accounting (see MEM_* below) and its batched total. */
+	atomic_uint_fast64_t	mem[MEM_NTYPES];
+	atomic_int_fast64_t	mem_batch;
+	/* Cache mode: the batched live memory (see cache_account()). */
+	atomic_int_fast64_t	cache_batch;
+	/* Huge page mode: the caches of the node and leaf arenas. */
+	thmap_hpcache_t		hp[MEM_KEY];
+} __aligned(CACHE_LINE_SIZE) thmap_shard_t;
+
+#define	THMAP_STAT_ADD(th, f, n)	\
+    atomic_fetch_add_explicit(&shard_get(th)->f, (n), memory_order_relaxed)
+
+#define	THMAP_STAT_INC(th, f)		THMAP_STAT_ADD(th, f, 1)
+
 #define	THMAP_ROOT_LEN	(sizeof(thmap_ptr_t) * ROOT_SIZE)
 
 struct thmap {
@@ -169,660 +363,4373 @@ struct thmap {
 	unsigned		flags;
 	const thmap_ops_t *	ops;
 	thmap_gc_t *_Atomic	gc_list;
-};
+	thmap_region_t *_Atomic	regions;
+	atomic_uint		region_lock;
+	thmap_cursor_t		defrag;
+	thmap_shard_t *		shards;
+	thmap_slotacct_t *	slots;
+	atomic_int_fast64_t	mem_total;
+	atomic_int_fast64_t	mem_batchlen;
+	atomic_size_t		mem_limit;
 
-static void	stage_mem_gc(thmap_t *, uintptr_t, size_t);
+	/* The node sizes and the inline value size, if in the inline mode. */
+	size_t			inode_len;
+	size_t			leaf_len;
+	size_t			vlen;
+	bool			vinline;
 
-/*
- * A few low-level helper routines.
- */
+	/*
+	 * Cache mode: the budget, the live entry count and memory (the
+	 * latter batched per shard, up to cache_batchlen) and the CLOCK hand.
+	 */
+	size_t			ref_off;
+	atomic_size_t		cache_maxitems;
+	atomic_size_t		cache_maxbytes;
+	atomic_int_fast64_t	cache_nitems;
+	atomic_int_fast64_t	cache_bytes;
+	atomic_int_fast64_t	cache_batchlen;
+	atomic_uint		clock_lock;
+	thmap_cursor_t		clock;
 
-static uintptr_t
-alloc_wrapper(size_t len)
-{
-	return (uintptr_t)malloc(len);
-}
+	/* TTL mode: the current time and the sweeper position. */
+	size_t			exp_off;
+	_Atomic uint64_t	now;
+	thmap_cursor_t		expiry;
 
-static void
-free_wrapper(uintptr_t addr, size_t len)
-{
-	free((void *)addr); (void)len;
-}
+	/* Called for the entries evicted or expired by the map itself. */
+	thmap_evict_func_t	evict_func;
+	void *			evict_arg;
 
-static const thmap_ops_t thmap_default_ops = {
-	.alloc = alloc_wrapper,
-	.free = free_wrapper
+	/*
+	 * Snapshot mode: the current generation, the live snapshots (the
+	 * newest first) and the flag stopping the writers.
+	 */
+	uint64_t		gen;
+	thmap_snapshot_t *	snapshots;
+	atomic_uint		snap_lock;
+	atomic_uint		snap_pending;
+
+	/* Huge page mode: the arenas of the intermediate nodes and leaves. */
+	thmap_hparena_t		hp[MEM_KEY];
+
+	/* Lock-free mode: the empty node the frozen empty slots point to. */
+	thmap_ptr_t		lf_empty;
+
+	/* NUMA mode: the CPU to node map and the root level replicas. */
+	unsigned		numa_nodes;
+	uint8_t *		numa_cpumap;
+	atomic_thmap_ptr_t **	numa_roots;
+	atomic_uint		numa_lock;
 };
 
+static void	stage_mem_gc(thmap_t *, uintptr_t, size_t, unsigned);
+static void	snap_enter(thmap_t *);
+static void	snap_exit(thmap_t *);
+static int	snap_unshare(thmap_t *, const void *, size_t);
+
 /*
- * NODE LOCKING.
+ * shard_get: return the counter shard of the current thread.
  */
-
-#ifdef DEBUG
-static inline bool
-node_locked_p(thmap_inode_t *node)
+static inline thmap_shard_t *
+shard_get(const thmap_t *thmap)
 {
-	return (atomic_load_relaxed(&node->state) & NODE_LOCKED) != 0;
-}
-#endif
+	static atomic_uint shard_next = 0;
+	static _Thread_local unsigned shard_idx = UINT_MAX;
 
-static void
-lock_node(thmap_inode_t *node)
-{
-	unsigned bcount = SPINLOCK_BACKOFF_MIN;
-	uint32_t s;
-again:
-	s = atomic_load_relaxed(&node->state);
-	if (s & NODE_LOCKED) {
-		SPINLOCK_BACKOFF(bcount);
-		goto again;
-	}
-	/* Acquire from prior release in unlock_node.() */
-	if (!atomic_compare_exchange_weak_explicit(&node->state,
-	    &s, s | NODE_LOCKED, memory_order_acquire, memory_order_relaxed)) {
-		bcount = SPINLOCK_BACKOFF_MIN;
-		goto again;
+	if (__predict_false(shard_idx == UINT_MAX)) {
+		shard_idx = atomic_fetch_add_explicit(&shard_next, 1,
+		    memory_order_relaxed) % THMAP_NSHARDS;
 	}
+	return &thmap->shards[shard_idx];
 }
 
-static void
-unlock_node(thmap_inode_t *node)
+/*
+ * count_add: adjust the number of entries in the shard of the thread.
+ */
+static inline void
+count_add(const thmap_t *thmap, int64_t n)
 {
-	uint32_t s = atomic_load_relaxed(&node->state) & ~NODE_LOCKED;
-
-	ASSERT(node_locked_p(node));
-	/* Release to subsequent acquire in lock_node(). */
-	atomic_store_release(&node->state, s);
+	atomic_fetch_add_explicit(&shard_get(thmap)->nitems, n,
+	    memory_order_relaxed);
 }
 
 /*
- * HASH VALUE AND KEY OPERATIONS.
+ * entry_account: account the inserted (sign is 1) or deleted (sign is -1)
+ * entry with the given key length in the root-level slot.
  */
-
 static inline void
-hashval_init(thmap_query_t *query, const void * restrict key, size_t len)
+entry_account(const thmap_t *thmap, unsigned rslot, int sign, size_t len)
 {
-	const uint32_t hashval = murmurhash3(key, len, 0);
+	thmap_slotacct_t *acct = &thmap->slots[rslot];
 
-	query->rslot = ((hashval >> ROOT_MSBITS) ^ len) & ROOT_MASK;
-	query->level = 0;
-	query->hashval = hashval;
-	query->hashidx = 0;
+	count_add(thmap, sign);
+	atomic_fetch_add_explicit(&acct->items, sign, memory_order_relaxed);
+	atomic_fetch_add_explicit(&acct->key_bytes, sign * (int64_t)len,
+	    memory_order_relaxed);
 }
 
 /*
- * hashval_getslot: given the key, compute the hash (if not already cached)
- * and return the offset for the current level.
+ * inode_account: account the created or removed intermediate nodes in
+ * the root-level slot.
  */
-static unsigned
-hashval_getslot(thmap_query_t *query, const void * restrict key, size_t len)
+static inline void
+inode_account(const thmap_t *thmap, unsigned rslot, int64_t n)
 {
-	const unsigned offset = query->level * LEVEL_BITS;
-	const unsigned shift = offset & HASHVAL_MOD;
-	const unsigned i = offset >> HASHVAL_SHIFT;
-
-	if (query->hashidx != i) {
-		/* Generate a hash value for a required range. */
-		query->hashval = murmurhash3(key, len, i);
-		query->hashidx = i;
-	}
-	return (query->hashval >> shift) & LEVEL_MASK;
+	atomic_fetch_add_explicit(&thmap->slots[rslot].inodes, n,
+	    memory_order_relaxed);
 }
 
-static unsigned
-hashval_getleafslot(const thmap_t *thmap,
-    const thmap_leaf_t *leaf, unsigned level)
-{
-	const void *key = THMAP_GETPTR(thmap, leaf->key);
-	const unsigned offset = level * LEVEL_BITS;
-	const unsigned shift = offset & HASHVAL_MOD;
-	const unsigned i = offset >> HASHVAL_SHIFT;
+/*
+ * NUMA.
+ *
+ * In the NUMA mode, the root level is replicated per node: the readers
+ * use the replica of their node, while the writers update the primary
+ * copy and then propagate the change to the replicas (see root_sync()).
+ * The nodes are allocated on the node of the inserting thread, if the
+ * alloc_node operation is provided; otherwise, the placement relies on
+ * the first-touch policy of the allocator.
+ *
+ * The topology (the CPU to node map) is taken from the THMAP_NUMA_TOPOLOGY
+ * environment variable, if set, listing the CPUs of each node, separated
+ * by semicolons, e.g. "0-3,8-11;4-7,12-15"; otherwise, from sysfs (Linux).
+ * A thread can also set its node explicitly using thmap_numa_setnode().
+ */
 
-	return (murmurhash3(key, leaf->len, i) >> shift) & LEVEL_MASK;
-}
+#define	NUMA_MAXNODES		64
+#define	NUMA_MAXCPUS		1024
 
-static inline unsigned
-hashval_getl0slot(const thmap_t *thmap, const thmap_query_t *query,
-    const thmap_leaf_t *leaf)
-{
-	if (__predict_true(query->hashidx == 0)) {
-		return query->hashval & LEVEL_MASK;
-	}
-	return hashval_getleafslot(thmap, leaf, 0);
-}
+#ifndef MPOL_PREFERRED
+#define	MPOL_PREFERRED		1
+#endif
 
-static bool
-key_cmp_p(const thmap_t *thmap, const thmap_leaf_t *leaf,
-    const void * restrict key, size_t len)
-{
-	const void *leafkey = THMAP_GETPTR(thmap, leaf->key);
-	return len == leaf->len && memcmp(key, leafkey, len) == 0;
-}
+static _Thread_local int	numa_thread_node = -1;
 
 /*
- * INTER-NODE OPERATIONS.
+ * thmap_numa_setnode: set the NUMA node of the calling thread (a negative
+ * value means the node is determined using the topology).
  */
+void
+thmap_numa_setnode(int node)
+{
+	numa_thread_node = node;
+}
 
-static thmap_inode_t *
-node_create(thmap_t *thmap, thmap_inode_t *parent)
+static inline unsigned
+numa_curnode(const thmap_t *thmap)
 {
-	thmap_inode_t *node;
-	uintptr_t p;
+	const int node = numa_thread_node;
 
-	p = thmap->ops->alloc(THMAP_INODE_LEN);
-	if (!p) {
-		return NULL;
+	if (node >= 0) {
+		return (unsigned)node % thmap->numa_nodes;
 	}
-	node = THMAP_GETPTR(thmap, p);
-	ASSERT(THMAP_ALIGNED_P(node));
+#if defined(__linux__)
+	{
+		const int cpu = sched_getcpu();
 
-	memset(node, 0, THMAP_INODE_LEN);
-	if (parent) {
-		/* Not yet published, no need for ordering. */
-		atomic_store_relaxed(&node->state, NODE_LOCKED);
-		node->parent = THMAP_GETOFF(thmap, parent);
+		if (cpu >= 0 && cpu < NUMA_MAXCPUS) {
+			return thmap->numa_cpumap[cpu];
+		}
 	}
-	return node;
+#endif
+	return 0;
 }
 
-static void
-node_insert(thmap_inode_t *node, unsigned slot, thmap_ptr_t child)
+/*
+ * numa_parse_cpulist: parse the CPU list (e.g. "0-3,8") of the node.
+ */
+static bool
+numa_parse_cpulist(uint8_t *cpumap, const char *list, unsigned node)
 {
-	ASSERT(node_locked_p(node) || node->parent == THMAP_NULL);
-	ASSERT((atomic_load_relaxed(&node->state) & NODE_DELETED) == 0);
-	ASSERT(atomic_load_relaxed(&node->slots[slot]) == THMAP_NULL);
+	const char *s = list;
 
-	ASSERT(NODE_COUNT(atomic_load_relaxed(&node->state)) < LEVEL_SIZE);
+	while (*s && *s != '\n') {
+		unsigned long lo, hi;
+		char *ep;
 
-	/*
-	 * If node is public already, caller is responsible for issuing
-	 * release fence; if node is not public, no ordering is needed.
-	 * Hence relaxed ordering.
-	 */
-	atomic_store_relaxed(&node->slots[slot], child);
-	atomic_store_relaxed(&node->state,
-	    atomic_load_relaxed(&node->state) + 1);
+		lo = hi = strtoul(s, &ep, 10);
+		if (ep == s) {
+			return false;
+		}
+		if (*ep == '-') {
+			s = ep + 1;
+			hi = strtoul(s, &ep, 10);
+			if (ep == s) {
+				return false;
+			}
+		}
+		if (lo > hi || hi >= NUMA_MAXCPUS) {
+			return false;
+		}
+		for (unsigned long cpu = lo; cpu <= hi; cpu++) {
+			cpumap[cpu] = node;
+		}
+		s = (*ep == ',') ? ep + 1 : ep;
+	}
+	return true;
 }
 
-static void
-node_remove(thmap_inode_t *node, unsigned slot)
+/*
+ * numa_topology: build the CPU to node map.
+ *
+ * => Returns 0 on success and -1 if the topology is invalid.
+ */
+static int
+numa_topology(thmap_t *thmap)
 {
-	const uint32_t state = atomic_load_relaxed(&node->state);
+	const char *env = getenv("THMAP_NUMA_TOPOLOGY");
+	unsigned nodes = 0;
 
-	ASSERT(node_locked_p(node));
-	ASSERT((state & NODE_DELETED) == 0);
-	ASSERT(atomic_load_relaxed(&node->slots[slot]) != THMAP_NULL);
+	if ((thmap->numa_cpumap = calloc(NUMA_MAXCPUS, 1)) == NULL) {
+		return -1;
+	}
+	if (env) {
+		char *list, *saveptr = NULL, *s;
 
-	ASSERT(NODE_COUNT(state) > 0);
-	ASSERT(NODE_COUNT(state) <= LEVEL_SIZE);
+		if ((list = strdup(env)) == NULL) {
+			return -1;
+		}
+		for (s = strtok_r(list, ";", &saveptr); s;
+		    s = strtok_r(NULL, ";", &saveptr)) {
+			if (nodes == NUMA_MAXNODES ||
+			    !numa_parse_cpulist(thmap->numa_cpumap, s, nodes)) {
+				free(list);
+				return -1;
+			}
+			nodes++;
+		}
+		free(list);
+	}
+#if defined(__linux__)
+	else for (unsigned i = 0; i < NUMA_MAXNODES; i++) {
+		char path[64], buf[1024];
+		FILE *fp;
 
-	/* Element will be GC-ed later; no need for ordering here. */
-	atomic_store_relaxed(&node->slots[slot], THMAP_NULL);
-	atomic_store_relaxed(&node->state, state - 1);
+		snprintf(path, sizeof(path),
+		    "/sys/devices/system/node/node%u/cpulist", i);
+		if ((fp = fopen(path, "r")) == NULL) {
+			continue;
+		}
+		if (fgets(buf, sizeof(buf), fp)) {
+			numa_parse_cpulist(thmap->numa_cpumap, buf, i);
+		}
+		fclose(fp);
+		nodes = i + 1;
+	}
+#endif
+	thmap->numa_nodes = MAX(nodes, 1);
+	return 0;
 }
 
 /*
- * LEAF OPERATIONS.
+ * numa_root_alloc: allocate the root level replica, preferably on the
+ * given node (best effort: the node might not exist, e.g. if the topology
+ * is configured).
  */
-
-static thmap_leaf_t *
-leaf_create(const thmap_t *thmap, const void *key, size_t len, void *val)
+static atomic_thmap_ptr_t *
+numa_root_alloc(unsigned node)
 {
-	thmap_leaf_t *leaf;
-	uintptr_t leaf_off, key_off;
+	void *p;
 
-	leaf_off = thmap->ops->alloc(sizeof(thmap_leaf_t));
-	if (!leaf_off) {
+	p = mmap(NULL, THMAP_ROOT_LEN, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
 		return NULL;
 	}
-	leaf = THMAP_GETPTR(thmap, leaf_off);
-	ASSERT(THMAP_ALIGNED_P(leaf));
+#if defined(__linux__) && defined(SYS_mbind)
+	if (node < sizeof(unsigned long) * CHAR_BIT) {
+		const unsigned long mask = 1UL << node;
 
-	if ((thmap->flags & THMAP_NOCOPY) == 0) {
-		/*
-		 * Copy the key.
-		 */
-		key_off = thmap->ops->alloc(len);
-		if (!key_off) {
-			thmap->ops->free(leaf_off, sizeof(thmap_leaf_t));
-			return NULL;
-		}
-		memcpy(THMAP_GETPTR(thmap, key_off), key, len);
-		leaf->key = key_off;
-	} else {
-		/* Otherwise, we use a reference. */
-		leaf->key = (uintptr_t)key;
+		(void)syscall(SYS_mbind, p, THMAP_ROOT_LEN, MPOL_PREFERRED,
+		    &mask, sizeof(mask) * CHAR_BIT, 0);
 	}
-	leaf->len = len;
-	leaf->val = val;
-	return leaf;
+#else
+	(void)node;
+#endif
+	return p;
 }
 
 static void
-leaf_free(const thmap_t *thmap, thmap_leaf_t *leaf)
+numa_fini(thmap_t *thmap)
 {
-	if ((thmap->flags & THMAP_NOCOPY) == 0) {
-		thmap->ops->free(leaf->key, leaf->len);
+	if (thmap->numa_roots) {
+		for (unsigned i = 0; i < thmap->numa_nodes; i++) {
+			if (thmap->numa_roots[i]) {
+				munmap(thmap->numa_roots[i], THMAP_ROOT_LEN);
+			}
+		}
+		free(thmap->numa_roots);
 	}
-	thmap->ops->free(THMAP_GETOFF(thmap, leaf), sizeof(thmap_leaf_t));
+	free(thmap->numa_cpumap);
 }
 
-static thmap_leaf_t *
-get_leaf(const thmap_t *thmap, thmap_inode_t *parent, unsigned slot)
+static int
+numa_init(thmap_t *thmap)
 {
-	thmap_ptr_t node;
-
-	/* Consume from prior release in thmap_put(). */
-	node = atomic_load_consume(&parent->slots[slot]);
-	if (THMAP_INODE_P(node)) {
-		return NULL;
+	if (numa_topology(thmap) == -1) {
+		return -1;
 	}
-	return THMAP_NODE(thmap, node);
+	thmap->numa_roots = calloc(thmap->numa_nodes,
+	    sizeof(atomic_thmap_ptr_t *));
+	if (!thmap->numa_roots) {
+		return -1;
+	}
+	for (unsigned i = 0; i < thmap->numa_nodes; i++) {
+		if ((thmap->numa_roots[i] = numa_root_alloc(i)) == NULL) {
+			return -1;
+		}
+	}
+	return 0;
 }
 
 /*
- * ROOT OPERATIONS.
+ * root_view: return the root level to be used by the readers.
  */
+static inline atomic_thmap_ptr_t *
+root_view(const thmap_t *thmap)
+{
+	if (__predict_false(thmap->flags & THMAP_NUMA)) {
+		return thmap->numa_roots[numa_curnode(thmap)];
+	}
+	return thmap->root;
+}
 
 /*
- * root_try_put: Try to set a root pointer at query->rslot.
+ * root_sync: propagate the root-level slot from the primary copy to the
+ * replicas.  Must be called after each change of the root-level slot.
  *
- * => Implies release operation on success.
- * => Implies no ordering on failure.
+ * => The slot is loaded and propagated under the lock, therefore the
+ *    replicas cannot be left with a value older than the primary.
  */
-static inline bool
-root_try_put(thmap_t *thmap, const thmap_query_t *query, thmap_leaf_t *leaf)
+static void
+root_sync(thmap_t *thmap, unsigned i)
 {
-	thmap_ptr_t expected;
-	const unsigned i = query->rslot;
-	thmap_inode_t *node;
-	thmap_ptr_t nptr;
-	unsigned slot;
+	unsigned bcount = SPINLOCK_BACKOFF_MIN;
+	unsigned expected;
+	thmap_ptr_t root;
 
-	/*
-	 * Must pre-check first.  No ordering required because we will
-	 * check again before taking any actions, and start over if
-	 * this changes from null.
-	 */
-	if (atomic_load_relaxed(&thmap->root[i])) {
-		return false;
+	if ((thmap->flags & THMAP_NUMA) == 0) {
+		return;
 	}
-
-	/*
-	 * Create an intermediate node.  Since there is no parent set,
-	 * it will be created unlocked and the CAS operation will
-	 * release it to readers.
-	 */
-	node = node_create(thmap, NULL);
-	slot = hashval_getl0slot(thmap, query, leaf);
-	node_insert(node, slot, THMAP_GETOFF(thmap, leaf) | THMAP_LEAF_BIT);
-	nptr = THMAP_GETOFF(thmap, node);
 again:
-	if (atomic_load_relaxed(&thmap->root[i])) {
-		thmap->ops->free(nptr, THMAP_INODE_LEN);
-		return false;
-	}
-	/* Release to subsequent consume in find_edge_node(). */
-	expected = THMAP_NULL;
-	if (!atomic_compare_exchange_weak_explicit(&thmap->root[i], &expected,
-	    nptr, memory_order_release, memory_order_relaxed)) {
+	expected = 0;
+	if (!atomic_compare_exchange_weak_explicit(&thmap->numa_lock,
+	    &expected, 1, memory_order_acquire, memory_order_relaxed)) {
+		SPINLOCK_BACKOFF(bcount);
 		goto again;
 	}
-	return true;
+	/* Acquire from the release in root_try_put() et al. */
+	root = atomic_load_acquire(&thmap->root[i]);
+	for (unsigned n = 0; n < thmap->numa_nodes; n++) {
+		/* Release to subsequent consume in find_edge_node(). */
+		atomic_store_release(&thmap->numa_roots[n][i], root);
+	}
+	atomic_store_release(&thmap->numa_lock, 0);
 }
 
 /*
- * find_edge_node: given the hash, traverse the tree to find the edge node.
- *
- * => Returns an aligned (clean) pointer to the parent node.
- * => Returns the slot number and sets current level.
+ * root_catchup: propagate the root-level slot if any replica lags behind
+ * the primary copy, i.e. the writer which changed it has not reached its
+ * root_sync() yet.  Called by the writers once they have locked the edge
+ * node found via the primary copy, so that their update is visible via
+ * every replica by the time they return (otherwise, e.g., a thread could
+ * miss its own completed insert).
  */
-static thmap_inode_t *
-find_edge_node(const thmap_t *thmap, thmap_query_t *query,
-    const void * restrict key, size_t len, unsigned *slot)
+static inline void
+root_catchup(thmap_t *thmap, unsigned i)
 {
-	thmap_ptr_t root_slot;
-	thmap_inode_t *parent;
-	thmap_ptr_t node;
-	unsigned off;
+	thmap_ptr_t root;
 
-	ASSERT(query->level == 0);
+	if ((thmap->flags & THMAP_NUMA) == 0) {
+		return;
+	}
+	root = atomic_load_relaxed(&thmap->root[i]);
+	for (unsigned n = 0; n < thmap->numa_nodes; n++) {
+		if (atomic_load_relaxed(&thmap->numa_roots[n][i]) != root) {
+			root_sync(thmap, i);
+			return;
+		}
+	}
+}
 
-	/* Consume from prior release in root_try_put(). */
-	root_slot = atomic_load_consume(&thmap->root[query->rslot]);
-	parent = THMAP_NODE(thmap, root_slot);
-	if (!parent) {
-		return NULL;
+/*
+ * HUGE PAGES.
+ *
+ * In the huge page mode (THMAP_HUGEPAGE), the intermediate nodes and the
+ * leaves are carved from the 2 MB chunks of anonymous memory, backed by
+ * the huge pages if possible: the reserved ones (MAP_HUGETLB) or, failing
+ * that, the transparent huge pages (a 2 MB aligned mapping advised with
+ * MADV_HUGEPAGE).  Each object type has its own arena, so the intermediate
+ * nodes, which are walked by every lookup, are packed together and the
+ * descent touches fewer TLB entries.  The keys are allocated using the
+ * operations of the map, as usual.
+ *
+ * The objects are of a fixed size per type, therefore the freed ones are
+ * simply kept on a free list for the reuse.  To avoid serializing the
+ * writers on the arena, each shard (i.e. thread, see shard_get()) has its
+ * own cache: it carves the objects from a slab taken from the chunk and
+ * keeps the freed objects on its own free list.  The arena lock is taken
+ * only to get a new slab or to pass a batch of the free objects between
+ * the shards: once the free list of a shard reaches a full batch, it is
+ * moved to the arena, from which the other shards take it before carving
+ * the new slabs.  The chunks are unmapped when the map is destroyed.
+ */
+
+#define	HP_CHUNK_SIZE		(2UL * 1024 * 1024)
+#define	HP_CHUNK_HDR		CACHE_LINE_SIZE
+#define	HP_SLAB_SIZE		(64 * 1024)
+#define	HP_FREE_BATCH		64
+#define	HP_OBJ_LEN(len)		roundup2((len), sizeof(uint64_t))
+
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+#define	HP_MAP_HUGETLB		(MAP_HUGETLB | (21 << MAP_HUGE_SHIFT))
+#elif defined(MAP_HUGETLB)
+#define	HP_MAP_HUGETLB		MAP_HUGETLB
+#endif
+
+static inline bool
+hp_type_p(const thmap_t *thmap, unsigned type)
+{
+	return (thmap->flags & THMAP_HUGEPAGE) != 0 && type != MEM_KEY;
+}
+
+static void
+hp_lock(atomic_uint *lock)
+{
+	unsigned bcount = SPINLOCK_BACKOFF_MIN;
+	unsigned expected;
+again:
+	expected = 0;
+	if (!atomic_compare_exchange_weak_explicit(lock,
+	    &expected, 1, memory_order_acquire, memory_order_relaxed)) {
+		SPINLOCK_BACKOFF(bcount);
+		goto again;
 	}
-descend:
-	off = hashval_getslot(query, key, len);
-	/* Consume from prior release in thmap_put(). */
-	node = atomic_load_consume(&parent->slots[off]);
+}
 
-	/* Descend the tree until we find a leaf or empty slot. */
-	if (node && THMAP_INODE_P(node)) {
-		parent = THMAP_NODE(thmap, node);
-		query->level++;
-		goto descend;
+static void
+hp_unlock(atomic_uint *lock)
+{
+	atomic_store_release(lock, 0);
+}
+
+/*
+ * hp_map: map a 2 MB aligned chunk, preferably backed by a huge page.
+ *
+ * => Returns NULL if the memory could not be mapped.
+ */
+static void *
+hp_map(void)
+{
+	const int prot = PROT_READ | PROT_WRITE;
+	const int mflags = MAP_PRIVATE | MAP_ANONYMOUS;
+	uintptr_t addr, chunk;
+	void *p;
+
+#if defined(HP_MAP_HUGETLB)
+	/* The reserved huge pages, if any are configured and available. */
+	p = mmap(NULL, HP_CHUNK_SIZE, prot, mflags | HP_MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED) {
+		return p;
 	}
+#endif
 	/*
-	 * NODE_DELETED does not become stale until GC runs, which
-	 * cannot happen while we are in the middle of an operation,
-	 * hence relaxed ordering.
+	 * Otherwise, map twice the size and trim it to the aligned chunk,
+	 * so that it can be backed by a transparent huge page.
 	 */
-	if (atomic_load_relaxed(&parent->state) & NODE_DELETED) {
+	p = mmap(NULL, 2 * HP_CHUNK_SIZE, prot, mflags, -1, 0);
+	if (p == MAP_FAILED) {
 		return NULL;
 	}
-	*slot = off;
-	return parent;
+	addr = (uintptr_t)p;
+	chunk = roundup2(addr, HP_CHUNK_SIZE);
+	if (chunk != addr) {
+		munmap(p, chunk - addr);
+	}
+	munmap((void *)(chunk + HP_CHUNK_SIZE), addr + HP_CHUNK_SIZE - chunk);
+#if defined(MADV_HUGEPAGE)
+	(void)madvise((void *)chunk, HP_CHUNK_SIZE, MADV_HUGEPAGE);
+#endif
+	return (void *)chunk;
 }
 
 /*
- * find_edge_node_locked: traverse the tree, like find_edge_node(),
- * but attempt to lock the edge node.
+ * hp_refill: refill the cache of the shard from the arena, either with
+ * a batch of the free objects or with a new slab.
  *
- * => Returns NULL if the deleted node is found.  This indicates that
- *    the caller must re-try from the root, as the root slot might have
- *    changed too.
+ * => The cache must be locked; the tail of its slab is wasted.
+ * => Returns 0 on success and -1 if no memory could be mapped.
  */
-static thmap_inode_t *
-find_edge_node_locked(const thmap_t *thmap, thmap_query_t *query,
-    const void * restrict key, size_t len, unsigned *slot)
+static int
+hp_refill(thmap_t *thmap, unsigned type, thmap_hpcache_t *hc, size_t len)
 {
-	thmap_inode_t *node;
-	thmap_ptr_t target;
-retry:
-	/*
-	 * Find the edge node and lock it!  Re-check the state since
-	 * the tree might change by the time we acquire the lock.
-	 */
-	node = find_edge_node(thmap, query, key, len, slot);
-	if (!node) {
-		/* The root slot is empty -- let the caller decide. */
-		query->level = 0;
-		return NULL;
-	}
-	lock_node(node);
-	if (__predict_false(atomic_load_relaxed(&node->state) & NODE_DELETED)) {
-		/*
-		 * The node has been deleted.  The tree might have a new
-		 * shape now, therefore we must re-start from the root.
-		 */
-		unlock_node(node);
-		query->level = 0;
-		return NULL;
+	thmap_hparena_t *arena = &thmap->hp[type];
+	size_t slab;
+
+	hp_lock(&arena->lock);
+	if (arena->batches) {
+		/* The batches are linked through the second word. */
+		hc->free = arena->batches;
+		hc->nfree = HP_FREE_BATCH;
+		arena->batches = ((uintptr_t *)hc->free)[1];
+		goto out;
 	}
-	target = atomic_load_relaxed(&node->slots[*slot]);
-	if (__predict_false(target && THMAP_INODE_P(target))) {
-		/*
-		 * The target slot has been changed and it is now an
-		 * intermediate node.  Re-start from the top internode.
-		 */
-		unlock_node(node);
-		query->level = 0;
-		goto retry;
+	if (arena->end - arena->cur < len) {
+		void *chunk;
+
+		/* Map a new chunk; the tail of the current one is wasted. */
+		if ((chunk = hp_map()) == NULL) {
+			hp_unlock(&arena->lock);
+			return -1;
+		}
+		*(uintptr_t *)chunk = arena->chunks;
+		arena->chunks = (uintptr_t)chunk;
+		arena->cur = (uintptr_t)chunk + HP_CHUNK_HDR;
+		arena->end = (uintptr_t)chunk + HP_CHUNK_SIZE;
 	}
-	return node;
+	slab = MIN(MAX(HP_SLAB_SIZE, len), arena->end - arena->cur);
+	hc->cur = arena->cur;
+	hc->end = arena->cur + slab;
+	arena->cur += slab;
+out:
+	hp_unlock(&arena->lock);
+	return 0;
 }
 
 /*
- * thmap_get: lookup a value given the key.
+ * hp_alloc: allocate an object of the given type from the cache of the
+ * shard, refilling it from the arena if needed.
+ *
+ * => Returns the object (relative to the base) or zero on failure.
  */
-void *
-thmap_get(thmap_t *thmap, const void *key, size_t len)
+static uintptr_t
+hp_alloc(thmap_t *thmap, unsigned type, size_t len)
 {
-	thmap_query_t query;
-	thmap_inode_t *parent;
-	thmap_leaf_t *leaf;
-	unsigned slot;
+	thmap_hpcache_t *hc = &shard_get(thmap)->hp[type];
+	uintptr_t addr;
 
-	hashval_init(&query, key, len);
-	parent = find_edge_node(thmap, &query, key, len, &slot);
-	if (!parent) {
-		return NULL;
-	}
-	leaf = get_leaf(thmap, parent, slot);
-	if (!leaf) {
-		return NULL;
+	len = HP_OBJ_LEN(len);
+	hp_lock(&hc->lock);
+	if (hc->free == 0 && hc->end - hc->cur < len &&
+	    hp_refill(thmap, type, hc, len) == -1) {
+		hp_unlock(&hc->lock);
+		return 0;
 	}
-	if (!key_cmp_p(thmap, leaf, key, len)) {
-		return NULL;
+	if ((addr = hc->free) != 0) {
+		/* The free object holds the next one. */
+		hc->free = *(uintptr_t *)addr;
+		hc->nfree--;
+	} else {
+		addr = hc->cur;
+		hc->cur += len;
 	}
-	return leaf->val;
+	hp_unlock(&hc->lock);
+	return THMAP_GETOFF(thmap, addr);
 }
 
 /*
- * thmap_put: insert a value given the key.
- *
- * => If the key is already present, return the associated value.
- * => Otherwise, on successful insert, return the given value.
+ * hp_free: put the object on the free list of the shard; a full batch
+ * is moved to the arena first, for the reuse by the other shards.
  */
-void *
-thmap_put(thmap_t *thmap, const void *key, size_t len, void *val)
+static void
+hp_free(thmap_t *thmap, unsigned type, uintptr_t off)
 {
-	thmap_query_t query;
-	thmap_leaf_t *leaf, *other;
-	thmap_inode_t *parent, *child;
-	unsigned slot, other_slot;
-	thmap_ptr_t target;
+	thmap_hpcache_t *hc = &shard_get(thmap)->hp[type];
+	uintptr_t *obj = THMAP_GETPTR(thmap, off);
 
-	/*
-	 * First, pre-allocate and initialize the leaf node.
-	 */
-	leaf = leaf_create(thmap, key, len, val);
-	if (__predict_false(!leaf)) {
-		return NULL;
+	hp_lock(&hc->lock);
+	if (hc->nfree == HP_FREE_BATCH) {
+		thmap_hparena_t *arena = &thmap->hp[type];
+
+		/* The objects have at least two words (see leaf_setup()). */
+		hp_lock(&arena->lock);
+		((uintptr_t *)hc->free)[1] = arena->batches;
+		arena->batches = hc->free;
+		hp_unlock(&arena->lock);
+		hc->free = 0;
+		hc->nfree = 0;
 	}
-	hashval_init(&query, key, len);
-retry:
-	/*
-	 * Try to insert into the root first, if its slot is empty.
-	 */
-	if (root_try_put(thmap, &query, leaf)) {
-		/* Success: the leaf was inserted; no locking involved. */
-		return val;
+	*obj = hc->free;
+	hc->free = (uintptr_t)obj;
+	hc->nfree++;
+	hp_unlock(&hc->lock);
+}
+
+/*
+ * hp_fini: unmap all chunks; the map must have no objects left.
+ */
+static void
+hp_fini(thmap_t *thmap)
+{
+	for (unsigned i = 0; i < MEM_KEY; i++) {
+		thmap_hparena_t *arena = &thmap->hp[i];
+
+		while (arena->chunks) {
+			void *chunk = (void *)arena->chunks;
+
+			arena->chunks = *(uintptr_t *)chunk;
+			munmap(chunk, HP_CHUNK_SIZE);
+		}
 	}
+}
 
-	/*
-	 * Release node via store in node_insert (*) to subsequent
-	 * consume in get_leaf() or find_edge_node().
-	 */
-	atomic_thread_fence(memory_order_release);
+/*
+ * MEMORY ACCOUNTING.
+ */
 
-	/*
-	 * Find the edge node and the target slot.
-	 */
-	parent = find_edge_node_locked(thmap, &query, key, len, &slot);
-	if (!parent) {
-		goto retry;
+/*
+ * cache_account: track the number of live leaves and the live memory
+ * (i.e. excluding the memory pending G/C) in the cache mode.
+ */
+static inline void
+cache_account(thmap_t *thmap, unsigned type, int64_t len)
+{
+	thmap_shard_t *shard;
+	int64_t batch, batchlen;
+
+	if ((thmap->flags & THMAP_CACHE) == 0 || type == MEM_GC) {
+		return;
 	}
-	target = atomic_load_relaxed(&parent->slots[slot]); // tagged offset
-	if (THMAP_INODE_P(target)) {
-		/*
-		 * Empty slot: simply insert the new leaf.  The release
-		 * fence is already issued for us.
-		 */
-		target = THMAP_GETOFF(thmap, leaf) | THMAP_LEAF_BIT;
-		node_insert(parent, slot, target); /* (*) */
-		goto out;
+	if (type == MEM_LEAF) {
+		atomic_fetch_add_explicit(&thmap->cache_nitems,
+		    len / (int64_t)THMAP_LEAF_LEN(thmap), memory_order_relaxed);
 	}
 
-	/*
-	 * Collision or duplicate.
-	 */
-	other = THMAP_NODE(thmap, target);
-	if (key_cmp_p(thmap, other, key, len)) {
-		/*
-		 * Duplicate.  Free the pre-allocated leaf and
-		 * return the present value.
-		 */
-		leaf_free(thmap, leaf);
-		val = other->val;
-		goto out;
+	/* Batched as the total, see mem_account() below. */
+	shard = shard_get(thmap);
+	batchlen = atomic_load_relaxed(&thmap->cache_batchlen);
+	batch = atomic_fetch_add_explicit(&shard->cache_batch, len,
+	    memory_order_relaxed) + len;
+	if (__predict_false(batch >= batchlen || batch <= -batchlen)) {
+		batch = atomic_exchange_explicit(&shard->cache_batch, 0,
+		    memory_order_relaxed);
+		atomic_fetch_add_explicit(&thmap->cache_bytes, batch,
+		    memory_order_relaxed);
 	}
-descend:
-	/*
-	 * Collision -- expand the tree.  Create an intermediate node
-	 * which will be locked (NODE_LOCKED) for us.  At this point,
-	 * we advance to the next level.
+}
+
+static void
+mem_account(thmap_t *thmap, unsigned type, int64_t len)
+{
+	thmap_shard_t *shard = shard_get(thmap);
+	const int64_t batchlen = atomic_load_relaxed(&thmap->mem_batchlen);
+	int64_t batch;
+
+	cache_account(thmap, type, len);
+	atomic_fetch_add_explicit(&shard->mem[type], (uint64_t)len,
+	    memory_order_relaxed);
+	batch = atomic_fetch_add_explicit(&shard->mem_batch, len,
+	    memory_order_relaxed) + len;
+	if (__predict_false(batch >= batchlen || batch <= -batchlen)) {
+		/* Propagate the batch to the global counter. */
+		batch = atomic_exchange_explicit(&shard->mem_batch, 0,
+		    memory_order_relaxed);
+		atomic_fetch_add_explicit(&thmap->mem_total, batch,
+		    memory_order_relaxed);
+	}
+}
+
+static uintptr_t
+mem_alloc(thmap_t *thmap, size_t len, unsigned type)
+{
+	const thmap_ops_t *ops = thmap->ops;
+	uintptr_t addr;
+
+	if (hp_type_p(thmap, type)) {
+		addr = hp_alloc(thmap, type, len);
+	} else if ((thmap->flags & THMAP_NUMA) && ops->alloc_node) {
+		addr = ops->alloc_node(len, numa_curnode(thmap));
+	} else {
+		addr = ops->alloc(len);
+	}
+	if (__predict_true(addr)) {
+		mem_account(thmap, type, len);
+	}
+	return addr;
+}
+
+/*
+ * mem_release: release the memory, without the accounting.
+ */
+static void
+mem_release(thmap_t *thmap, uintptr_t addr, size_t len, unsigned type)
+{
+	if (hp_type_p(thmap, type)) {
+		hp_free(thmap, type, addr);
+	} else {
+		thmap->ops->free(addr, len);
+	}
+}
+
+static void
+mem_free(thmap_t *thmap, uintptr_t addr, size_t len, unsigned type)
+{
+	mem_release(thmap, addr, len, type);
+	mem_account(thmap, type, -(int64_t)len);
+}
+
+/*
+ * mem_limit_p: return true if there is a memory limit and allocating the
+ * given amount of memory would exceed it.
+ */
+static inline bool
+mem_limit_p(const thmap_t *thmap, size_t len)
+{
+	const int64_t limit = (int64_t)atomic_load_relaxed(&thmap->mem_limit);
+	int64_t total;
+
+	if (__predict_true(limit == 0)) {
+		return false;
+	}
+
+	/*
+	 * The global counter lags behind by at most a batch per shard;
+	 * get the precise total only if close to the limit.
 	 */
-	child = node_create(thmap, parent);
-	if (__predict_false(!child)) {
-		leaf_free(thmap, leaf);
-		val = NULL;
-		goto out;
+	total = atomic_load_relaxed(&thmap->mem_total);
+	if (__predict_true(total + (int64_t)len + THMAP_NSHARDS *
+	    atomic_load_relaxed(&thmap->mem_batchlen) <= limit)) {
+		return false;
 	}
-	query.level++;
+	total = (int64_t)thmap_memory_usage(thmap, NULL);
+	return total + (int64_t)len > limit;
+}
+
+/*
+ * A few low-level helper routines.
+ */
+
+static uintptr_t
+alloc_wrapper(size_t len)
+{
+	return (uintptr_t)malloc(len);
+}
+
+static void
+free_wrapper(uintptr_t addr, size_t len)
+{
+	free((void *)addr); (void)len;
+}
+
+static const thmap_ops_t thmap_default_ops = {
+	.alloc = alloc_wrapper,
+	.free = free_wrapper
+};
+
+/*
+ * NODE LOCKING.
+ */
+
+/*
+ * The number of the spin (back-off) iterations before parking.
+ */
+#define	LOCK_SPIN_LIMIT		(64)
+
+#ifdef DEBUG
+static inline bool
+node_locked_p(thmap_inode_t *node)
+{
+	return (atomic_load_relaxed(&node->state) & NODE_LOCKED) != 0;
+}
+#endif
+
+/*
+ * Parking primitives: wait while the word has the given value and wake
+ * up a waiter.  Note: not using FUTEX_PRIVATE_FLAG, as the nodes might
+ * be in the shared memory.
+ */
+
+static inline void
+park_wait(atomic_uint_least32_t *addr, uint32_t val)
+{
+#if defined(__linux__)
+	(void)syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+#else
+	(void)addr; (void)val;
+	sched_yield();
+#endif
+}
+
+static inline void
+park_wake(atomic_uint_least32_t *addr)
+{
+#if defined(__linux__)
+	(void)syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+#else
+	(void)addr;
+#endif
+}
+
+/*
+ * lock_node_park: register as a waiter and sleep until the lock is
+ * released, then acquire it.
+ */
+static void
+lock_node_park(thmap_inode_t *node)
+{
+	uint32_t s;
 
 	/*
-	 * Insert the other (colliding) leaf first.  The new child is
-	 * not yet published, so memory order is relaxed.
+	 * Note: the waiter registration and the state check are ordered
+	 * against the unlock and the waiter check in unlock_node().
 	 */
-	other_slot = hashval_getleafslot(thmap, other, query.level);
-	target = THMAP_GETOFF(thmap, other) | THMAP_LEAF_BIT;
-	node_insert(child, other_slot, target);
+	atomic_fetch_add_explicit(&node->waiters, 1, memory_order_seq_cst);
+	for (;;) {
+		s = atomic_load_explicit(&node->state, memory_order_seq_cst);
+		if ((s & NODE_LOCKED) == 0) {
+			if (atomic_compare_exchange_weak_explicit(&node->state,
+			    &s, s | NODE_LOCKED, memory_order_acquire,
+			    memory_order_relaxed)) {
+				break;
+			}
+			continue;
+		}
+		park_wait(&node->state, s);
+	}
+	atomic_fetch_sub_explicit(&node->waiters, 1, memory_order_relaxed);
+}
+
+static void
+lock_node(const thmap_t *thmap, thmap_inode_t *node)
+{
+	unsigned bcount = SPINLOCK_BACKOFF_MIN, nspins = 0;
+	uint32_t s;
+
+	if (thmap->flags & THMAP_SINGLEWRITER) {
+		/*
+		 * There are no other writers: just mark the node, so that
+		 * the lock state remains consistent (no R/M/W needed).
+		 */
+		s = atomic_load_relaxed(&node->state);
+		ASSERT((s & NODE_LOCKED) == 0);
+		atomic_store_relaxed(&node->state, s | NODE_LOCKED);
+		return;
+	}
+again:
+	s = atomic_load_relaxed(&node->state);
+	if (s & NODE_LOCKED) {
+		if ((thmap->flags & THMAP_PARKLOCK) &&
+		    nspins >= LOCK_SPIN_LIMIT) {
+			/* Spun for long enough: park. */
+			THMAP_STAT_ADD(thmap, lock_spins, nspins);
+			THMAP_STAT_INC(thmap, lock_parks);
+			lock_node_park(node);
+			return;
+		}
+		SPINLOCK_BACKOFF(bcount);
+		nspins++;
+		goto again;
+	}
+	/* Acquire from prior release in unlock_node() */
+	if (!atomic_compare_exchange_weak_explicit(&node->state,
+	    &s, s | NODE_LOCKED, memory_order_acquire, memory_order_relaxed)) {
+		bcount = SPINLOCK_BACKOFF_MIN;
+		nspins++;
+		goto again;
+	}
+	if (__predict_false(nspins)) {
+		THMAP_STAT_ADD(thmap, lock_spins, nspins);
+	}
+}
+
+static void
+unlock_node(const thmap_t *thmap, thmap_inode_t *node)
+{
+	uint32_t s = atomic_load_relaxed(&node->state) & ~NODE_LOCKED;
+
+	ASSERT(node_locked_p(node));
+	if (thmap->flags & THMAP_SINGLEWRITER) {
+		/* No writer to synchronize with, see lock_node(). */
+		atomic_store_relaxed(&node->state, s);
+		return;
+	}
+	if ((thmap->flags & THMAP_PARKLOCK) == 0) {
+		/* Release to subsequent acquire in lock_node(). */
+		atomic_store_release(&node->state, s);
+		return;
+	}
 
 	/*
-	 * Insert the intermediate node into the parent node.
-	 * It becomes the new parent for the our new leaf.
-	 *
-	 * Ensure that stores to the child (and leaf) reach global
-	 * visibility before it gets inserted to the parent, as
-	 * consumed by get_leaf() or find_edge_node().
+	 * Release the lock and wake up a parked waiter, if any.  See the
+	 * lock_node_park() on the ordering.
 	 */
-	atomic_store_release(&parent->slots[slot], THMAP_GETOFF(thmap, child));
+	atomic_store_explicit(&node->state, s, memory_order_seq_cst);
+	if (atomic_load_explicit(&node->waiters, memory_order_seq_cst)) {
+		park_wake(&node->state);
+	}
+}
+
+/*
+ * HASH VALUE AND KEY OPERATIONS.
+ */
+
+static inline void
+hashval_init(thmap_query_t *query, const void * restrict key, size_t len)
+{
+	const uint32_t hashval = murmurhash3(key, len, 0);
+
+	query->rslot = ((hashval >> ROOT_MSBITS) ^ len) & ROOT_MASK;
+	query->level = 0;
+	query->hashval = hashval;
+	query->hashidx = 0;
+}
+
+/*
+ * hashval_getslot: given the key, compute the hash (if not already cached)
+ * and return the offset for the current level.
+ */
+static unsigned
+hashval_getslot(thmap_query_t *query, const void * restrict key, size_t len)
+{
+	const unsigned offset = query->level * LEVEL_BITS;
+	const unsigned shift = offset & HASHVAL_MOD;
+	const unsigned i = offset >> HASHVAL_SHIFT;
+
+	if (query->hashidx != i) {
+		/* Generate a hash value for a required range. */
+		query->hashval = murmurhash3(key, len, i);
+		query->hashidx = i;
+	}
+	return (query->hashval >> shift) & LEVEL_MASK;
+}
+
+static unsigned
+hashval_getleafslot(const thmap_t *thmap,
+    const thmap_leaf_t *leaf, unsigned level)
+{
+	const void *key = THMAP_GETPTR(thmap, leaf->key);
+	const unsigned offset = level * LEVEL_BITS;
+	const unsigned shift = offset & HASHVAL_MOD;
+	const unsigned i = offset >> HASHVAL_SHIFT;
+
+	return (murmurhash3(key, leaf->len, i) >> shift) & LEVEL_MASK;
+}
+
+static inline unsigned
+hashval_getl0slot(const thmap_t *thmap, const thmap_query_t *query,
+    const thmap_leaf_t *leaf)
+{
+	if (__predict_true(query->hashidx == 0)) {
+		return query->hashval & LEVEL_MASK;
+	}
+	return hashval_getleafslot(thmap, leaf, 0);
+}
+
+static bool
+key_cmp_p(const thmap_t *thmap, const thmap_leaf_t *leaf,
+    const void * restrict key, size_t len)
+{
+	const void *leafkey = THMAP_GETPTR(thmap, leaf->key);
+	return len == leaf->len && memcmp(key, leafkey, len) == 0;
+}
+
+/*
+ * INTER-NODE OPERATIONS.
+ */
+
+static thmap_inode_t *
+node_create(thmap_t *thmap, thmap_inode_t *parent)
+{
+	thmap_inode_t *node;
+	uintptr_t p;
+
+	p = mem_alloc(thmap, THMAP_INODE_LEN(thmap), MEM_INODE);
+	if (!p) {
+		return NULL;
+	}
+	node = THMAP_GETPTR(thmap, p);
+	ASSERT(THMAP_ALIGNED_P(node));
+
+	memset(node, 0, THMAP_INODE_LEN(thmap));
+	if (thmap->flags & THMAP_SNAPSHOT) {
+		*THMAP_INODE_GEN(node) = thmap->gen;
+	}
+	if (parent) {
+		/* Not yet published, no need for ordering. */
+		atomic_store_relaxed(&node->state, NODE_LOCKED);
+		node->parent = THMAP_GETOFF(thmap, parent);
+	}
+	return node;
+}
+
+static void
+node_insert(thmap_inode_t *node, unsigned slot, thmap_ptr_t child)
+{
+	ASSERT(node_locked_p(node) || node->parent == THMAP_NULL);
+	ASSERT((atomic_load_relaxed(&node->state) & NODE_DELETED) == 0);
+	ASSERT(atomic_load_relaxed(&node->slots[slot]) == THMAP_NULL);
+
+	ASSERT(NODE_COUNT(atomic_load_relaxed(&node->state)) < LEVEL_SIZE);
+
+	/*
+	 * If node is public already, caller is responsible for issuing
+	 * release fence; if node is not public, no ordering is needed.
+	 * Hence relaxed ordering.
+	 */
+	atomic_store_relaxed(&node->slots[slot], child);
+	atomic_store_relaxed(&node->state,
+	    atomic_load_relaxed(&node->state) + 1);
+}
+
+static void
+node_remove(thmap_inode_t *node, unsigned slot)
+{
+	const uint32_t state = atomic_load_relaxed(&node->state);
+
+	ASSERT(node_locked_p(node));
+	ASSERT((state & NODE_DELETED) == 0);
+	ASSERT(atomic_load_relaxed(&node->slots[slot]) != THMAP_NULL);
+
+	ASSERT(NODE_COUNT(state) > 0);
+	ASSERT(NODE_COUNT(state) <= LEVEL_SIZE);
+
+	/* Element will be GC-ed later; no need for ordering here. */
+	atomic_store_relaxed(&node->slots[slot], THMAP_NULL);
+	atomic_store_relaxed(&node->state, state - 1);
+}
+
+/*
+ * LEAF OPERATIONS.
+ */
+
+/*
+ * leaf_val: return the value of the leaf or, in the inline value mode,
+ * the pointer to the value stored in the leaf.
+ */
+static inline void *
+leaf_val(const thmap_t *thmap, const thmap_leaf_t *leaf)
+{
+	if (thmap->vinline) {
+		return THMAP_LEAF_VAL(leaf);
+	}
+	/* Consume from prior release in leaf_replace(). */
+	return atomic_load_consume(&leaf->val);
+}
+
+static void
+leaf_setval(thmap_t *thmap, thmap_leaf_t *leaf, const void *val)
+{
+	if (thmap->vinline) {
+		if (thmap->vlen) {
+			memcpy(THMAP_LEAF_VAL(leaf), val, thmap->vlen);
+		}
+		return;
+	}
+	atomic_store_relaxed(&leaf->val, (void *)(uintptr_t)val);
+}
+
+/*
+ * leaf_touch: set the reference bit of the leaf in the cache mode.
+ * Avoid dirtying the cache line if the bit is already set.
+ */
+static inline void
+leaf_touch(const thmap_t *thmap, const thmap_leaf_t *leaf)
+{
+	if (thmap->flags & THMAP_CACHE) {
+		atomic_uint *ref = THMAP_LEAF_REF(thmap, leaf);
+
+		if (!atomic_load_relaxed(ref)) {
+			atomic_store_relaxed(ref, 1);
+		}
+	}
+}
+
+/*
+ * leaf_expired_p: return true if the leaf has expired by the given time.
+ */
+static inline bool
+leaf_expired_p(const thmap_t *thmap, const thmap_leaf_t *leaf, uint64_t now)
+{
+	uint64_t expire;
+
+	if ((thmap->flags & THMAP_TTL) == 0) {
+		return false;
+	}
+	expire = atomic_load_relaxed(THMAP_LEAF_EXP(thmap, leaf));
+	return expire && expire <= now;
+}
+
+/*
+ * leaf_live_p: return false if the leaf has expired, i.e. it must be
+ * treated as missing even though it is not yet removed.
+ */
+static inline bool
+leaf_live_p(const thmap_t *thmap, const thmap_leaf_t *leaf)
+{
+	return !leaf_expired_p(thmap, leaf, atomic_load_relaxed(&thmap->now));
+}
+
+static thmap_leaf_t *
+leaf_create(thmap_t *thmap, const void *key, size_t len, void *val)
+{
+	thmap_leaf_t *leaf;
+	uintptr_t leaf_off, key_off;
+
+	leaf_off = mem_alloc(thmap, THMAP_LEAF_LEN(thmap), MEM_LEAF);
+	if (!leaf_off) {
+		return NULL;
+	}
+	leaf = THMAP_GETPTR(thmap, leaf_off);
+	ASSERT(THMAP_ALIGNED_P(leaf));
+
+	if ((thmap->flags & THMAP_NOCOPY) == 0) {
+		/*
+		 * Copy the key.
+		 */
+		key_off = mem_alloc(thmap, len, MEM_KEY);
+		if (!key_off) {
+			mem_free(thmap, leaf_off, THMAP_LEAF_LEN(thmap), MEM_LEAF);
+			return NULL;
+		}
+		memcpy(THMAP_GETPTR(thmap, key_off), key, len);
+		leaf->key = key_off;
+	} else {
+		/* Otherwise, we use a reference. */
+		leaf->key = (uintptr_t)key;
+	}
+	leaf->len = len;
+	leaf_setval(thmap, leaf, val);
+	if (thmap->flags & THMAP_CACHE) {
+		/* Give the new entry a chance to get referenced. */
+		atomic_store_relaxed(THMAP_LEAF_REF(thmap, leaf), 1);
+	}
+	return leaf;
+}
+
+/*
+ * leaf_stage_gc: stage the removed leaf and its key for G/C.
+ */
+static void
+leaf_stage_gc(thmap_t *thmap, thmap_leaf_t *leaf)
+{
+	if ((thmap->flags & THMAP_NOCOPY) == 0) {
+		stage_mem_gc(thmap, leaf->key, leaf->len, MEM_KEY);
+	}
+	stage_mem_gc(thmap, THMAP_GETOFF(thmap, leaf),
+	    THMAP_LEAF_LEN(thmap), MEM_LEAF);
+}
+
+/*
+ * leaf_evicted: report the leaf removed by the map itself.
+ */
+static void
+leaf_evicted(const thmap_t *thmap, const thmap_leaf_t *leaf)
+{
+	if (thmap->evict_func) {
+		thmap->evict_func(THMAP_GETPTR(thmap, leaf->key), leaf->len,
+		    leaf_val(thmap, leaf), thmap->evict_arg);
+	}
+}
+
+static void
+leaf_free(thmap_t *thmap, thmap_leaf_t *leaf)
+{
+	if ((thmap->flags & THMAP_NOCOPY) == 0) {
+		mem_free(thmap, leaf->key, leaf->len, MEM_KEY);
+	}
+	mem_free(thmap, THMAP_GETOFF(thmap, leaf),
+	    THMAP_LEAF_LEN(thmap), MEM_LEAF);
+}
+
+static thmap_leaf_t *
+get_leaf(const thmap_t *thmap, thmap_inode_t *parent, unsigned slot)
+{
+	thmap_ptr_t node;
+
+	/* Consume from prior release in thmap_put(). */
+	node = atomic_load_consume(&parent->slots[slot]);
+	if (THMAP_INODE_P(node)) {
+		return NULL;
+	}
+	return THMAP_NODE(thmap, node);
+}
+
+/*
+ * leaf_copy: replace the leaf in the slot with its copy holding the given
+ * value; the original stays intact for the concurrent readers (and the
+ * snapshots) and is staged for G/C, while the key moves to the copy.
+ *
+ * => Must be called with the parent node locked.
+ * => Returns the new leaf or NULL if it could not be allocated.
+ */
+static thmap_leaf_t *
+leaf_copy(thmap_t *thmap, thmap_inode_t *parent, unsigned slot,
+    thmap_leaf_t *leaf, const void *val)
+{
+	thmap_leaf_t *nleaf;
+	uintptr_t nleaf_off;
+
+	nleaf_off = mem_alloc(thmap, THMAP_LEAF_LEN(thmap), MEM_LEAF);
+	if (!nleaf_off) {
+		return NULL;
+	}
+	nleaf = THMAP_GETPTR(thmap, nleaf_off);
+	memcpy(nleaf, leaf, THMAP_LEAF_LEN(thmap));
+	leaf_setval(thmap, nleaf, val);
+
+	/* Release to subsequent consume in get_leaf(). */
+	atomic_store_release(&parent->slots[slot],
+	    nleaf_off | THMAP_LEAF_BIT);
+	stage_mem_gc(thmap, THMAP_GETOFF(thmap, leaf),
+	    THMAP_LEAF_LEN(thmap), MEM_LEAF);
+	return nleaf;
+}
+
+/*
+ * ROOT OPERATIONS.
+ */
+
+/*
+ * root_try_put: Try to set a root pointer at query->rslot.
+ *
+ * => Implies release operation on success.
+ * => Implies no ordering on failure.
+ * => Returns 1 on success, 0 if the slot is taken and -1 if the node
+ *    could not be allocated.
+ */
+static inline int
+root_try_put(thmap_t *thmap, const thmap_query_t *query, thmap_leaf_t *leaf)
+{
+	thmap_ptr_t expected;
+	const unsigned i = query->rslot;
+	thmap_inode_t *node;
+	thmap_ptr_t nptr;
+	unsigned slot;
+
+	/*
+	 * Must pre-check first.  No ordering required because we will
+	 * check again before taking any actions, and start over if
+	 * this changes from null.
+	 */
+	if (atomic_load_relaxed(&thmap->root[i])) {
+		return 0;
+	}
+
+	/*
+	 * Create an intermediate node.  Since there is no parent set,
+	 * it will be created unlocked and the CAS operation will
+	 * release it to readers.
+	 */
+	node = node_create(thmap, NULL);
+	if (__predict_false(!node)) {
+		return -1;
+	}
+	slot = hashval_getl0slot(thmap, query, leaf);
+	node_insert(node, slot, THMAP_GETOFF(thmap, leaf) | THMAP_LEAF_BIT);
+	nptr = THMAP_GETOFF(thmap, node);
+	if (thmap->flags & THMAP_SINGLEWRITER) {
+		/*
+		 * No other writers: the slot is still empty.
+		 * Release to subsequent consume in find_edge_node().
+		 */
+		atomic_store_release(&thmap->root[i], nptr);
+		root_sync(thmap, i);
+		return 1;
+	}
+again:
+	if (atomic_load_relaxed(&thmap->root[i])) {
+		THMAP_STAT_INC(thmap, root_cas_fails);
+		mem_free(thmap, nptr, THMAP_INODE_LEN(thmap), MEM_INODE);
+		return 0;
+	}
+	/* Release to subsequent consume in find_edge_node(). */
+	expected = THMAP_NULL;
+	if (!atomic_compare_exchange_weak_explicit(&thmap->root[i], &expected,
+	    nptr, memory_order_release, memory_order_relaxed)) {
+		THMAP_STAT_INC(thmap, root_cas_fails);
+		goto again;
+	}
+	root_sync(thmap, i);
+	return 1;
+}
+
+/*
+ * find_edge_node: given the hash, traverse the tree to find the edge node.
+ *
+ * => Returns an aligned (clean) pointer to the parent node.
+ * => Returns the slot number and sets current level.
+ */
+static thmap_inode_t *
+find_edge_node(const thmap_t *thmap, atomic_thmap_ptr_t *root,
+    thmap_query_t *query, const void * restrict key, size_t len,
+    unsigned *slot)
+{
+	thmap_ptr_t root_slot;
+	thmap_inode_t *parent;
+	thmap_ptr_t node;
+	unsigned off;
+
+	ASSERT(query->level == 0);
+
+	/* Consume from prior release in root_try_put(). */
+	root_slot = atomic_load_consume(&root[query->rslot]);
+	parent = THMAP_NODE(thmap, root_slot);
+	if (!parent) {
+		return NULL;
+	}
+descend:
+	off = hashval_getslot(query, key, len);
+	/* Consume from prior release in thmap_put(). */
+	node = atomic_load_consume(&parent->slots[off]);
+
+	/* Descend the tree until we find a leaf or empty slot. */
+	if (node && THMAP_INODE_P(node)) {
+		parent = THMAP_NODE(thmap, node);
+		query->level++;
+		goto descend;
+	}
+	/*
+	 * NODE_DELETED does not become stale until GC runs, which
+	 * cannot happen while we are in the middle of an operation,
+	 * hence relaxed ordering.
+	 */
+	if (atomic_load_relaxed(&parent->state) & NODE_DELETED) {
+		return NULL;
+	}
+	*slot = off;
+	return parent;
+}
+
+/*
+ * find_edge_node_locked: traverse the tree, like find_edge_node(),
+ * but attempt to lock the edge node.
+ *
+ * => Returns NULL if the deleted node is found.  This indicates that
+ *    the caller must re-try from the root, as the root slot might have
+ *    changed too.
+ */
+static thmap_inode_t *
+find_edge_node_locked(thmap_t *thmap, thmap_query_t *query,
+    const void * restrict key, size_t len, unsigned *slot)
+{
+	thmap_inode_t *node;
+	thmap_ptr_t target;
+retry:
+	/*
+	 * Find the edge node and lock it!  Re-check the state since
+	 * the tree might change by the time we acquire the lock.
+	 */
+	node = find_edge_node(thmap, thmap->root, query, key, len, slot);
+	if (!node) {
+		/* The root slot is empty -- let the caller decide. */
+		query->level = 0;
+		return NULL;
+	}
+	lock_node(thmap, node);
+	if (thmap->flags & THMAP_SINGLEWRITER) {
+		/* No other writers: the node could not have changed. */
+		return node;
+	}
+	if (__predict_false(atomic_load_relaxed(&node->state) &
+	    (NODE_DELETED | NODE_MOVED))) {
+		/*
+		 * The node has been deleted or relocated.  The tree might
+		 * have a new shape now, therefore we must re-start from
+		 * the root.
+		 */
+		unlock_node(thmap, node);
+		THMAP_STAT_INC(thmap, restarts);
+		query->level = 0;
+		return NULL;
+	}
+	target = atomic_load_relaxed(&node->slots[*slot]);
+	if (__predict_false(target && THMAP_INODE_P(target))) {
+		/*
+		 * The target slot has been changed and it is now an
+		 * intermediate node.  Re-start from the top internode.
+		 */
+		unlock_node(thmap, node);
+		THMAP_STAT_INC(thmap, retries);
+		query->level = 0;
+		goto retry;
+	}
+	root_catchup(thmap, query->rslot);
+	return node;
+}
+
+/*
+ * thmap_get: lookup a value given the key.
+ */
+void *
+thmap_get(thmap_t *thmap, const void *key, size_t len)
+{
+	thmap_query_t query;
+	thmap_inode_t *parent;
+	thmap_leaf_t *leaf;
+	unsigned slot;
+
+	hashval_init(&query, key, len);
+	parent = find_edge_node(thmap, root_view(thmap),
+	    &query, key, len, &slot);
+	if (!parent) {
+		return NULL;
+	}
+	leaf = get_leaf(thmap, parent, slot);
+	if (!leaf) {
+		return NULL;
+	}
+	if (!key_cmp_p(thmap, leaf, key, len) || !leaf_live_p(thmap, leaf)) {
+		return NULL;
+	}
+	leaf_touch(thmap, leaf);
+	return leaf_val(thmap, leaf);
+}
+
+/*
+ * thmap_get_copy: lookup the key and copy out its value into the buffer.
+ *
+ * => In the inline value mode, the value (of the size set at creation)
+ *    is copied; otherwise, the value pointer is copied.
+ * => Returns 0 if the key was found and -1 otherwise.
+ */
+int
+thmap_get_copy(thmap_t *thmap, const void *key, size_t len, void *buf)
+{
+	void *val;
+
+	if ((val = thmap_get(thmap, key, len)) == NULL) {
+		return -1;
+	}
+	if (thmap->vinline) {
+		memcpy(buf, val, thmap->vlen);
+	} else {
+		memcpy(buf, &val, sizeof(void *));
+	}
+	return 0;
+}
+
+/*
+ * counter_add: add the delta to the counter stored inline in the leaf
+ * and return the result in its place.
+ *
+ * => Must be called with the parent node locked, which serializes
+ *    against the leaf replacement and relocation.
+ * => In the lock-free mode, the leaves are never replaced or relocated,
+ *    therefore the counter is simply updated using the atomic addition.
+ * => If there are live snapshots, the leaf is replaced with the copy.
+ * => Returns 0 on success and -1 if the copy could not be allocated.
+ */
+static int
+counter_add(thmap_t *thmap, thmap_inode_t *parent, unsigned slot,
+    thmap_leaf_t *leaf, int64_t *deltap)
+{
+	_Atomic int64_t *counter = THMAP_LEAF_VAL(leaf);
+	int64_t val;
+
+	if (thmap->flags & THMAP_LOCKFREE) {
+		*deltap += atomic_fetch_add_explicit(counter, *deltap,
+		    memory_order_relaxed);
+		return 0;
+	}
+	val = atomic_load_relaxed(counter) + *deltap;
+	if (__predict_false(thmap->snapshots != NULL)) {
+		if (!leaf_copy(thmap, parent, slot, leaf, &val)) {
+			return -1;
+		}
+	} else {
+		atomic_store_relaxed(counter, val);
+	}
+	*deltap = val;
+	return 0;
+}
+
+/*
+ * LOCK-FREE WRITERS.
+ *
+ * In the lock-free mode (THMAP_LOCKFREE), the writers take no locks and
+ * every update is a single CAS on a slot:
+ *
+ * - Insert: the empty slot is swapped from null to the new leaf.
+ *
+ * - Split: on a collision, the new intermediate node(s) with both leaves
+ *   are constructed privately and the slot is swapped from the colliding
+ *   leaf to the new node.
+ *
+ * - Delete: the slot is swapped from the leaf to null.
+ *
+ * - Collapse: the empty node is first frozen, by setting THMAP_FROZEN_BIT
+ *   on each of its slots, so that it can no longer change; then the parent
+ *   slot is swapped from the node to null or, if an entry got inserted in
+ *   the meantime, to an unfrozen copy of the node.
+ *
+ * A writer finding a frozen slot helps to complete the collapse and then
+ * re-tries from the root, therefore a stalled writer cannot block others.
+ * The empty slots are frozen by pointing them to a permanently empty node
+ * marked with NODE_DELETED, so the readers need no extra checks.  The node
+ * counts in the state word are not maintained in this mode.
+ */
+
+typedef struct {
+	atomic_thmap_ptr_t *	pslot;	// parent slot pointing to the node
+	thmap_inode_t *		node;	// edge node
+	unsigned		slot;	// target slot in the edge node
+	thmap_ptr_t		target;	// target slot value (null or leaf)
+} lf_edge_t;
+
+static bool
+lf_node_empty_p(const thmap_inode_t *node)
+{
+	for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+		if (atomic_load_relaxed(&node->slots[i]) != THMAP_NULL) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static thmap_ptr_t
+lf_unfreeze(const thmap_t *thmap, thmap_ptr_t p)
+{
+	const thmap_inode_t *node;
+
+	p &= ~(thmap_ptr_t)THMAP_FROZEN_BIT;
+	if (THMAP_INODE_P(p)) {
+		node = THMAP_GETPTR(thmap, p);
+		if (atomic_load_relaxed(&node->state) & NODE_DELETED) {
+			return THMAP_NULL;
+		}
+	}
+	return p;
+}
+
+/*
+ * lf_collapse: freeze the node and remove it from the parent slot or,
+ * if the node is not empty, replace it with the copy.
+ *
+ * => Any number of writers may call it concurrently (helping).  Once
+ *    frozen, the node does not change, hence they all reach the same
+ *    decision and only one of them succeeds to swap the parent slot.
+ * => Returns 1 if the node was found empty and thus removed, 0 if it is
+ *    replaced with the copy and -1 if the copy could not be allocated.
+ */
+static int
+lf_collapse(thmap_t *thmap, atomic_thmap_ptr_t *pslot, thmap_inode_t *node)
+{
+	thmap_ptr_t slots[LEVEL_SIZE], nptr, repl = THMAP_NULL;
+	thmap_inode_t *copy = NULL;
+	unsigned count = 0;
+
+	for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+		/*
+		 * Acquire the slot value, so that the copy can release
+		 * the nodes it points to (CAS continues the release
+		 * sequence of the value it replaces).
+		 */
+		thmap_ptr_t p = atomic_load_explicit(&node->slots[i],
+		    memory_order_acquire);
+
+		while ((p & THMAP_FROZEN_BIT) == 0) {
+			const thmap_ptr_t frozen = (p ? p : thmap->lf_empty) |
+			    THMAP_FROZEN_BIT;
+
+			if (atomic_compare_exchange_weak_explicit(
+			    &node->slots[i], &p, frozen,
+			    memory_order_acquire, memory_order_acquire)) {
+				p = frozen;
+			}
+		}
+		slots[i] = lf_unfreeze(thmap, p);
+		count += slots[i] != THMAP_NULL;
+	}
+	if (count) {
+		/* Not yet published, no need for ordering. */
+		if ((copy = node_create(thmap, NULL)) == NULL) {
+			return -1;
+		}
+		for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+			atomic_store_relaxed(&copy->slots[i], slots[i]);
+		}
+		repl = THMAP_GETOFF(thmap, copy);
+	}
+
+	/* Release the copy to subsequent consume in find_edge_node(). */
+	nptr = THMAP_GETOFF(thmap, node);
+	if (atomic_compare_exchange_strong_explicit(pslot, &nptr, repl,
+	    memory_order_release, memory_order_relaxed)) {
+		stage_mem_gc(thmap, THMAP_GETOFF(thmap, node),
+		    THMAP_INODE_LEN(thmap), MEM_INODE);
+		if (!copy) {
+			THMAP_STAT_INC(thmap, collapses);
+		}
+	} else if (copy) {
+		/* Completed by another writer. */
+		mem_free(thmap, repl, THMAP_INODE_LEN(thmap), MEM_INODE);
+	}
+	return copy ? 0 : 1;
+}
+
+/*
+ * lf_find_edge_node: traverse the tree from the root, like find_edge_node(),
+ * helping to complete the collapse of any frozen node on the way.
+ *
+ * => Returns 1 and the edge node, 0 if the root slot is empty or -1 if
+ *    the collapse could not be completed.
+ */
+static int
+lf_find_edge_node(thmap_t *thmap, thmap_query_t *query,
+    const void * restrict key, size_t len, lf_edge_t *e)
+{
+	thmap_ptr_t target;
+retry:
+	query->level = 0;
+	e->pslot = &thmap->root[query->rslot];
+
+	/* Consume from prior release in root_try_put() or lf_collapse(). */
+	target = atomic_load_consume(e->pslot);
+	if (!target) {
+		return 0;
+	}
+	for (;;) {
+		e->node = THMAP_NODE(thmap, target);
+		e->slot = hashval_getslot(query, key, len);
+
+		/* Consume from prior release in lf_put_entry(). */
+		target = atomic_load_consume(&e->node->slots[e->slot]);
+		if (__predict_false(target & THMAP_FROZEN_BIT)) {
+			if (lf_collapse(thmap, e->pslot, e->node) == -1) {
+				return -1;
+			}
+			THMAP_STAT_INC(thmap, restarts);
+			goto retry;
+		}
+		if (!target || !THMAP_INODE_P(target)) {
+			break;
+		}
+		e->pslot = &e->node->slots[e->slot];
+		query->level++;
+	}
+	e->target = target;
+	return 1;
+}
+
+/*
+ * lf_split_free: free the intermediate nodes created by lf_split(),
+ * which did not get published.
+ */
+static void
+lf_split_free(thmap_t *thmap, thmap_inode_t *node)
+{
+	while (node) {
+		thmap_inode_t *next = NULL;
+
+		for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+			const thmap_ptr_t p =
+			    atomic_load_relaxed(&node->slots[i]);
+
+			if (p && THMAP_INODE_P(p)) {
+				next = THMAP_NODE(thmap, p);
+			}
+		}
+		mem_free(thmap, THMAP_GETOFF(thmap, node),
+		    THMAP_INODE_LEN(thmap), MEM_INODE);
+		node = next;
+	}
+}
+
+/*
+ * lf_split: construct the intermediate node(s) below the query level,
+ * holding the colliding leaf and the new leaf.
+ *
+ * => Returns the top new node, not yet published, or NULL on failure.
+ */
+static thmap_inode_t *
+lf_split(thmap_t *thmap, const thmap_query_t *query,
+    const void * restrict key, size_t len, const thmap_leaf_t *other,
+    thmap_ptr_t lptr, unsigned *nlevels)
+{
+	thmap_query_t q = *query;
+	thmap_inode_t *top = NULL, *node = NULL, *child;
+	unsigned slot = 0, other_slot;
+
+	*nlevels = 0;
+	do {
+		if ((child = node_create(thmap, NULL)) == NULL) {
+			lf_split_free(thmap, top);
+			return NULL;
+		}
+		if (node) {
+			node_insert(node, slot, THMAP_GETOFF(thmap, child));
+		} else {
+			top = child;
+		}
+		node = child;
+		q.level++;
+		(*nlevels)++;
+
+		other_slot = hashval_getleafslot(thmap, other, q.level);
+		slot = hashval_getslot(&q, key, len);
+	} while (slot == other_slot);
+
+	node_insert(node, other_slot,
+	    THMAP_GETOFF(thmap, other) | THMAP_LEAF_BIT);
+	node_insert(node, slot, lptr);
+	return top;
+}
+
+/*
+ * lf_put_entry: insert the pre-allocated leaf, see put_entry().
+ */
+static void *
+lf_put_entry(thmap_t *thmap, thmap_query_t *query, const void *key,
+    size_t len, thmap_leaf_t *leaf, int64_t *addp)
+{
+	const thmap_ptr_t lptr = THMAP_GETOFF(thmap, leaf) | THMAP_LEAF_BIT;
+	thmap_inode_t *child;
+	thmap_leaf_t *other;
+	unsigned nlevels;
+	lf_edge_t e;
+retry:
+	switch (root_try_put(thmap, query, leaf)) {
+	case 1:
+		goto out;
+	case -1:
+		goto fail;
+	}
+	switch (lf_find_edge_node(thmap, query, key, len, &e)) {
+	case 0:
+		/* The root slot got emptied. */
+		goto retry;
+	case -1:
+		goto fail;
+	}
+
+	if (e.target == THMAP_NULL) {
+		/*
+		 * Empty slot: insert the new leaf.  Release the leaf to
+		 * subsequent consume in get_leaf() or find_edge_node().
+		 */
+		if (!atomic_compare_exchange_strong_explicit(
+		    &e.node->slots[e.slot], &e.target, lptr,
+		    memory_order_release, memory_order_relaxed)) {
+			THMAP_STAT_INC(thmap, retries);
+			goto retry;
+		}
+		goto out;
+	}
+
+	other = THMAP_NODE(thmap, e.target);
+	if (key_cmp_p(thmap, other, key, len)) {
+		/*
+		 * Duplicate.  Free the pre-allocated leaf and
+		 * return the present value.
+		 */
+		leaf_free(thmap, leaf);
+		if (addp) {
+			(void)counter_add(thmap, e.node, e.slot, other, addp);
+		}
+		return leaf_val(thmap, other);
+	}
+
+	/*
+	 * Collision -- expand the tree privately and swap the colliding
+	 * leaf with the new node, releasing the node (and the new leaf).
+	 */
+	child = lf_split(thmap, query, key, len, other, lptr, &nlevels);
+	if (__predict_false(!child)) {
+		goto fail;
+	}
+	if (!atomic_compare_exchange_strong_explicit(&e.node->slots[e.slot],
+	    &e.target, THMAP_GETOFF(thmap, child),
+	    memory_order_release, memory_order_relaxed)) {
+		lf_split_free(thmap, child);
+		THMAP_STAT_INC(thmap, retries);
+		goto retry;
+	}
+	THMAP_STAT_ADD(thmap, splits, nlevels);
+out:
+	count_add(thmap, 1);
+	return leaf_val(thmap, leaf);
+fail:
+	leaf_free(thmap, leaf);
+	return NULL;
+}
+
+/*
+ * lf_del_entry: remove the entry given the key, see del_entry().
+ */
+static thmap_leaf_t *
+lf_del_entry(thmap_t *thmap, const void *key, size_t len)
+{
+	thmap_query_t query;
+	thmap_leaf_t *leaf;
+	lf_edge_t e;
+
+	hashval_init(&query, key, len);
+retry:
+	if (lf_find_edge_node(thmap, &query, key, len, &e) != 1 ||
+	    e.target == THMAP_NULL) {
+		return NULL;
+	}
+	leaf = THMAP_NODE(thmap, e.target);
+	if (!key_cmp_p(thmap, leaf, key, len)) {
+		return NULL;
+	}
+
+	/* Remove the leaf; it stays valid until G/C. */
+	if (!atomic_compare_exchange_strong_explicit(&e.node->slots[e.slot],
+	    &e.target, THMAP_NULL, memory_order_relaxed,
+	    memory_order_relaxed)) {
+		THMAP_STAT_INC(thmap, retries);
+		goto retry;
+	}
+	leaf_stage_gc(thmap, leaf);
+	count_add(thmap, -1);
+
+	/*
+	 * Collapse the empty levels on the path, bottom-up.  Stop if any
+	 * of them gets an entry concurrently.
+	 */
+	while (lf_find_edge_node(thmap, &query, key, len, &e) == 1 &&
+	    e.target == THMAP_NULL && lf_node_empty_p(e.node) &&
+	    lf_collapse(thmap, e.pslot, e.node) == 1) {
+		continue;
+	}
+	return leaf;
+}
+
+/*
+ * put_entry: insert a value given the key, see thmap_put().
+ *
+ * => In the TTL mode, set the expiry time of the new entry; the expired
+ *    entry, if present, gets replaced.
+ * => If the counter delta is given (see thmap_add()) and the key is
+ *    already present, add it to the value and return the result there.
+ */
+static void *
+put_entry(thmap_t *thmap, const void *key, size_t len, void *val,
+    uint64_t expire, int64_t *addp)
+{
+	thmap_query_t query;
+	thmap_leaf_t *leaf, *other, *expired = NULL;
+	thmap_inode_t *parent, *child;
+	unsigned slot, other_slot;
+	thmap_ptr_t target;
+
+	/*
+	 * If the memory limit is set, then fail early if the insert might
+	 * exceed it (assume the worst case of creating a new level).
+	 */
+	if (__predict_false(mem_limit_p(thmap,
+	    THMAP_LEAF_LEN(thmap) + len + THMAP_INODE_LEN(thmap)))) {
+		return NULL;
+	}
+
+	/*
+	 * First, pre-allocate and initialize the leaf node.
+	 */
+	leaf = leaf_create(thmap, key, len, val);
+	if (__predict_false(!leaf)) {
+		return NULL;
+	}
+	if (thmap->flags & THMAP_TTL) {
+		atomic_store_relaxed(THMAP_LEAF_EXP(thmap, leaf), expire);
+	}
+	val = leaf_val(thmap, leaf);
+	hashval_init(&query, key, len);
+	if (thmap->flags & THMAP_LOCKFREE) {
+		return lf_put_entry(thmap, &query, key, len, leaf, addp);
+	}
+	snap_enter(thmap);
+	if (__predict_false(snap_unshare(thmap, key, len) == -1)) {
+		leaf_free(thmap, leaf);
+		val = NULL;
+		goto done;
+	}
+retry:
+	/*
+	 * Try to insert into the root first, if its slot is empty.
+	 */
+	switch (root_try_put(thmap, &query, leaf)) {
+	case 1:
+		/* Success: the leaf was inserted; no locking involved. */
+		entry_account(thmap, query.rslot, 1, len);
+		inode_account(thmap, query.rslot, 1);
+		goto done;
+	case -1:
+		leaf_free(thmap, leaf);
+		val = NULL;
+		goto done;
+	}
+
+	/*
+	 * Release node via store in node_insert (*) to subsequent
+	 * consume in get_leaf() or find_edge_node().
+	 */
+	atomic_thread_fence(memory_order_release);
+
+	/*
+	 * Find the edge node and the target slot.
+	 */
+	parent = find_edge_node_locked(thmap, &query, key, len, &slot);
+	if (!parent) {
+		goto retry;
+	}
+	target = atomic_load_relaxed(&parent->slots[slot]); // tagged offset
+	if (THMAP_INODE_P(target)) {
+		/*
+		 * Empty slot: simply insert the new leaf.  The release
+		 * fence is already issued for us.
+		 */
+		target = THMAP_GETOFF(thmap, leaf) | THMAP_LEAF_BIT;
+		node_insert(parent, slot, target); /* (*) */
+		entry_account(thmap, query.rslot, 1, len);
+		goto out;
+	}
+
+	/*
+	 * Collision or duplicate.
+	 */
+	other = THMAP_NODE(thmap, target);
+	if (key_cmp_p(thmap, other, key, len)) {
+		if (__predict_false(!leaf_live_p(thmap, other))) {
+			/*
+			 * Expired: replace with the new leaf.  The release
+			 * fence is already issued for us.
+			 */
+			target = THMAP_GETOFF(thmap, leaf) | THMAP_LEAF_BIT;
+			atomic_store_relaxed(&parent->slots[slot], target);
+			expired = other;
+			goto out;
+		}
+		/*
+		 * Duplicate.  Free the pre-allocated leaf and
+		 * return the present value.
+		 */
+		leaf_free(thmap, leaf);
+		val = leaf_val(thmap, other);
+		if (addp && counter_add(thmap, parent, slot, other, addp)) {
+			val = NULL;
+		}
+		goto out;
+	}
+descend:
+	/*
+	 * Collision -- expand the tree.  Create an intermediate node
+	 * which will be locked (NODE_LOCKED) for us.  At this point,
+	 * we advance to the next level.
+	 */
+	child = node_create(thmap, parent);
+	if (__predict_false(!child)) {
+		leaf_free(thmap, leaf);
+		val = NULL;
+		goto out;
+	}
+	THMAP_STAT_INC(thmap, splits);
+	inode_account(thmap, query.rslot, 1);
+	query.level++;
+
+	/*
+	 * Insert the other (colliding) leaf first.  The new child is
+	 * not yet published, so memory order is relaxed.
+	 */
+	other_slot = hashval_getleafslot(thmap, other, query.level);
+	target = THMAP_GETOFF(thmap, other) | THMAP_LEAF_BIT;
+	node_insert(child, other_slot, target);
+
+	/*
+	 * Insert the intermediate node into the parent node.
+	 * It becomes the new parent for the our new leaf.
+	 *
+	 * Ensure that stores to the child (and leaf) reach global
+	 * visibility before it gets inserted to the parent, as
+	 * consumed by get_leaf() or find_edge_node().
+	 */
+	atomic_store_release(&parent->slots[slot], THMAP_GETOFF(thmap, child));
+
+	unlock_node(thmap, parent);
+	ASSERT(node_locked_p(child));
+	parent = child;
+
+	/*
+	 * Get the new slot and check for another collision
+	 * at the next level.
+	 */
+	slot = hashval_getslot(&query, key, len);
+	if (slot == other_slot) {
+		/* Another collision -- descend and expand again. */
+		goto descend;
+	}
+
+	/*
+	 * Insert our new leaf once we expanded enough.  The release
+	 * fence is already issued for us.
+	 */
+	target = THMAP_GETOFF(thmap, leaf) | THMAP_LEAF_BIT;
+	node_insert(parent, slot, target); /* (*) */
+	entry_account(thmap, query.rslot, 1, len);
+out:
+	unlock_node(thmap, parent);
+	if (__predict_false(expired)) {
+		leaf_stage_gc(thmap, expired);
+		THMAP_STAT_INC(thmap, expirations);
+		leaf_evicted(thmap, expired);
+	}
+done:
+	snap_exit(thmap);
+	return val;
+}
+
+/*
+ * thmap_put: insert a value given the key.
+ *
+ * => If the key is already present, return the associated value.
+ * => Otherwise, on successful insert, return the given value.
+ * => In the inline value mode, the value is copied into the leaf and
+ *    the pointer to the stored value is returned instead.
+ */
+void *
+thmap_put(thmap_t *thmap, const void *key, size_t len, void *val)
+{
+	val = put_entry(thmap, key, len, val, 0, NULL);
+	if (__predict_false(thmap->flags & THMAP_CACHE)) {
+		(void)thmap_cache_evict(thmap, CLOCK_STEPS);
+	}
+	return val;
+}
+
+/*
+ * thmap_add: atomically add the delta to the 64-bit counter stored as
+ * the value, inserting the entry with the delta as its value if the key
+ * is not present.  The map must store the values of sizeof(int64_t)
+ * inline (see thmap_create_vlen()).
+ *
+ * => If the key is present, the counter is updated in place, in a single
+ *    descent and without any allocation.
+ * => Returns 0 and, if requested, the resulting value on success; -1 on
+ *    failure or if the map does not store the counters.
+ */
+int
+thmap_add(thmap_t *thmap, const void *key, size_t len, int64_t delta,
+    int64_t *valp)
+{
+	thmap_query_t query;
+	thmap_inode_t *parent;
+	thmap_leaf_t *leaf;
+	unsigned slot;
+
+	if (!thmap->vinline || thmap->vlen != sizeof(int64_t)) {
+		return -1;
+	}
+	hashval_init(&query, key, len);
+	if (thmap->flags & THMAP_LOCKFREE) {
+		parent = find_edge_node(thmap, thmap->root,
+		    &query, key, len, &slot);
+		leaf = parent ? get_leaf(thmap, parent, slot) : NULL;
+		if (leaf && key_cmp_p(thmap, leaf, key, len)) {
+			(void)counter_add(thmap, parent, slot, leaf, &delta);
+			goto out;
+		}
+	} else {
+		int error = 0;
+		bool found = false;
+
+		snap_enter(thmap);
+		if (snap_unshare(thmap, key, len) == -1) {
+			error = -1;
+		} else if ((parent = find_edge_node_locked(thmap,
+		    &query, key, len, &slot)) != NULL) {
+			leaf = get_leaf(thmap, parent, slot);
+			if (leaf && key_cmp_p(thmap, leaf, key, len) &&
+			    leaf_live_p(thmap, leaf)) {
+				leaf_touch(thmap, leaf);
+				error = counter_add(thmap, parent, slot,
+				    leaf, &delta);
+				found = true;
+			}
+			unlock_node(thmap, parent);
+		}
+		snap_exit(thmap);
+		if (error) {
+			return -1;
+		}
+		if (found) {
+			goto out;
+		}
+	}
+
+	/*
+	 * Not found: insert the entry.  If inserted concurrently, then
+	 * the delta gets added to the present value.
+	 */
+	if (put_entry(thmap, key, len, &delta, 0, &delta) == NULL) {
+		return -1;
+	}
+	if (__predict_false(thmap->flags & THMAP_CACHE)) {
+		(void)thmap_cache_evict(thmap, CLOCK_STEPS);
+	}
+out:
+	if (valp) {
+		*valp = delta;
+	}
+	return 0;
+}
+
+/*
+ * del_entry: remove the entry given the key, see thmap_del().
+ *
+ * => If the time is given, remove the entry only if it has expired.
+ * => Returns the removed leaf, staged for G/C, or NULL if not found.
+ */
+static thmap_leaf_t *
+del_entry(thmap_t *thmap, const void *key, size_t len, uint64_t now)
+{
+	thmap_query_t query;
+	thmap_leaf_t *leaf = NULL;
+	thmap_inode_t *parent;
+	unsigned slot;
+
+	if (thmap->flags & THMAP_LOCKFREE) {
+		ASSERT(now == 0);
+		return lf_del_entry(thmap, key, len);
+	}
+	snap_enter(thmap);
+	if (__predict_false(snap_unshare(thmap, key, len) == -1)) {
+		goto out;
+	}
+	hashval_init(&query, key, len);
+	parent = find_edge_node_locked(thmap, &query, key, len, &slot);
+	if (!parent) {
+		/* Root slot empty: not found. */
+		goto out;
+	}
+	leaf = get_leaf(thmap, parent, slot);
+	if (!leaf || !key_cmp_p(thmap, leaf, key, len) ||
+	    (now && !leaf_expired_p(thmap, leaf, now))) {
+		/* Not found (or not expired). */
+		unlock_node(thmap, parent);
+		leaf = NULL;
+		goto out;
+	}
+
+	/* Remove the leaf. */
+	ASSERT(THMAP_NODE(thmap, atomic_load_relaxed(&parent->slots[slot]))
+	    == leaf);
+	node_remove(parent, slot);
+
+	/*
+	 * Collapse the levels if removing the last item.
+	 */
+	while (query.level &&
+	    NODE_COUNT(atomic_load_relaxed(&parent->state)) == 0) {
+		thmap_inode_t *node = parent;
+
+		ASSERT(atomic_load_relaxed(&node->state) == NODE_LOCKED);
+
+		/*
+		 * Ascend one level up.
+		 * => Mark our current parent as deleted.
+		 * => Lock the parent one level up.
+		 */
+		query.level--;
+		slot = hashval_getslot(&query, key, len);
+		parent = THMAP_NODE(thmap, node->parent);
+		ASSERT(parent != NULL);
+
+		lock_node(thmap, parent);
+		ASSERT((atomic_load_relaxed(&parent->state) & NODE_DELETED)
+		    == 0);
+
+		/*
+		 * Lock is exclusive, so nobody else can be writing at
+		 * the same time, and no need for atomic R/M/W, but
+		 * readers may read without the lock and so need atomic
+		 * load/store.  No ordering here needed because the
+		 * entry itself stays valid until GC.
+		 */
+		atomic_store_relaxed(&node->state,
+		    atomic_load_relaxed(&node->state) | NODE_DELETED);
+		unlock_node(thmap, node); // memory_order_release
+
+		ASSERT(THMAP_NODE(thmap,
+		    atomic_load_relaxed(&parent->slots[slot])) == node);
+		node_remove(parent, slot);
+
+		/* Stage the removed node for G/C. */
+		stage_mem_gc(thmap, THMAP_GETOFF(thmap, node),
+		    THMAP_INODE_LEN(thmap), MEM_INODE);
+		inode_account(thmap, query.rslot, -1);
+		THMAP_STAT_INC(thmap, collapses);
+	}
+
+	/*
+	 * If the top node is empty, then we need to remove it from the
+	 * root level.  Mark the node as deleted and clear the slot.
+	 *
+	 * Note: acquiring the lock on the top node effectively prevents
+	 * the root slot from changing.
+	 */
+	if (NODE_COUNT(atomic_load_relaxed(&parent->state)) == 0) {
+		const unsigned rslot = query.rslot;
+		const thmap_ptr_t nptr =
+		    atomic_load_relaxed(&thmap->root[rslot]);
+
+		ASSERT(query.level == 0);
+		ASSERT(parent->parent == THMAP_NULL);
+		ASSERT(THMAP_GETOFF(thmap, parent) == nptr);
+
+		/* Mark as deleted and remove from the root-level slot. */
+		atomic_store_relaxed(&parent->state,
+		    atomic_load_relaxed(&parent->state) | NODE_DELETED);
+		atomic_store_relaxed(&thmap->root[rslot], THMAP_NULL);
+		root_sync(thmap, rslot);
+
+		stage_mem_gc(thmap, nptr, THMAP_INODE_LEN(thmap), MEM_INODE);
+		inode_account(thmap, rslot, -1);
+		THMAP_STAT_INC(thmap, collapses);
+	}
+	unlock_node(thmap, parent);
+
+	/* Stage the leaf for G/C. */
+	entry_account(thmap, query.rslot, -1, leaf->len);
+	leaf_stage_gc(thmap, leaf);
+out:
+	snap_exit(thmap);
+	return leaf;
+}
+
+/*
+ * thmap_del: remove the entry given the key.
+ *
+ * => Returns the value; in the inline value mode, the pointer to the
+ *    stored value, which stays valid until the leaf is reclaimed by G/C.
+ */
+void *
+thmap_del(thmap_t *thmap, const void *key, size_t len)
+{
+	thmap_leaf_t *leaf;
+
+	if ((leaf = del_entry(thmap, key, len, 0)) == NULL) {
+		return NULL;
+	}
+	return leaf_val(thmap, leaf);
+}
+
+/*
+ * STEPWISE LOOKUP.
+ *
+ * The lookup of thmap_get() split into the steps, each touching a single
+ * node (the root slot, an intermediate node, the leaf and the key), which
+ * is prefetched by the preceding step.  The caller can interleave many
+ * independent lookups, so that the memory accesses of one overlap with
+ * the work of the others (group prefetching).
+ */
+
+#define	LOOKUP_ROOT	0
+#define	LOOKUP_SLOT	1
+#define	LOOKUP_LEAF	2
+#define	LOOKUP_KEY	3
+
+static void
+lookup_next_slot(thmap_lookup_t *lk, const thmap_t *thmap,
+    thmap_inode_t *parent)
+{
+	thmap_query_t query = {
+		.rslot = lk->rslot, .level = lk->level,
+		.hashidx = lk->hashidx, .hashval = lk->hashval
+	};
+
+	lk->slot = hashval_getslot(&query, lk->key, lk->len);
+	lk->hashidx = query.hashidx;
+	lk->hashval = query.hashval;
+	lk->node = THMAP_GETOFF(thmap, parent);
+	lk->step = LOOKUP_SLOT;
+	__prefetch(&parent->slots[lk->slot]);
+}
+
+/*
+ * thmap_lookup_start: initiate the stepwise lookup of the given key.
+ *
+ * => Computes the hash and prefetches the root slot.
+ * => The key must remain valid until the lookup is complete.
+ */
+void
+thmap_lookup_start(thmap_t *thmap, thmap_lookup_t *lk,
+    const void *key, size_t len)
+{
+	thmap_query_t query;
+
+	hashval_init(&query, key, len);
+	lk->key = key;
+	lk->len = len;
+	lk->val = NULL;
+	lk->rslot = query.rslot;
+	lk->level = query.level;
+	lk->hashidx = query.hashidx;
+	lk->hashval = query.hashval;
+	lk->step = LOOKUP_ROOT;
+	__prefetch(&root_view(thmap)[query.rslot]);
+}
+
+/*
+ * thmap_lookup_step: perform the next step of the lookup.
+ *
+ * => Returns 1 if more steps are needed (the memory accessed by the next
+ *    step has been prefetched) and 0 if the lookup is complete, in which
+ *    case lk->val contains the value or NULL if the key was not found.
+ * => The caller is a reader for the whole duration of the lookup, i.e.
+ *    the memory must not be reclaimed by thmap_gc() before it completes.
+ */
+int
+thmap_lookup_step(thmap_t *thmap, thmap_lookup_t *lk)
+{
+	thmap_inode_t *parent;
+	thmap_leaf_t *leaf;
+	thmap_ptr_t node;
+
+	switch (lk->step) {
+	case LOOKUP_ROOT:
+		/* Consume from prior release in root_try_put(). */
+		node = atomic_load_consume(&root_view(thmap)[lk->rslot]);
+		if (!node) {
+			return 0;
+		}
+		lookup_next_slot(lk, thmap, THMAP_NODE(thmap, node));
+		return 1;
+	case LOOKUP_SLOT:
+		parent = THMAP_GETPTR(thmap, lk->node);
+		/* Consume from prior release in thmap_put(). */
+		node = atomic_load_consume(&parent->slots[lk->slot]);
+		if (node && THMAP_INODE_P(node)) {
+			lk->level++;
+			lookup_next_slot(lk, thmap, THMAP_NODE(thmap, node));
+			return 1;
+		}
+		/* See find_edge_node() on the ordering. */
+		if (!node || (atomic_load_relaxed(&parent->state) &
+		    NODE_DELETED) != 0) {
+			return 0;
+		}
+		leaf = THMAP_NODE(thmap, node);
+		lk->node = THMAP_GETOFF(thmap, leaf);
+		lk->step = LOOKUP_LEAF;
+		__prefetch(leaf);
+		return 1;
+	case LOOKUP_LEAF:
+		leaf = THMAP_GETPTR(thmap, lk->node);
+		if (leaf->len != lk->len) {
+			return 0;
+		}
+		lk->step = LOOKUP_KEY;
+		__prefetch(THMAP_GETPTR(thmap, leaf->key));
+		return 1;
+	case LOOKUP_KEY:
+		leaf = THMAP_GETPTR(thmap, lk->node);
+		if (key_cmp_p(thmap, leaf, lk->key, lk->len) &&
+		    leaf_live_p(thmap, leaf)) {
+			leaf_touch(thmap, leaf);
+			lk->val = leaf_val(thmap, leaf);
+		}
+		return 0;
+	}
+	ASSERT(false);
+	return 0;
+}
+
+/*
+ * COMPACTION.
+ *
+ * The nodes are re-laid into a single contiguous region: first, all
+ * intermediate nodes in the breadth-first order (so that the top levels,
+ * which are hit by every lookup, are packed together), then the leaves,
+ * each followed by its key.  The new copy is published via the root-level
+ * slots and the old nodes are staged for G/C.
+ */
+
+/*
+ * Region list lock and the reference dropping.  Note: the list is rarely
+ * modified and only looked up on G/C, therefore a simple spin-lock is used.
+ */
+
+static void
+region_lock(thmap_t *thmap)
+{
+	unsigned bcount = SPINLOCK_BACKOFF_MIN;
+	unsigned expected;
+again:
+	expected = 0;
+	if (!atomic_compare_exchange_weak_explicit(&thmap->region_lock,
+	    &expected, 1, memory_order_acquire, memory_order_relaxed)) {
+		SPINLOCK_BACKOFF(bcount);
+		goto again;
+	}
+}
+
+static void
+region_unlock(thmap_t *thmap)
+{
+	atomic_store_release(&thmap->region_lock, 0);
+}
+
+/*
+ * region_release: if the address belongs to a compacted region, then drop
+ * the reference and free the region once it is no longer used.
+ *
+ * => Returns true if the address belongs to a region.
+ */
+static bool
+region_release(thmap_t *thmap, uintptr_t addr)
+{
+	thmap_region_t *region, *prev = NULL;
+
+	region_lock(thmap);
+	region = atomic_load_relaxed(&thmap->regions);
+	while (region) {
+		if (addr >= region->addr && addr - region->addr < region->len) {
+			break;
+		}
+		prev = region;
+		region = region->next;
+	}
+	if (region == NULL) {
+		region_unlock(thmap);
+		return false;
+	}
+	ASSERT(region->refs > 0);
+	if (--region->refs) {
+		region_unlock(thmap);
+		return true;
+	}
+	if (prev) {
+		prev->next = region->next;
+	} else {
+		atomic_store_relaxed(&thmap->regions, region->next);
+	}
+	region_unlock(thmap);
+
+	thmap->ops->free(region->addr, region->len);
+	free(region);
+	return true;
+}
+
+typedef struct {
+	size_t		inodes;		// number of intermediate nodes
+	size_t		leaves;		// number of leaves
+	size_t		len;		// total length of the leaves and keys
+	size_t		keylen;		// total length of the keys (unpadded)
+} compact_ctx_t;
+
+static inline size_t
+compact_keylen(const thmap_t *thmap, size_t len)
+{
+	if (thmap->flags & THMAP_NOCOPY) {
+		return 0;
+	}
+	/* Note: empty keys still get a unique address in the region. */
+	return roundup2(MAX(len, 1), sizeof(void *));
+}
+
+static void
+compact_count(const thmap_t *thmap, const thmap_inode_t *node,
+    compact_ctx_t *ctx)
+{
+	ctx->inodes++;
+	for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+		const thmap_ptr_t p = atomic_load_relaxed(&node->slots[i]);
+
+		if (p == THMAP_NULL) {
+			continue;
+		}
+		if (THMAP_INODE_P(p)) {
+			compact_count(thmap, THMAP_NODE(thmap, p), ctx);
+		} else {
+			const thmap_leaf_t *leaf = THMAP_NODE(thmap, p);
+			ctx->leaves++;
+			ctx->len += THMAP_LEAF_LEN(thmap);
+			ctx->len += compact_keylen(thmap, leaf->len);
+			ctx->keylen += leaf->len;
+		}
+	}
+}
+
+static thmap_ptr_t
+compact_leaf(const thmap_t *thmap, const thmap_leaf_t *leaf, uintptr_t *cur)
+{
+	const uintptr_t leaf_off = *cur;
+	thmap_leaf_t *nleaf = THMAP_GETPTR(thmap, leaf_off);
+
+	memcpy(nleaf, leaf, THMAP_LEAF_LEN(thmap));
+	*cur += THMAP_LEAF_LEN(thmap);
+
+	if ((thmap->flags & THMAP_NOCOPY) == 0) {
+		const void *key = THMAP_GETPTR(thmap, leaf->key);
+
+		memcpy(THMAP_GETPTR(thmap, *cur), key, leaf->len);
+		nleaf->key = *cur;
+		*cur += compact_keylen(thmap, leaf->len);
+	}
+	return leaf_off | THMAP_LEAF_BIT;
+}
+
+static void
+compact_retire(thmap_t *thmap, thmap_inode_t *node)
+{
+	for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+		const thmap_ptr_t p = atomic_load_relaxed(&node->slots[i]);
+
+		if (p == THMAP_NULL) {
+			continue;
+		}
+		if (THMAP_INODE_P(p)) {
+			compact_retire(thmap, THMAP_NODE(thmap, p));
+		} else {
+			thmap_leaf_t *leaf = THMAP_NODE(thmap, p);
+
+			if ((thmap->flags & THMAP_NOCOPY) == 0) {
+				stage_mem_gc(thmap, leaf->key, leaf->len,
+				    MEM_KEY);
+			}
+			stage_mem_gc(thmap, THMAP_ALIGN(p),
+			    THMAP_LEAF_LEN(thmap), MEM_LEAF);
+		}
+	}
+	stage_mem_gc(thmap, THMAP_GETOFF(thmap, node),
+	    THMAP_INODE_LEN(thmap), MEM_INODE);
+}
+
+/*
+ * compact_inode: return the n-th intermediate node in the region.
+ */
+static inline thmap_inode_t *
+compact_inode(const thmap_t *thmap, uintptr_t addr, size_t n)
+{
+	return THMAP_GETPTR(thmap, addr + n * THMAP_INODE_LEN(thmap));
+}
+
+static int
+compact(thmap_t *thmap)
+{
+	thmap_ptr_t oroot[ROOT_SIZE], nroot[ROOT_SIZE];
+	compact_ctx_t ctx = { 0, 0, 0, 0 };
+	thmap_region_t *region;
+	uintptr_t addr, cur;
+	size_t len, n = 0;
+
+	for (unsigned i = 0; i < ROOT_SIZE; i++) {
+		oroot[i] = atomic_load_relaxed(&thmap->root[i]);
+		if (oroot[i]) {
+			compact_count(thmap, THMAP_NODE(thmap, oroot[i]), &ctx);
+		}
+	}
+	if (ctx.inodes == 0) {
+		/* Empty map: nothing to do. */
+		return 0;
+	}
+
+	/*
+	 * Allocate the region and its descriptor.  Each carved object
+	 * holds a reference, dropped when the object gets reclaimed.
+	 */
+	len = ctx.inodes * THMAP_INODE_LEN(thmap) + ctx.len;
+	if ((region = malloc(sizeof(thmap_region_t))) == NULL) {
+		return -1;
+	}
+	if ((addr = thmap->ops->alloc(len)) == 0) {
+		free(region);
+		return -1;
+	}
+	region->addr = addr;
+	region->len = len;
+	region->refs = ctx.inodes + ctx.leaves;
+	if ((thmap->flags & THMAP_NOCOPY) == 0) {
+		region->refs += ctx.leaves;
+	}
+	ASSERT(THMAP_ALIGNED_P(compact_inode(thmap, addr, 0)));
+
+	/*
+	 * Copy the top-level nodes and then the remaining levels in the
+	 * breadth-first order, using the region itself as the queue.  The
+	 * leaves are placed after the intermediate nodes.
+	 */
+	for (unsigned i = 0; i < ROOT_SIZE; i++) {
+		if (oroot[i] == THMAP_NULL) {
+			nroot[i] = THMAP_NULL;
+			continue;
+		}
+		memcpy(compact_inode(thmap, addr, n),
+		    THMAP_NODE(thmap, oroot[i]), THMAP_INODE_LEN(thmap));
+		nroot[i] = THMAP_GETOFF(thmap, compact_inode(thmap, addr, n++));
+	}
+	cur = addr + ctx.inodes * THMAP_INODE_LEN(thmap);
+	for (size_t i = 0; i < n; i++) {
+		thmap_inode_t *node = compact_inode(thmap, addr, i);
+
+		for (unsigned j = 0; j < LEVEL_SIZE; j++) {
+			thmap_ptr_t p = atomic_load_relaxed(&node->slots[j]);
+			thmap_inode_t *child;
+
+			if (p == THMAP_NULL) {
+				continue;
+			}
+			if (!THMAP_INODE_P(p)) {
+				p = compact_leaf(thmap, THMAP_NODE(thmap, p), &cur);
+				atomic_store_relaxed(&node->slots[j], p);
+				continue;
+			}
+			ASSERT(n < ctx.inodes);
+			child = compact_inode(thmap, addr, n++);
+			memcpy(child, THMAP_NODE(thmap, p),
+			    THMAP_INODE_LEN(thmap));
+			child->parent = THMAP_GETOFF(thmap, node);
+			atomic_store_relaxed(&node->slots[j],
+			    THMAP_GETOFF(thmap, child));
+		}
+	}
+	ASSERT(n == ctx.inodes);
+	ASSERT(cur == addr + len);
+
+	/*
+	 * Account the objects carved from the region, as if they were
+	 * allocated individually, and register the region (before
+	 * anything gets staged for G/C).
+	 */
+	mem_account(thmap, MEM_INODE, ctx.inodes * THMAP_INODE_LEN(thmap));
+	mem_account(thmap, MEM_LEAF, ctx.leaves * THMAP_LEAF_LEN(thmap));
+	if ((thmap->flags & THMAP_NOCOPY) == 0) {
+		mem_account(thmap, MEM_KEY, ctx.keylen);
+	}
+	region_lock(thmap);
+	region->next = atomic_load_relaxed(&thmap->regions);
+	atomic_store_relaxed(&thmap->regions, region);
+	region_unlock(thmap);
+
+	/*
+	 * Switch the readers over to the new copy and retire the old nodes.
+	 * Release to subsequent consume in find_edge_node().
+	 */
+	for (unsigned i = 0; i < ROOT_SIZE; i++) {
+		if (oroot[i] == THMAP_NULL) {
+			continue;
+		}
+		atomic_store_release(&thmap->root[i], nroot[i]);
+		root_sync(thmap, i);
+		compact_retire(thmap, THMAP_NODE(thmap, oroot[i]));
+	}
+	return 0;
+}
+
+/*
+ * thmap_compact: re-lay the whole map into a contiguous memory region.
+ *
+ * => The caller must ensure there are no concurrent writers; lookups
+ *    can proceed concurrently.
+ * => Returns 0 on success and -1 if the region could not be allocated,
+ *    the map is in the lock-free mode or has live snapshots.
+ */
+int
+thmap_compact(thmap_t *thmap)
+{
+	int ret = -1;
+
+	if (thmap->flags & THMAP_LOCKFREE) {
+		return -1;
+	}
+	snap_enter(thmap);
+	if (thmap->snapshots == NULL) {
+		ret = compact(thmap);
+	}
+	snap_exit(thmap);
+	return ret;
+}
+
+/*
+ * DEFRAGMENTATION.
+ *
+ * The trie is walked incrementally, in the depth-first order, and the
+ * nodes are relocated if the allocator can provide them a lower address.
+ * Hence, with an address-ordered allocator (e.g. first-fit arena), the
+ * live objects migrate towards the beginning and the tail space gets
+ * freed.  The walk position is kept as a path of slot indexes rather
+ * than node pointers, since the nodes might be reclaimed in between the
+ * calls; the path is re-validated on each call.
+ */
+
+/*
+ * relocate_alloc: allocate the memory for relocation; return 0 unless
+ * the new address is lower than the current one.
+ */
+static uintptr_t
+relocate_alloc(thmap_t *thmap, uintptr_t cur, size_t len, unsigned type)
+{
+	const uintptr_t addr = mem_alloc(thmap, len, type);
+
+	if (addr && addr > cur) {
+		mem_free(thmap, addr, len, type);
+		return 0;
+	}
+	return addr;
+}
+
+/*
+ * relocate_leaf: move the leaf (and its key, if copied) at the given slot.
+ *
+ * => The leaf is replaced to point at the moved key, therefore the key
+ *    moves only if the leaf gets a lower address as well.
+ * => Returns true if anything was relocated.
+ */
+static bool
+relocate_leaf(thmap_t *thmap, thmap_inode_t *node, unsigned slot,
+    thmap_ptr_t target)
+{
+	const uintptr_t leaf_off = THMAP_ALIGN(target);
+	thmap_leaf_t *leaf = THMAP_NODE(thmap, target), *nleaf;
+	uintptr_t nleaf_off, nkey_off = 0;
+
+	nleaf_off = relocate_alloc(thmap, leaf_off,
+	    THMAP_LEAF_LEN(thmap), MEM_LEAF);
+	if ((thmap->flags & THMAP_NOCOPY) == 0) {
+		nkey_off = relocate_alloc(thmap, leaf->key, leaf->len, MEM_KEY);
+	}
+	if (!nleaf_off) {
+		/*
+		 * Just the key could move, but it needs a new leaf, which
+		 * would not be at a lower address: leave both in place.
+		 */
+		if (nkey_off) {
+			mem_free(thmap, nkey_off, leaf->len, MEM_KEY);
+		}
+		return false;
+	}
+
+	lock_node(thmap, node);
+	if ((atomic_load_relaxed(&node->state) & (NODE_DELETED | NODE_MOVED)) ||
+	    atomic_load_relaxed(&node->slots[slot]) != target) {
+		/* Raced with the removal. */
+		unlock_node(thmap, node);
+		if (nkey_off) {
+			mem_free(thmap, nkey_off, leaf->len, MEM_KEY);
+		}
+		mem_free(thmap, nleaf_off, THMAP_LEAF_LEN(thmap), MEM_LEAF);
+		return false;
+	}
+	nleaf = THMAP_GETPTR(thmap, nleaf_off);
+	memcpy(nleaf, leaf, THMAP_LEAF_LEN(thmap));
+	if (nkey_off) {
+		memcpy(THMAP_GETPTR(thmap, nkey_off),
+		    THMAP_GETPTR(thmap, leaf->key), leaf->len);
+		nleaf->key = nkey_off;
+	}
+
+	/* Release to subsequent consume in get_leaf(). */
+	atomic_store_release(&node->slots[slot], nleaf_off | THMAP_LEAF_BIT);
+	unlock_node(thmap, node);
+
+	if (nkey_off) {
+		stage_mem_gc(thmap, leaf->key, leaf->len, MEM_KEY);
+	}
+	stage_mem_gc(thmap, leaf_off, THMAP_LEAF_LEN(thmap), MEM_LEAF);
+	THMAP_STAT_INC(thmap, relocations);
+	return true;
+}
+
+/*
+ * inode_move: move the intermediate node, referenced either by the parent
+ * slot or, if the parent is NULL, by the root-level slot, into the given
+ * new memory.
+ *
+ * => Returns the new node or NULL, if the node has changed in the
+ *    meantime (the new memory is then freed).
+ */
+static thmap_inode_t *
+inode_move(thmap_t *thmap, thmap_inode_t *parent, unsigned slot,
+    thmap_ptr_t target, uintptr_t nnode_off)
+{
+	atomic_thmap_ptr_t *pslot = parent ?
+	    &parent->slots[slot] : &thmap->root[slot];
+	thmap_inode_t *node = THMAP_NODE(thmap, target), *nnode = NULL;
+	thmap_inode_t *children[LEVEL_SIZE];
+	unsigned nchildren = 0, n = 0;
+
+	/*
+	 * Lock the intermediate children, the node and its parent.  Then
+	 * verify that neither of them has changed in the meantime.
+	 */
+	for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+		const thmap_ptr_t p = atomic_load_relaxed(&node->slots[i]);
+
+		if (p && THMAP_INODE_P(p)) {
+			children[nchildren] = THMAP_NODE(thmap, p);
+			lock_node(thmap, children[nchildren++]);
+		}
+	}
+	lock_node(thmap, node);
+	if (parent) {
+		lock_node(thmap, parent);
+	}
+	if ((atomic_load_relaxed(&node->state) & (NODE_DELETED | NODE_MOVED)) ||
+	    (parent && (atomic_load_relaxed(&parent->state) &
+	    (NODE_DELETED | NODE_MOVED))) ||
+	    atomic_load_relaxed(pslot) != target) {
+		goto out;
+	}
+	for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+		const thmap_ptr_t p = atomic_load_relaxed(&node->slots[i]);
+
+		if (p && THMAP_INODE_P(p)) {
+			if (n == nchildren || children[n] != THMAP_NODE(thmap, p))
+				goto out;
+			n++;
+		}
+	}
+	if (n != nchildren) {
+		goto out;
+	}
+
+	/*
+	 * Copy the node (it will be locked, as the original one is)
+	 * and update the parent pointers of the children.
+	 */
+	nnode = THMAP_GETPTR(thmap, nnode_off);
+	memcpy(nnode, node, THMAP_INODE_LEN(thmap));
+	atomic_store_relaxed(&nnode->waiters, 0);
+	if (thmap->flags & THMAP_SNAPSHOT) {
+		*THMAP_INODE_GEN(nnode) = thmap->gen;
+	}
+	for (unsigned i = 0; i < nchildren; i++) {
+		children[i]->parent = nnode_off;
+	}
+
+	/*
+	 * Publish the new node and mark the old one as moved.
+	 * Release to subsequent consume in find_edge_node().
+	 */
+	atomic_store_release(pslot, nnode_off);
+	if (!parent) {
+		root_sync(thmap, slot);
+	}
+	atomic_store_relaxed(&node->state,
+	    atomic_load_relaxed(&node->state) | NODE_MOVED);
+	stage_mem_gc(thmap, target, THMAP_INODE_LEN(thmap), MEM_INODE);
+
+	unlock_node(thmap, node);
+	node = nnode;
+	nnode_off = 0;
+out:
+	if (parent) {
+		unlock_node(thmap, parent);
+	}
+	unlock_node(thmap, node);
+	while (nchildren--) {
+		unlock_node(thmap, children[nchildren]);
+	}
+	if (nnode_off) {
+		mem_free(thmap, nnode_off, THMAP_INODE_LEN(thmap), MEM_INODE);
+		nnode = NULL;
+	}
+	return nnode;
+}
+
+/*
+ * relocate_inode: move the intermediate node to a lower address, if
+ * possible, see inode_move().
+ *
+ * => Returns the current node (the new one, if relocated).
+ */
+static thmap_inode_t *
+relocate_inode(thmap_t *thmap, thmap_inode_t *parent, unsigned slot,
+    thmap_ptr_t target)
+{
+	thmap_inode_t *nnode;
+	uintptr_t nnode_off;
+
+	nnode_off = relocate_alloc(thmap, target,
+	    THMAP_INODE_LEN(thmap), MEM_INODE);
+	if (!nnode_off || (nnode = inode_move(thmap, parent, slot,
+	    target, nnode_off)) == NULL) {
+		return THMAP_NODE(thmap, target);
+	}
+	THMAP_STAT_INC(thmap, relocations);
+	return nnode;
+}
+
+/*
+ * cursor_locate: find the current node by following the path.  If the path
+ * no longer leads to an intermediate node (the trie has changed), then the
+ * walk continues from the level where it broke off.
+ *
+ * => Fills the stack of nodes, up to the current level.
+ * => Returns false if the root-level slot is empty.
+ */
+static bool
+cursor_locate(const thmap_t *thmap, thmap_cursor_t *cur,
+    thmap_inode_t **stack)
+{
+	thmap_ptr_t target;
+
+	/* Consume from prior release in root_try_put(). */
+	target = atomic_load_consume(&thmap->root[cur->rslot]);
+	if (target == THMAP_NULL) {
+		return false;
+	}
+	stack[0] = THMAP_NODE(thmap, target);
+	for (unsigned level = 0; level < cur->level; level++) {
+		target = atomic_load_consume(
+		    &stack[level]->slots[cur->path[level]]);
+		if (!target || !THMAP_INODE_P(target)) {
+			cur->level = level;
+			break;
+		}
+		stack[level + 1] = THMAP_NODE(thmap, target);
+	}
+	return true;
+}
+
+/*
+ * cursor_next: advance the walk position to the next leaf, wrapping around
+ * at the end of the map.  Each intermediate node or leaf visited (and each
+ * root-level slot) takes a step.
+ *
+ * => Returns the leaf or NULL if the steps have been exhausted.
+ */
+static thmap_leaf_t *
+cursor_next(const thmap_t *thmap, thmap_cursor_t *cur,
+    thmap_inode_t **stack, bool *located, unsigned *nsteps)
+{
+	while (*nsteps) {
+		thmap_ptr_t target;
+		unsigned level, slot;
+
+		if (!*located && !cursor_locate(thmap, cur, stack)) {
+			/* Empty root slot. */
+			cur->path[0] = LEVEL_SIZE;
+			cur->level = 0;
+		}
+		*located = true;
+
+		level = cur->level;
+		slot = cur->path[level];
+		if (slot == LEVEL_SIZE) {
+			/* Ascend or advance to the next root slot. */
+			if (level) {
+				cur->path[--cur->level]++;
+				continue;
+			}
+			cur->rslot = (cur->rslot + 1) % ROOT_SIZE;
+			cur->path[0] = 0;
+			*located = false;
+			(*nsteps)--;
+			continue;
+		}
+		(*nsteps)--;
+
+		target = atomic_load_consume(&stack[level]->slots[slot]);
+		if (target && THMAP_INODE_P(target)) {
+			ASSERT(level + 1 < THMAP_MAXDEPTH);
+			stack[level + 1] = THMAP_NODE(thmap, target);
+			cur->path[++cur->level] = 0;
+			continue;
+		}
+		cur->path[level]++;
+		if (target) {
+			return THMAP_NODE(thmap, target);
+		}
+	}
+	return NULL;
+}
+
+static int
+defrag(thmap_t *thmap, unsigned nsteps)
+{
+	thmap_cursor_t *cur = &thmap->defrag;
+	thmap_inode_t *stack[THMAP_MAXDEPTH];
+	bool located = false;
+
+	if (cur->rslot == ROOT_SIZE) {
+		/* Start a new pass. */
+		cur->rslot = 0;
+		cur->started = false;
+	}
+	while (nsteps) {
+		thmap_ptr_t target;
+		thmap_inode_t *node;
+		unsigned level, slot;
+
+		if (!cur->started) {
+			/* Starting the root slot: visit the top node. */
+			target = atomic_load_consume(&thmap->root[cur->rslot]);
+			if (target) {
+				relocate_inode(thmap, NULL, cur->rslot, target);
+			}
+			cur->started = true;
+			cur->level = 0;
+			cur->path[0] = 0;
+			located = false;
+			nsteps--;
+			continue;
+		}
+		if (!located && !cursor_locate(thmap, cur, stack)) {
+			/* Empty root slot. */
+			cur->path[0] = LEVEL_SIZE;
+			cur->level = 0;
+		}
+		located = true;
+
+		level = cur->level;
+		slot = cur->path[level];
+		if (slot == LEVEL_SIZE) {
+			/* Ascend or advance to the next root slot. */
+			if (level) {
+				cur->path[--cur->level]++;
+				continue;
+			}
+			if (++cur->rslot == ROOT_SIZE) {
+				return 0;
+			}
+			cur->started = false;
+			continue;
+		}
+		node = stack[level];
+		nsteps--;
+
+		target = atomic_load_consume(&node->slots[slot]);
+		if (target && THMAP_INODE_P(target)) {
+			/* Relocate the intermediate node and descend. */
+			ASSERT(level + 1 < THMAP_MAXDEPTH);
+			stack[level + 1] = relocate_inode(thmap,
+			    node, slot, target);
+			cur->path[++cur->level] = 0;
+			continue;
+		}
+		if (target) {
+			relocate_leaf(thmap, node, slot, target);
+		}
+		cur->path[level]++;
+	}
+	return 1;
+}
+
+/*
+ * thmap_defrag: perform up to the given number of the relocation steps,
+ * continuing from where the previous call has stopped.
+ *
+ * => The calls must be serialized (e.g. a maintenance thread).  The
+ *    caller is considered a reader with respect to the G/C.
+ * => Returns 0 if the pass over the whole map has completed (the next
+ *    call starts a new pass) and 1 otherwise.
+ * => The relocation relies on the node locks, therefore in the lock-free
+ *    mode there is nothing to do.  Neither is there while the map has
+ *    live snapshots, as the nodes are shared with them.
+ */
+int
+thmap_defrag(thmap_t *thmap, unsigned nsteps)
+{
+	int ret = 0;
+
+	if (thmap->flags & THMAP_LOCKFREE) {
+		return 0;
+	}
+	snap_enter(thmap);
+	if (thmap->snapshots == NULL) {
+		ret = defrag(thmap, nsteps);
+	}
+	snap_exit(thmap);
+	return ret;
+}
+
+/*
+ * CACHE.
+ *
+ * In the cache mode, the lookups set the reference bit of the leaf and
+ * the CLOCK hand sweeps over the leaves in the trie order, using the
+ * resumable walk position: the referenced entries get their bit cleared
+ * (a second chance), while the others are evicted using thmap_del(),
+ * i.e. through the regular G/C path.  The hand is moved by the inserting
+ * writers, when the budget is exceeded, or explicitly.
+ */
+
+/*
+ * cache_full_p: return true if the cache budget is exceeded.
+ *
+ * => The live memory counter lags behind by at most a batch per shard,
+ *    which is scaled to the budget (see MEM_BATCH_LEN()), so the shards
+ *    are not summed on every check.
+ */
+static bool
+cache_full_p(const thmap_t *thmap)
+{
+	const int64_t maxitems = atomic_load_relaxed(&thmap->cache_maxitems);
+	const int64_t maxbytes = atomic_load_relaxed(&thmap->cache_maxbytes);
+
+	if (maxitems && atomic_load_relaxed(&thmap->cache_nitems) > maxitems) {
+		return true;
+	}
+	return maxbytes && atomic_load_relaxed(&thmap->cache_bytes) > maxbytes;
+}
+
+/*
+ * clock_evict: evict the entry of the given leaf.
+ */
+static void
+clock_evict(thmap_t *thmap, const thmap_leaf_t *leaf)
+{
+	thmap_leaf_t *removed;
+
+	/*
+	 * Note: the key stays valid until G/C, even if the entry gets
+	 * deleted concurrently.
+	 */
+	removed = del_entry(thmap, THMAP_GETPTR(thmap, leaf->key),
+	    leaf->len, 0);
+	if (removed) {
+		THMAP_STAT_INC(thmap, evictions);
+		leaf_evicted(thmap, removed);
+	}
+}
+
+/*
+ * thmap_cache_evict: move the CLOCK hand by up to the given number of
+ * steps (leaves and intermediate nodes visited), evicting the entries
+ * while the cache budget is exceeded.
+ *
+ * => If another thread is moving the hand, then return immediately.
+ * => The caller is considered a reader with respect to the G/C.
+ * => Returns the number of the evicted entries.
+ */
+unsigned
+thmap_cache_evict(thmap_t *thmap, unsigned nsteps)
+{
+	thmap_cursor_t *cur = &thmap->clock;
+	thmap_inode_t *stack[THMAP_MAXDEPTH];
+	const thmap_leaf_t *leaf;
+	bool located = false;
+	unsigned nevicted = 0;
+
+	if ((thmap->flags & THMAP_CACHE) == 0 || !cache_full_p(thmap)) {
+		return 0;
+	}
+	if (atomic_exchange_explicit(&thmap->clock_lock, 1,
+	    memory_order_acquire)) {
+		/* Someone else is evicting; the budget is soft. */
+		return 0;
+	}
+	while ((leaf = cursor_next(thmap, cur, stack, &located,
+	    &nsteps)) != NULL) {
+		atomic_uint *ref = THMAP_LEAF_REF(thmap, leaf);
+
+		/* Second chance for the referenced entries. */
+		if (atomic_load_relaxed(ref)) {
+			atomic_store_relaxed(ref, 0);
+			continue;
+		}
+
+		/* The trie might change: locate again after the eviction. */
+		clock_evict(thmap, leaf);
+		located = false;
+		nevicted++;
+		if (!cache_full_p(thmap)) {
+			break;
+		}
+	}
+	atomic_store_release(&thmap->clock_lock, 0);
+	return nevicted;
+}
+
+/*
+ * thmap_setcache: set the cache budget, the maximum number of entries
+ * and/or the memory in bytes (as per thmap_memory_usage(), but excluding
+ * the memory pending G/C); zero indicates no limit.
+ *
+ * => May be called concurrently with the writers.
+ * => The map must be created with THMAP_CACHE; returns -1 otherwise.
+ */
+int
+thmap_setcache(thmap_t *thmap, size_t maxitems, size_t maxbytes)
+{
+	if ((thmap->flags & THMAP_CACHE) == 0) {
+		return -1;
+	}
+	atomic_store_relaxed(&thmap->cache_batchlen, MEM_BATCH_LEN(maxbytes));
+	atomic_store_relaxed(&thmap->cache_maxitems, maxitems);
+	atomic_store_relaxed(&thmap->cache_maxbytes, maxbytes);
+
+	/* Propagate the batches, which might exceed the new length. */
+	for (unsigned i = 0; i < THMAP_NSHARDS; i++) {
+		const int64_t batch = atomic_exchange_explicit(
+		    &thmap->shards[i].cache_batch, 0, memory_order_relaxed);
+
+		atomic_fetch_add_explicit(&thmap->cache_bytes, batch,
+		    memory_order_relaxed);
+	}
+	return 0;
+}
+
+/*
+ * thmap_setevict: set the function called for every entry removed by
+ * the map itself, i.e. evicted in the cache mode or expired in the TTL
+ * mode, e.g. to release the value once it is safe to do so (the key and
+ * the value are valid until G/C).
+ */
+void
+thmap_setevict(thmap_t *thmap, thmap_evict_func_t func, void *arg)
+{
+	thmap->evict_func = func;
+	thmap->evict_arg = arg;
+}
+
+/*
+ * TTL.
+ *
+ * In the TTL mode, the leaf holds the expiry time, in arbitrary units
+ * (e.g. seconds).  The map keeps the current time, advanced by the
+ * sweeper, thmap_expire(): the expired entries are treated as missing
+ * by the lookups (lazy expiration), replaced by the inserts and removed
+ * by the sweeper in batches, through the regular G/C path.  Hence, the
+ * expiration does not add to the write traffic of the request path.
+ */
+
+/*
+ * thmap_put_ttl: insert a value given the key, with the expiry time
+ * (zero means no expiry), see thmap_put().
+ *
+ * => The map must be created with THMAP_TTL; returns NULL otherwise.
+ */
+void *
+thmap_put_ttl(thmap_t *thmap, const void *key, size_t len, void *val,
+    uint64_t expire)
+{
+	if ((thmap->flags & THMAP_TTL) == 0) {
+		return NULL;
+	}
+	val = put_entry(thmap, key, len, val, expire, NULL);
+	if (__predict_false(thmap->flags & THMAP_CACHE)) {
+		(void)thmap_cache_evict(thmap, CLOCK_STEPS);
+	}
+	return val;
+}
+
+/*
+ * thmap_setexpire: set the expiry time of the entry (zero means no
+ * expiry), e.g. to extend the lifetime of a session.
+ *
+ * => Returns 0 on success and -1 if the key is not found (or expired).
+ */
+int
+thmap_setexpire(thmap_t *thmap, const void *key, size_t len, uint64_t expire)
+{
+	thmap_query_t query;
+	thmap_inode_t *parent;
+	thmap_leaf_t *leaf;
+	unsigned slot;
+
+	if ((thmap->flags & THMAP_TTL) == 0) {
+		return -1;
+	}
+
+	/*
+	 * Lock the parent node: the leaf might be relocated or replaced
+	 * concurrently and the update must not get lost.
+	 */
+	hashval_init(&query, key, len);
+	parent = find_edge_node_locked(thmap, &query, key, len, &slot);
+	if (!parent) {
+		return -1;
+	}
+	leaf = get_leaf(thmap, parent, slot);
+	if (!leaf || !key_cmp_p(thmap, leaf, key, len) ||
+	    !leaf_live_p(thmap, leaf)) {
+		unlock_node(thmap, parent);
+		return -1;
+	}
+	atomic_store_relaxed(THMAP_LEAF_EXP(thmap, leaf), expire);
+	unlock_node(thmap, parent);
+	return 0;
+}
+
+/*
+ * thmap_expire: advance the current time of the map and perform up to
+ * the given number of the sweeper steps (intermediate nodes and leaves
+ * visited), continuing from where the previous call has stopped and
+ * removing the expired entries.
+ *
+ * => The calls must be serialized (e.g. a maintenance thread).  The
+ *    caller is considered a reader with respect to the G/C.
+ * => The time must not go backwards; zero steps just set the time.
+ * => Returns the number of the removed entries.
+ */
+unsigned
+thmap_expire(thmap_t *thmap, uint64_t now, unsigned nsteps)
+{
+	thmap_cursor_t *cur = &thmap->expiry;
+	thmap_inode_t *stack[THMAP_MAXDEPTH];
+	const thmap_leaf_t *leaf;
+	bool located = false;
+	unsigned nexpired = 0;
+
+	if ((thmap->flags & THMAP_TTL) == 0) {
+		return 0;
+	}
+	if (now > atomic_load_relaxed(&thmap->now)) {
+		atomic_store_relaxed(&thmap->now, now);
+	}
+	while ((leaf = cursor_next(thmap, cur, stack, &located,
+	    &nsteps)) != NULL) {
+		thmap_leaf_t *removed;
+
+		if (!leaf_expired_p(thmap, leaf, now)) {
+			continue;
+		}
+
+		/*
+		 * Remove, unless updated concurrently (the key stays
+		 * valid until G/C).  The trie might change: locate again.
+		 */
+		removed = del_entry(thmap, THMAP_GETPTR(thmap, leaf->key),
+		    leaf->len, now);
+		if (removed) {
+			THMAP_STAT_INC(thmap, expirations);
+			leaf_evicted(thmap, removed);
+			nexpired++;
+		}
+		located = false;
+	}
+	return nexpired;
+}
+
+/*
+ * ITERATION.
+ */
+
+static void
+walk_node(const thmap_t *thmap, const thmap_inode_t *node,
+    thmap_walk_func_t func, void *arg)
+{
+	for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+		/* Consume from prior release in thmap_put(). */
+		const thmap_ptr_t p = atomic_load_consume(&node->slots[i]);
+		const thmap_leaf_t *leaf;
+
+		if (p == THMAP_NULL) {
+			continue;
+		}
+		if (THMAP_INODE_P(p)) {
+			walk_node(thmap, THMAP_NODE(thmap, p), func, arg);
+			continue;
+		}
+		leaf = THMAP_NODE(thmap, p);
+		if (!leaf_live_p(thmap, leaf)) {
+			continue;
+		}
+		func(THMAP_GETPTR(thmap, leaf->key), leaf->len,
+		    leaf_val(thmap, leaf), arg);
+	}
+}
+
+/*
+ * thmap_walk: call the given function for every entry in the map.
+ *
+ * => Safe to call concurrently with the writers; the caller is considered
+ *    a reader with respect to the G/C.  The entries inserted or deleted
+ *    during the walk (including by the function itself) may be missed.
+ */
+void
+thmap_walk(const thmap_t *thmap, thmap_walk_func_t func, void *arg)
+{
+	for (unsigned i = 0; i < ROOT_SIZE; i++) {
+		/* Consume from prior release in root_try_put(). */
+		const thmap_ptr_t root = atomic_load_consume(&thmap->root[i]);
+
+		if (root) {
+			walk_node(thmap, THMAP_NODE(thmap, root), func, arg);
+		}
+	}
+}
+
+/*
+ * SNAPSHOTS.
+ *
+ * In the snapshot mode, a snapshot is a read-only view of the map as of
+ * the moment it was taken, sharing the structure with the live map.  It
+ * consists of a copy of the root level only; then the map advances its
+ * generation.  Every intermediate node records the generation it was
+ * created in: the nodes not newer than the newest snapshot might be shared
+ * with it, therefore the writer first copies such nodes on the path of
+ * its key, top-down (see snap_unshare()), and then updates the path as
+ * usual.  The leaves are not updated in place while there are snapshots:
+ * the value replacement creates a new leaf instead (see leaf_copy()).
+ *
+ * The objects removed from the map while there are live snapshots are
+ * retired to the newest snapshot, instead of the G/C list.  Releasing the
+ * snapshot passes them on to the next older snapshot, which might still
+ * reference them, or, if there is none, stages them for G/C.
+ *
+ * The snapshot must be taken while no update is half-way, therefore the
+ * writers pass through a barrier: a writer increments the counter of its
+ * shard and then checks the pending flag, while the snapshot sets the flag
+ * and then waits for the counters to drain.  Hence, the writers are held
+ * off only for the constant time it takes to copy the root level; the
+ * lookups and iteration on the map or the snapshots never wait.
+ */
+
+static void
+snap_enter(thmap_t *thmap)
+{
+	unsigned bcount = SPINLOCK_BACKOFF_MIN;
+	thmap_shard_t *shard;
+
+	if ((thmap->flags & THMAP_SNAPSHOT) == 0) {
+		return;
+	}
+	shard = shard_get(thmap);
+	for (;;) {
+		/*
+		 * Store-load ordering against snap_stop(), which sets the
+		 * flag and then loads the counters, hence seq-cst.
+		 */
+		atomic_fetch_add_explicit(&shard->writers, 1,
+		    memory_order_seq_cst);
+		if (!atomic_load_explicit(&thmap->snap_pending,
+		    memory_order_seq_cst)) {
+			break;
+		}
+		atomic_fetch_sub_explicit(&shard->writers, 1,
+		    memory_order_release);
+		while (atomic_load_relaxed(&thmap->snap_pending)) {
+			SPINLOCK_BACKOFF(bcount);
+		}
+	}
+}
+
+static void
+snap_exit(thmap_t *thmap)
+{
+	if ((thmap->flags & THMAP_SNAPSHOT) == 0) {
+		return;
+	}
+	/* Release to subsequent load in snap_stop(). */
+	atomic_fetch_sub_explicit(&shard_get(thmap)->writers, 1,
+	    memory_order_release);
+}
+
+/*
+ * snap_stop: serialize against the other snapshot operations and wait
+ * for the writers to leave the barrier, holding off the new ones.
+ */
+static void
+snap_stop(thmap_t *thmap)
+{
+	unsigned bcount = SPINLOCK_BACKOFF_MIN;
+	unsigned expected;
+again:
+	expected = 0;
+	if (!atomic_compare_exchange_weak_explicit(&thmap->snap_lock,
+	    &expected, 1, memory_order_acquire, memory_order_relaxed)) {
+		SPINLOCK_BACKOFF(bcount);
+		goto again;
+	}
+	atomic_store_explicit(&thmap->snap_pending, 1, memory_order_seq_cst);
+	for (unsigned i = 0; i < THMAP_NSHARDS; i++) {
+		bcount = SPINLOCK_BACKOFF_MIN;
+		while (atomic_load_explicit(&thmap->shards[i].writers,
+		    memory_order_seq_cst)) {
+			SPINLOCK_BACKOFF(bcount);
+		}
+	}
+}
+
+static void
+snap_resume(thmap_t *thmap)
+{
+	/* Release to subsequent load in snap_enter(). */
+	atomic_store_explicit(&thmap->snap_pending, 0, memory_order_seq_cst);
+	atomic_store_release(&thmap->snap_lock, 0);
+}
+
+/*
+ * snap_unshare: copy the intermediate nodes, on the path of the given key,
+ * which might be shared with the snapshots.
+ *
+ * => Must be called in the barrier, without any node locked.
+ * => Once copied, the path stays private to the map until the next
+ *    snapshot, which cannot be taken while in the barrier.
+ * => Returns 0 on success and -1 if a node could not be allocated.
+ */
+static int
+snap_unshare(thmap_t *thmap, const void *key, size_t len)
+{
+	thmap_query_t query;
+	thmap_inode_t *parent, *node;
+	thmap_ptr_t target;
+	uintptr_t nnode_off;
+	unsigned slot;
+
+	if (__predict_true(thmap->snapshots == NULL)) {
+		return 0;
+	}
+	hashval_init(&query, key, len);
+retry:
+	query.level = 0;
+	parent = NULL;
+	slot = query.rslot;
+
+	/* Consume from prior release in root_try_put(). */
+	target = atomic_load_consume(&thmap->root[slot]);
+	while (target && THMAP_INODE_P(target)) {
+		node = THMAP_NODE(thmap, target);
+		if (*THMAP_INODE_GEN(node) <= thmap->snapshots->gen) {
+			nnode_off = mem_alloc(thmap,
+			    THMAP_INODE_LEN(thmap), MEM_INODE);
+			if (!nnode_off) {
+				return -1;
+			}
+			node = inode_move(thmap, parent, slot,
+			    target, nnode_off);
+			if (!node) {
+				/* Raced with another writer. */
+				THMAP_STAT_INC(thmap, restarts);
+				goto retry;
+			}
+		}
+		slot = hashval_getslot(&query, key, len);
+		query.level++;
+		parent = node;
+
+		/* Consume from prior release in thmap_put(). */
+		target = atomic_load_consume(&parent->slots[slot]);
+	}
+	return 0;
+}
+
+/*
+ * thmap_snapshot_take: take a consistent point-in-time snapshot of the map.
+ *
+ * => Briefly holds off the writers (see above); the cost does not
+ *    depend on the number of entries.
+ * => Returns NULL if the map is not in the snapshot mode or on failure.
+ */
+thmap_snapshot_t *
+thmap_snapshot_take(thmap_t *thmap)
+{
+	thmap_snapshot_t *snap;
+
+	if ((thmap->flags & THMAP_SNAPSHOT) == 0) {
+		return NULL;
+	}
+	if ((snap = calloc(1, sizeof(thmap_snapshot_t))) == NULL) {
+		return NULL;
+	}
+	snap->thmap = thmap;
+
+	snap_stop(thmap);
+	for (unsigned i = 0; i < ROOT_SIZE; i++) {
+		atomic_store_relaxed(&snap->root[i],
+		    atomic_load_relaxed(&thmap->root[i]));
+	}
+	snap->gen = thmap->gen++;
+	snap->older = thmap->snapshots;
+	if (snap->older) {
+		snap->older->newer = snap;
+	}
+	thmap->snapshots = snap;
+	snap_resume(thmap);
+	return snap;
+}
+
+/*
+ * thmap_snapshot_get: lookup a value given the key, as of the snapshot.
+ */
+void *
+thmap_snapshot_get(thmap_snapshot_t *snap, const void *key, size_t len)
+{
+	const thmap_t *thmap = snap->thmap;
+	thmap_query_t query;
+	thmap_inode_t *parent;
+	thmap_leaf_t *leaf;
+	unsigned slot;
+
+	hashval_init(&query, key, len);
+	parent = find_edge_node(thmap, snap->root, &query, key, len, &slot);
+	if (!parent) {
+		return NULL;
+	}
+	leaf = get_leaf(thmap, parent, slot);
+	if (!leaf || !key_cmp_p(thmap, leaf, key, len)) {
+		return NULL;
+	}
+	return leaf_val(thmap, leaf);
+}
+
+/*
+ * thmap_snapshot_walk: call the given function for every entry in the
+ * snapshot, see thmap_walk().
+ *
+ * => Unlike the walk of the live map, no entry is missed or seen twice.
+ */
+void
+thmap_snapshot_walk(thmap_snapshot_t *snap, thmap_walk_func_t func,
+    void *arg)
+{
+	const thmap_t *thmap = snap->thmap;
+
+	for (unsigned i = 0; i < ROOT_SIZE; i++) {
+		const thmap_ptr_t root = atomic_load_consume(&snap->root[i]);
+
+		if (root) {
+			walk_node(thmap, THMAP_NODE(thmap, root), func, arg);
+		}
+	}
+}
+
+/*
+ * thmap_snapshot_release: release the snapshot.
+ *
+ * => The snapshot must not be accessed afterwards, but the objects it
+ *    references are reclaimed through the G/C, therefore the concurrent
+ *    readers of the snapshot are handled as the readers of the map.
+ */
+void
+thmap_snapshot_release(thmap_snapshot_t *snap)
+{
+	thmap_t *thmap = snap->thmap;
+	thmap_gc_t *_Atomic *list;
+	thmap_gc_t *head, *tail, *next;
+
+	snap_stop(thmap);
+	if (snap->newer) {
+		snap->newer->older = snap->older;
+	} else {
+		thmap->snapshots = snap->older;
+	}
+	if (snap->older) {
+		snap->older->newer = snap->newer;
+	}
+
+	/*
+	 * Pass the retired objects on to the next older snapshot or stage
+	 * them for G/C, if none.  The latter might be concurrently taken
+	 * by thmap_stage_gc(), hence the CAS.
+	 */
+	if ((head = atomic_load_relaxed(&snap->retired)) != NULL) {
+		list = snap->older ? &snap->older->retired : &thmap->gc_list;
+		for (tail = head; tail->next; tail = tail->next)
+			continue;
+retry:
+		next = atomic_load_relaxed(list);
+		tail->next = next;
+
+		/* Release to subsequent acquire in thmap_stage_gc(). */
+		if (!atomic_compare_exchange_weak_explicit(list, &next, head,
+		    memory_order_release, memory_order_relaxed)) {
+			goto retry;
+		}
+	}
+	snap_resume(thmap);
+	free(snap);
+}
+
+/*
+ * STRUCTURAL STATISTICS.
+ */
+
+static void
+stat_walk(const thmap_t *thmap, const thmap_inode_t *node, unsigned level,
+    thmap_structure_t *st)
+{
+	const unsigned l = MIN(level, THMAP_STAT_LEVELS - 1);
+
+	st->inodes++;
+	st->level_inodes[l]++;
+
+	for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+		/* Consume from prior release in thmap_put(). */
+		const thmap_ptr_t p = atomic_load_consume(&node->slots[i]);
+
+		if (p == THMAP_NULL) {
+			continue;
+		}
+		st->level_slots[l]++;
+		if (THMAP_INODE_P(p)) {
+			stat_walk(thmap, THMAP_NODE(thmap, p), level + 1, st);
+		} else {
+			const thmap_leaf_t *leaf = THMAP_NODE(thmap, p);
+
+			st->leaves++;
+			st->depth[l]++;
+			st->key_bytes += leaf->len;
+		}
+	}
+}
+
+/*
+ * thmap_stat_structure: walk the trie and collect the statistics on its
+ * shape and the memory footprint.
+ *
+ * => Safe to call concurrently with the writers; the caller is considered
+ *    a reader with respect to the G/C.  The result reflects the structure
+ *    as it was seen by the walk.
+ */
+void
+thmap_stat_structure(const thmap_t *thmap, thmap_structure_t *st)
+{
+	memset(st, 0, sizeof(thmap_structure_t));
+	for (unsigned i = 0; i < ROOT_SIZE; i++) {
+		/* Consume from prior release in root_try_put(). */
+		const thmap_ptr_t root = atomic_load_consume(&thmap->root[i]);
+
+		if (root) {
+			stat_walk(thmap, THMAP_NODE(thmap, root), 0, st);
+		}
+	}
+	st->total_bytes = THMAP_ROOT_LEN;
+	st->total_bytes += st->inodes * THMAP_INODE_LEN(thmap);
+	st->total_bytes += st->leaves * THMAP_LEAF_LEN(thmap);
+	if ((thmap->flags & THMAP_NOCOPY) == 0) {
+		st->total_bytes += st->key_bytes;
+	}
+	st->bytes_per_entry = st->leaves ? st->total_bytes / st->leaves : 0;
+}
+
+/*
+ * SPLIT AND GRAFT.
+ *
+ * The keys are distributed across the root-level slots by their hash and
+ * length (the prefix), therefore a whole root-level subtree can be moved
+ * between the maps sharing the base address and the allocator, e.g. an
+ * arena in the shared memory, by moving the pointer instead of iterating
+ * and re-inserting the keys.  The subtree is self-contained: its top node
+ * has no parent and the slot positions below depend only on the key.
+ *
+ * The accounting moves with the subtree as well: the counts of the prefix
+ * are taken from the per-slot accounting of the source map on detach and
+ * kept in a record referenced by the parent field of the detached top node
+ * (otherwise unused), which is applied and released on graft.  The record
+ * is allocated using the operations of the map, hence it is reachable in
+ * the other processes sharing the memory.  Therefore, the move does not
+ * depend on the number of the keys.
+ *
+ * The nodes must have the same layout in both maps: the node sizes (which
+ * depend on the value mode and size), the key copying and the extra leaf
+ * words of the cache and TTL modes.  The record carries the layout of the
+ * source map, so that the graft can verify it.
+ */
+
+#define	THMAP_LAYOUT_FLAGS	(THMAP_NOCOPY | THMAP_CACHE | THMAP_TTL)
+
+typedef struct {
+	uint64_t	items;
+	uint64_t	inodes;
+	uint64_t	key_bytes;
+	uint32_t	inode_len;
+	uint32_t	leaf_len;
+	uint32_t	flags;
+	uint32_t	vinline;
+	uint64_t	vlen;
+} thmap_subacct_t;
+
+/*
+ * layout_compat_p: return true if the maps have the same node layout.
+ */
+static bool
+layout_compat_p(const thmap_t *a, const thmap_t *b)
+{
+	return a->inode_len == b->inode_len && a->leaf_len == b->leaf_len &&
+	    ((a->flags ^ b->flags) & THMAP_LAYOUT_FLAGS) == 0 &&
+	    a->vinline == b->vinline && a->vlen == b->vlen;
+}
+
+/*
+ * thmap_prefix: return the prefix (root-level slot) of the given key.
+ */
+unsigned
+thmap_prefix(const void *key, size_t len)
+{
+	thmap_query_t query;
+
+	hashval_init(&query, key, len);
+	return query.rslot;
+}
+
+/*
+ * subtree_sum: get the per-slot accounting of the prefix.
+ */
+static void
+subtree_sum(const thmap_t *thmap, unsigned prefix, thmap_subacct_t *sa)
+{
+	thmap_slotacct_t *acct = &thmap->slots[prefix];
+
+	memset(sa, 0, sizeof(thmap_subacct_t));
+	sa->items = atomic_load_relaxed(&acct->items);
+	sa->inodes = atomic_load_relaxed(&acct->inodes);
+	sa->key_bytes = atomic_load_relaxed(&acct->key_bytes);
+}
+
+/*
+ * subtree_account: move the memory accounting and the entry count of the
+ * subtree in or out of the map (sign is 1 or -1).
+ */
+static void
+subtree_account(thmap_t *thmap, unsigned prefix,
+    const thmap_subacct_t *sa, int sign)
+{
+	thmap_slotacct_t *acct = &thmap->slots[prefix];
+
+	mem_account(thmap, MEM_INODE, sign * (int64_t)
+	    (sa->inodes * THMAP_INODE_LEN(thmap)));
+	mem_account(thmap, MEM_LEAF, sign * (int64_t)
+	    (sa->items * THMAP_LEAF_LEN(thmap)));
+	if ((thmap->flags & THMAP_NOCOPY) == 0) {
+		mem_account(thmap, MEM_KEY, sign * (int64_t)sa->key_bytes);
+	}
+	count_add(thmap, sign * (int64_t)sa->items);
+
+	atomic_fetch_add_explicit(&acct->items,
+	    sign * (int64_t)sa->items, memory_order_relaxed);
+	atomic_fetch_add_explicit(&acct->inodes,
+	    sign * (int64_t)sa->inodes, memory_order_relaxed);
+	atomic_fetch_add_explicit(&acct->key_bytes,
+	    sign * (int64_t)sa->key_bytes, memory_order_relaxed);
+}
+
+/*
+ * thmap_detach: detach the subtree of the given prefix from the map.
+ *
+ * => Sets the subtree to its address (relative to the base) or to zero
+ *    if there are no keys with the prefix.
+ * => The map must have no concurrent writers operating on the prefix.
+ *    The readers may still reference the subtree, therefore it must not
+ *    be modified until they are done (as for the G/C).
+ * => Fails (returns -1) if the map has compacted regions, since their
+ *    memory is released together with the region, if the map is in the
+ *    lock-free, snapshot or huge page mode (the nodes belong to the
+ *    arenas of the map) or if the accounting record (see above) could not
+ *    be allocated.
+ */
+int
+thmap_detach(thmap_t *thmap, unsigned prefix, uintptr_t *subtree)
+{
+	thmap_subacct_t *sa;
+	thmap_inode_t *node;
+	thmap_ptr_t root, rec;
+
+	if (prefix >= ROOT_SIZE || atomic_load_relaxed(&thmap->regions) ||
+	    (thmap->flags & (THMAP_LOCKFREE | THMAP_SNAPSHOT |
+	    THMAP_HUGEPAGE)) != 0) {
+		return -1;
+	}
+	if ((rec = thmap->ops->alloc(sizeof(thmap_subacct_t))) == 0) {
+		return -1;
+	}
+again:
+	root = atomic_load_relaxed(&thmap->root[prefix]);
+	if (root == THMAP_NULL) {
+		thmap->ops->free(rec, sizeof(thmap_subacct_t));
+		*subtree = 0;
+		return 0;
+	}
+
+	/*
+	 * Acquiring the lock on the top node prevents the root slot from
+	 * changing (see thmap_del() and relocate_inode()).
+	 */
+	node = THMAP_NODE(thmap, root);
+	lock_node(thmap, node);
+	if (atomic_load_relaxed(&node->state) & (NODE_DELETED | NODE_MOVED)) {
+		unlock_node(thmap, node);
+		goto again;
+	}
+	ASSERT(node->parent == THMAP_NULL);
+	atomic_store_relaxed(&thmap->root[prefix], THMAP_NULL);
+	root_sync(thmap, prefix);
+	unlock_node(thmap, node);
+
+	/* There are no writers on the prefix: the counts are settled. */
+	sa = THMAP_GETPTR(thmap, rec);
+	subtree_sum(thmap, prefix, sa);
+	subtree_account(thmap, prefix, sa, -1);
+	sa->inode_len = thmap->inode_len;
+	sa->leaf_len = thmap->leaf_len;
+	sa->flags = thmap->flags & THMAP_LAYOUT_FLAGS;
+	sa->vinline = thmap->vinline;
+	sa->vlen = thmap->vlen;
+	node->parent = rec;
+	*subtree = root;
+	return 0;
+}
+
+/*
+ * thmap_graft: attach the subtree, previously detached from a map using
+ * the same base address and allocator, at the given prefix.
+ *
+ * => The source map must have the same node layout (see above), i.e.
+ *    the same key copying, value mode and size and the cache and TTL
+ *    modes.
+ * => Returns 0 on success and -1 if the prefix is already populated,
+ *    the subtree was not detached, the layout differs or the map is in
+ *    the snapshot mode (the nodes carry no generation) or the huge page
+ *    mode (the nodes are not from its arenas).
+ */
+int
+thmap_graft(thmap_t *thmap, unsigned prefix, uintptr_t subtree)
+{
+	thmap_ptr_t expected, rec;
+	thmap_subacct_t *sa;
+	thmap_inode_t *node;
+
+	if (prefix >= ROOT_SIZE || subtree == 0 ||
+	    !THMAP_ALIGNED_P(subtree) ||
+	    (thmap->flags & (THMAP_SNAPSHOT | THMAP_HUGEPAGE))) {
+		return -1;
+	}
+	node = THMAP_NODE(thmap, subtree);
+	if ((rec = node->parent) == THMAP_NULL) {
+		return -1;
+	}
+	sa = THMAP_GETPTR(thmap, rec);
+	if (sa->inode_len != thmap->inode_len ||
+	    sa->leaf_len != thmap->leaf_len ||
+	    sa->flags != (thmap->flags & THMAP_LAYOUT_FLAGS) ||
+	    sa->vinline != thmap->vinline || sa->vlen != thmap->vlen) {
+		return -1;
+	}
+
+	/* Account first: the entries may be deleted once published. */
+	subtree_account(thmap, prefix, sa, 1);
+	node->parent = THMAP_NULL;
+again:
+	if (atomic_load_relaxed(&thmap->root[prefix])) {
+		subtree_account(thmap, prefix, sa, -1);
+		node->parent = rec;
+		return -1;
+	}
+	/* Release to subsequent consume in find_edge_node(). */
+	expected = THMAP_NULL;
+	if (!atomic_compare_exchange_weak_explicit(&thmap->root[prefix],
+	    &expected, subtree, memory_order_release, memory_order_relaxed)) {
+		goto again;
+	}
+	root_sync(thmap, prefix);
+	thmap->ops->free(rec, sizeof(thmap_subacct_t));
+	return 0;
+}
+
+/*
+ * thmap_split: move the subtree of the given prefix into the destination
+ * map, which must use the same base address, allocator and node layout
+ * (key copying, value mode and size, cache and TTL modes).  See
+ * thmap_detach() on the constraints.
+ *
+ * => Returns 0 on success and -1 on failure (incompatible maps or the
+ *    prefix already populated in the destination).
+ */
+int
+thmap_split(thmap_t *thmap, unsigned prefix, thmap_t *dst)
+{
+	uintptr_t subtree;
+
+	if (dst->baseptr != thmap->baseptr || dst->ops != thmap->ops ||
+	    !layout_compat_p(dst, thmap) || prefix >= ROOT_SIZE ||
+	    atomic_load_relaxed(&dst->root[prefix])) {
+		return -1;
+	}
+	if (thmap_detach(thmap, prefix, &subtree) == -1) {
+		return -1;
+	}
+	if (subtree && thmap_graft(dst, prefix, subtree) == -1) {
+		/*
+		 * Populated concurrently: put the subtree back (there are
+		 * no writers on the prefix, hence the slot is still free).
+		 */
+		(void)thmap_graft(thmap, prefix, subtree);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * MERGE AND DIFF.
+ *
+ * The position of a key in the trie is determined by its hash, therefore
+ * the same position (the root-level slot and the path of slot indexes) in
+ * two maps covers the same hash prefix.  The maps are compared by walking
+ * both tries in lockstep: a subtree absent on one side is taken as a whole,
+ * while the keys are compared only where a leaf meets a leaf or a subtree.
+ * The root-level slots are independent, so the per-prefix variants can be
+ * run in parallel by the caller.  The expired entries (in the TTL mode)
+ * are treated as absent, as for the lookups.
+ */
+
+typedef struct {
+	const thmap_t *		a;
+	const thmap_t *		b;
+	bool			skip_a;	// do not report the keys only in 'a'
+	thmap_diff_func_t	func;
+	void *			arg;
+} diff_ctx_t;
+
+/*
+ * diff_val_eq_p: compare the values; the inline values are compared
+ * by their contents.
+ */
+static inline bool
+diff_val_eq_p(const thmap_t *thmap, const void *a, const void *b)
+{
+	if (thmap->vinline) {
+		return thmap->vlen == 0 || memcmp(a, b, thmap->vlen) == 0;
+	}
+	return a == b;
+}
+
+static inline void
+diff_report(const diff_ctx_t *ctx, const thmap_t *thmap,
+    const thmap_leaf_t *leaf, void *aval, void *bval)
+{
+	ctx->func(THMAP_GETPTR(thmap, leaf->key), leaf->len,
+	    aval, bval, ctx->arg);
+}
+
+/*
+ * diff_subtree: report all entries of the subtree (or a leaf) present on
+ * one side only.
+ */
+static void
+diff_subtree(const diff_ctx_t *ctx, thmap_ptr_t p, bool is_a)
+{
+	const thmap_t *thmap = is_a ? ctx->a : ctx->b;
+	const thmap_leaf_t *leaf;
+	void *val;
+
+	if (THMAP_INODE_P(p)) {
+		const thmap_inode_t *node = THMAP_NODE(thmap, p);
+
+		for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+			/* Consume from prior release in thmap_put(). */
+			const thmap_ptr_t c =
+			    atomic_load_consume(&node->slots[i]);
+
+			if (c) {
+				diff_subtree(ctx, c, is_a);
+			}
+		}
+		return;
+	}
+	leaf = THMAP_NODE(thmap, p);
+	if (!leaf_live_p(thmap, leaf)) {
+		return;
+	}
+	val = leaf_val(thmap, leaf);
+	diff_report(ctx, thmap, leaf, is_a ? val : NULL, is_a ? NULL : val);
+}
+
+/*
+ * diff_leaf_node: compare the leaf of one side with the subtree at the
+ * same position of the other side; the leaf's key, if present on the
+ * other side, must be within that subtree.
+ */
+static void
+diff_leaf_node(const diff_ctx_t *ctx, const thmap_leaf_t *leaf, bool leaf_a,
+    thmap_ptr_t p, bool *found)
+{
+	const thmap_t *lmap = leaf_a ? ctx->a : ctx->b;
+	const thmap_t *omap = leaf_a ? ctx->b : ctx->a;
+	const thmap_leaf_t *other;
+	void *lval, *oval;
+
+	if (THMAP_INODE_P(p)) {
+		const thmap_inode_t *node = THMAP_NODE(omap, p);
+
+		for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+			/* Consume from prior release in thmap_put(). */
+			const thmap_ptr_t c =
+			    atomic_load_consume(&node->slots[i]);
+
+			if (c) {
+				diff_leaf_node(ctx, leaf, leaf_a, c, found);
+			}
+		}
+		return;
+	}
+	other = THMAP_NODE(omap, p);
+	if (!leaf_live_p(omap, other)) {
+		return;
+	}
+	oval = leaf_val(omap, other);
+	if (!*found && key_cmp_p(omap, other,
+	    THMAP_GETPTR(lmap, leaf->key), leaf->len)) {
+		*found = true;
+		lval = leaf_val(lmap, leaf);
+		if (!diff_val_eq_p(lmap, lval, oval)) {
+			diff_report(ctx, lmap, leaf, leaf_a ? lval : oval,
+			    leaf_a ? oval : lval);
+		}
+		return;
+	}
+	if (leaf_a) {
+		diff_report(ctx, omap, other, NULL, oval);
+	} else if (!ctx->skip_a) {
+		diff_report(ctx, omap, other, oval, NULL);
+	}
+}
+
+/*
+ * diff_live: return the slot, or THMAP_NULL if it is an expired leaf.
+ */
+static inline thmap_ptr_t
+diff_live(const thmap_t *thmap, thmap_ptr_t p)
+{
+	if (p && !THMAP_INODE_P(p) &&
+	    !leaf_live_p(thmap, THMAP_NODE(thmap, p))) {
+		return THMAP_NULL;
+	}
+	return p;
+}
+
+/*
+ * diff_slot: compare the slots at the same position in both maps.
+ */
+static void
+diff_slot(const diff_ctx_t *ctx, thmap_ptr_t pa, thmap_ptr_t pb)
+{
+	const thmap_leaf_t *la, *lb;
+	bool found = false;
+
+	pa = diff_live(ctx->a, pa);
+	pb = diff_live(ctx->b, pb);
+	if (pa == THMAP_NULL || pb == THMAP_NULL) {
+		if (pb) {
+			diff_subtree(ctx, pb, false);
+		} else if (pa && !ctx->skip_a) {
+			diff_subtree(ctx, pa, true);
+		}
+		return;
+	}
+	if (THMAP_INODE_P(pa) && THMAP_INODE_P(pb)) {
+		const thmap_inode_t *na = THMAP_NODE(ctx->a, pa);
+		const thmap_inode_t *nb = THMAP_NODE(ctx->b, pb);
+
+		for (unsigned i = 0; i < LEVEL_SIZE; i++) {
+			/* Consume from prior release in thmap_put(). */
+			diff_slot(ctx, atomic_load_consume(&na->slots[i]),
+			    atomic_load_consume(&nb->slots[i]));
+		}
+		return;
+	}
+	if (THMAP_INODE_P(pa)) {
+		lb = THMAP_NODE(ctx->b, pb);
+		diff_leaf_node(ctx, lb, false, pa, &found);
+		if (!found) {
+			diff_report(ctx, ctx->b, lb, NULL,
+			    leaf_val(ctx->b, lb));
+		}
+		return;
+	}
+	la = THMAP_NODE(ctx->a, pa);
+	if (THMAP_INODE_P(pb)) {
+		diff_leaf_node(ctx, la, true, pb, &found);
+		if (!found && !ctx->skip_a) {
+			diff_report(ctx, ctx->a, la,
+			    leaf_val(ctx->a, la), NULL);
+		}
+		return;
+	}
+
+	/* Leaf vs leaf. */
+	lb = THMAP_NODE(ctx->b, pb);
+	if (key_cmp_p(ctx->b, lb, THMAP_GETPTR(ctx->a, la->key), la->len)) {
+		void *aval = leaf_val(ctx->a, la);
+		void *bval = leaf_val(ctx->b, lb);
+
+		if (!diff_val_eq_p(ctx->a, aval, bval)) {
+			diff_report(ctx, ctx->a, la, aval, bval);
+		}
+		return;
+	}
+	if (!ctx->skip_a) {
+		diff_report(ctx, ctx->a, la, leaf_val(ctx->a, la), NULL);
+	}
+	diff_report(ctx, ctx->b, lb, NULL, leaf_val(ctx->b, lb));
+}
+
+/*
+ * diff_compat_p: return true if the values of both maps are comparable,
+ * i.e. the maps use the same value mode.
+ */
+static bool
+diff_compat_p(const thmap_t *a, const thmap_t *b)
+{
+	return a->vinline == b->vinline && a->vlen == b->vlen;
+}
+
+static void
+diff_prefix(const diff_ctx_t *ctx, unsigned prefix)
+{
+	/* Consume from prior release in root_try_put(). */
+	diff_slot(ctx, atomic_load_consume(&ctx->a->root[prefix]),
+	    atomic_load_consume(&ctx->b->root[prefix]));
+}
 
-	unlock_node(parent);
-	ASSERT(node_locked_p(child));
-	parent = child;
+/*
+ * thmap_diff_prefix: call the function for every key with the given
+ * prefix which is present in only one of the maps (the value on the
+ * other side is NULL) or is present in both with different values.
+ *
+ * => Safe to call concurrently with the writers of both maps, as a reader
+ *    of both; the concurrent changes may or may not be reflected.
+ * => In the inline value mode, the values are compared by their contents
+ *    and the function is given the pointers to the stored values.
+ * => Returns -1 if the maps use different value modes.
+ */
+int
+thmap_diff_prefix(const thmap_t *a, const thmap_t *b, unsigned prefix,
+    thmap_diff_func_t func, void *arg)
+{
+	const diff_ctx_t ctx = {
+		.a = a, .b = b, .skip_a = false, .func = func, .arg = arg
+	};
 
-	/*
-	 * Get the new slot and check for another collision
-	 * at the next level.
-	 */
-	slot = hashval_getslot(&query, key, len);
-	if (slot == other_slot) {
-		/* Another collision -- descend and expand again. */
-		goto descend;
+	if (prefix >= ROOT_SIZE || !diff_compat_p(a, b)) {
+		return -1;
 	}
+	diff_prefix(&ctx, prefix);
+	return 0;
+}
 
-	/*
-	 * Insert our new leaf once we expanded enough.  The release
-	 * fence is already issued for us.
-	 */
-	target = THMAP_GETOFF(thmap, leaf) | THMAP_LEAF_BIT;
-	node_insert(parent, slot, target); /* (*) */
-out:
-	unlock_node(parent);
-	return val;
+int
+thmap_diff(const thmap_t *a, const thmap_t *b, thmap_diff_func_t func,
+    void *arg)
+{
+	for (unsigned i = 0; i < ROOT_SIZE; i++) {
+		if (thmap_diff_prefix(a, b, i, func, arg) == -1) {
+			return -1;
+		}
+	}
+	return 0;
 }
 
+typedef struct {
+	thmap_t *		dst;
+	thmap_merge_func_t	func;
+	void *			arg;
+	bool			error;
+} merge_ctx_t;
+
 /*
- * thmap_del: remove the entry given the key.
+ * leaf_replace: replace the value of an existing entry.
+ *
+ * => In the inline value mode, the leaf is immutable: a copy with the
+ *    new value replaces it and the old leaf is staged for G/C.  So it is
+ *    if there are live snapshots, which might share the leaf.
+ * => Returns 1 if replaced, 0 if the key is not found (or has expired,
+ *    so that the caller inserts it anew) and -1 on failure.
  */
-void *
-thmap_del(thmap_t *thmap, const void *key, size_t len)
+static int
+leaf_replace(thmap_t *thmap, const void *key, size_t len, void *val)
 {
 	thmap_query_t query;
-	thmap_leaf_t *leaf;
 	thmap_inode_t *parent;
+	thmap_leaf_t *leaf;
 	unsigned slot;
-	void *val;
+	int ret = 0;
 
+	snap_enter(thmap);
+	if (snap_unshare(thmap, key, len) == -1) {
+		ret = -1;
+		goto out;
+	}
 	hashval_init(&query, key, len);
 	parent = find_edge_node_locked(thmap, &query, key, len, &slot);
 	if (!parent) {
-		/* Root slot empty: not found. */
-		return NULL;
+		goto out;
 	}
 	leaf = get_leaf(thmap, parent, slot);
-	if (!leaf || !key_cmp_p(thmap, leaf, key, len)) {
-		/* Not found. */
-		unlock_node(parent);
-		return NULL;
+	if (!leaf || !key_cmp_p(thmap, leaf, key, len) ||
+	    !leaf_live_p(thmap, leaf)) {
+		unlock_node(thmap, parent);
+		goto out;
 	}
-
-	/* Remove the leaf. */
-	ASSERT(THMAP_NODE(thmap, atomic_load_relaxed(&parent->slots[slot]))
-	    == leaf);
-	node_remove(parent, slot);
-
-	/*
-	 * Collapse the levels if removing the last item.
-	 */
-	while (query.level &&
-	    NODE_COUNT(atomic_load_relaxed(&parent->state)) == 0) {
-		thmap_inode_t *node = parent;
-
-		ASSERT(atomic_load_relaxed(&node->state) == NODE_LOCKED);
-
-		/*
-		 * Ascend one level up.
-		 * => Mark our current parent as deleted.
-		 * => Lock the parent one level up.
-		 */
-		query.level--;
-		slot = hashval_getslot(&query, key, len);
-		parent = THMAP_NODE(thmap, node->parent);
-		ASSERT(parent != NULL);
-
-		lock_node(parent);
-		ASSERT((atomic_load_relaxed(&parent->state) & NODE_DELETED)
-		    == 0);
-
-		/*
-		 * Lock is exclusive, so nobody else can be writing at
-		 * the same time, and no need for atomic R/M/W, but
-		 * readers may read without the lock and so need atomic
-		 * load/store.  No ordering here needed because the
-		 * entry itself stays valid until GC.
-		 */
-		atomic_store_relaxed(&node->state,
-		    atomic_load_relaxed(&node->state) | NODE_DELETED);
-		unlock_node(node); // memory_order_release
-
-		ASSERT(THMAP_NODE(thmap,
-		    atomic_load_relaxed(&parent->slots[slot])) == node);
-		node_remove(parent, slot);
-
-		/* Stage the removed node for G/C. */
-		stage_mem_gc(thmap, THMAP_GETOFF(thmap, node), THMAP_INODE_LEN);
+	if (!thmap->vinline && thmap->snapshots == NULL) {
+		/* Release to subsequent consume in leaf_val(). */
+		atomic_store_release(&leaf->val, val);
+		ret = 1;
+	} else {
+		ret = leaf_copy(thmap, parent, slot, leaf, val) ? 1 : -1;
 	}
+	unlock_node(thmap, parent);
+out:
+	snap_exit(thmap);
+	return ret;
+}
 
-	/*
-	 * If the top node is empty, then we need to remove it from the
-	 * root level.  Mark the node as deleted and clear the slot.
-	 *
-	 * Note: acquiring the lock on the top node effectively prevents
-	 * the root slot from changing.
-	 */
-	if (NODE_COUNT(atomic_load_relaxed(&parent->state)) == 0) {
-		const unsigned rslot = query.rslot;
-		const thmap_ptr_t nptr =
-		    atomic_load_relaxed(&thmap->root[rslot]);
+static void
+merge_entry(const void *key, size_t len, void *dval, void *sval, void *arg)
+{
+	merge_ctx_t *ctx = arg;
+	void *val;
 
-		ASSERT(query.level == 0);
-		ASSERT(parent->parent == THMAP_NULL);
-		ASSERT(THMAP_GETOFF(thmap, parent) == nptr);
+	if (ctx->error || sval == NULL) {
+		return;
+	}
+	if (dval == NULL) {
+		/* Only in the source: insert. */
+		dval = thmap_put(ctx->dst, key, len, sval);
+		if (dval == NULL) {
+			ctx->error = true;
+			return;
+		}
+		if (diff_val_eq_p(ctx->dst, dval, sval)) {
+			return;
+		}
+	}
+	/* Conflict: keep the destination value, unless resolved otherwise. */
+	val = ctx->func ? ctx->func(key, len, dval, sval, ctx->arg) : dval;
+	if (val == dval) {
+		return;
+	}
+	switch (leaf_replace(ctx->dst, key, len, val)) {
+	case 0:
+		/* Deleted or expired concurrently: insert. */
+		if (thmap_put(ctx->dst, key, len, val) != NULL) {
+			break;
+		}
+		/* FALLTHROUGH */
+	case -1:
+		ctx->error = true;
+		break;
+	}
+}
 
-		/* Mark as deleted and remove from the root-level slot. */
-		atomic_store_relaxed(&parent->state,
-		    atomic_load_relaxed(&parent->state) | NODE_DELETED);
-		atomic_store_relaxed(&thmap->root[rslot], THMAP_NULL);
+/*
+ * thmap_merge_prefix: insert the entries with the given prefix from the
+ * source map into the destination map.  For the keys present in both
+ * with different values, the conflict function (if any) decides which
+ * value to keep: it is given the destination and the source values and
+ * returns the value to store; by default, the destination value is kept.
+ *
+ * => Returns 0 on success and -1 if an entry could not be inserted,
+ *    the maps use different value modes or the destination is in the
+ *    lock-free mode (the values are replaced under the node locks).
+ *    In the inline value mode, the conflict function returns the pointer
+ *    to the value to copy.
+ * => The destination may be accessed concurrently; the source is walked
+ *    as a reader.  If the destination does not copy the keys, then it
+ *    references the keys of the source.
+ */
+int
+thmap_merge_prefix(thmap_t *dst, const thmap_t *src, unsigned prefix,
+    thmap_merge_func_t func, void *arg)
+{
+	merge_ctx_t mctx = { .dst = dst, .func = func, .arg = arg };
+	const diff_ctx_t ctx = {
+		.a = dst, .b = src, .skip_a = true,
+		.func = merge_entry, .arg = &mctx
+	};
 
-		stage_mem_gc(thmap, nptr, THMAP_INODE_LEN);
+	if (prefix >= ROOT_SIZE || !diff_compat_p(dst, src) ||
+	    (dst->flags & THMAP_LOCKFREE) != 0) {
+		return -1;
 	}
-	unlock_node(parent);
+	diff_prefix(&ctx, prefix);
+	return mctx.error ? -1 : 0;
+}
 
-	/*
-	 * Save the value and stage the leaf for G/C.
-	 */
-	val = leaf->val;
-	if ((thmap->flags & THMAP_NOCOPY) == 0) {
-		stage_mem_gc(thmap, leaf->key, leaf->len);
+int
+thmap_merge(thmap_t *dst, const thmap_t *src, thmap_merge_func_t func,
+    void *arg)
+{
+	int ret = 0;
+
+	for (unsigned i = 0; i < ROOT_SIZE; i++) {
+		if (thmap_merge_prefix(dst, src, i, func, arg) == -1) {
+			ret = -1;
+		}
 	}
-	stage_mem_gc(thmap, THMAP_GETOFF(thmap, leaf), sizeof(thmap_leaf_t));
-	return val;
+	return ret;
 }
 
 /*
@@ -830,19 +4737,38 @@ thmap_del(thmap_t *thmap, const void *key, size_t len)
  */
 
 static void
-stage_mem_gc(thmap_t *thmap, uintptr_t addr, size_t len)
+stage_mem_gc(thmap_t *thmap, uintptr_t addr, size_t len, unsigned type)
 {
+	thmap_shard_t *shard = shard_get(thmap);
+	thmap_gc_t *_Atomic *list;
 	thmap_gc_t *head, *gc;
 
+	/* Account the memory as pending G/C (the total does not change). */
+	cache_account(thmap, type, -(int64_t)len);
+	atomic_fetch_sub_explicit(&shard->mem[type], len, memory_order_relaxed);
+	atomic_fetch_add_explicit(&shard->mem[MEM_GC], len,
+	    memory_order_relaxed);
+
 	gc = malloc(sizeof(thmap_gc_t));
 	gc->addr = addr;
 	gc->len = len;
+	gc->type = type;
+
+	/*
+	 * In the snapshot mode, the object might be referenced by the live
+	 * snapshots: retire it to the newest one (see the SNAPSHOTS section).
+	 * The writers are in the barrier, so the snapshots do not change.
+	 */
+	list = &thmap->gc_list;
+	if (__predict_false(thmap->snapshots != NULL)) {
+		list = &thmap->snapshots->retired;
+	}
 retry:
-	head = atomic_load_relaxed(&thmap->gc_list);
+	head = atomic_load_relaxed(list);
 	gc->next = head; // not yet published
 
 	/* Release to subsequent acquire in thmap_stage_gc(). */
-	if (!atomic_compare_exchange_weak_explicit(&thmap->gc_list, &head, gc,
+	if (!atomic_compare_exchange_weak_explicit(list, &head, gc,
 	    memory_order_release, memory_order_relaxed)) {
 		goto retry;
 	}
@@ -863,12 +4789,41 @@ thmap_gc(thmap_t *thmap, void *ref)
 
 	while (gc) {
 		thmap_gc_t *next = gc->next;
-		thmap->ops->free(gc->addr, gc->len);
+
+		/*
+		 * The objects carved from a compacted region are released
+		 * together with the region.
+		 */
+		if (!atomic_load_relaxed(&thmap->regions) ||
+		    !region_release(thmap, gc->addr)) {
+			mem_release(thmap, gc->addr, gc->len, gc->type);
+		}
+		mem_account(thmap, MEM_GC, -(int64_t)gc->len);
 		free(gc);
 		gc = next;
 	}
 }
 
+/*
+ * leaf_setup: set the leaf size, given the size up to the end of the
+ * value; in the cache mode, the reference word follows and, in the TTL
+ * mode, the expiry time.
+ */
+static void
+leaf_setup(thmap_t *thmap, size_t len)
+{
+	len = roundup2(len, sizeof(void *));
+	if (thmap->flags & THMAP_CACHE) {
+		thmap->ref_off = len;
+		len = roundup2(len + sizeof(atomic_uint), sizeof(void *));
+	}
+	if (thmap->flags & THMAP_TTL) {
+		thmap->exp_off = roundup2(len, sizeof(uint64_t));
+		len = thmap->exp_off + sizeof(uint64_t);
+	}
+	thmap->leaf_len = len;
+}
+
 /*
  * thmap_create: construct a new trie-hash map object.
  */
@@ -891,11 +4846,100 @@ thmap_create(uintptr_t baseptr, const thmap_ops_t *ops, unsigned flags)
 	thmap->baseptr = baseptr;
 	thmap->ops = ops ? ops : &thmap_default_ops;
 	thmap->flags = flags;
+	thmap->defrag.rslot = ROOT_SIZE;
+	thmap->inode_len = sizeof(thmap_inode_t);
+	if (flags & THMAP_SNAPSHOT) {
+		thmap->inode_len += sizeof(uint64_t);
+	}
+	thmap->gen = 1;
+	atomic_store_relaxed(&thmap->cache_batchlen, MEM_BATCH);
+	atomic_store_relaxed(&thmap->mem_batchlen, MEM_BATCH);
+	leaf_setup(thmap, sizeof(thmap_leaf_t));
+
+	/*
+	 * NUMA mode: the replicas are process-local, therefore it cannot
+	 * be used with the root shared with other processes, neither by
+	 * attaching to it nor by creating it in a region relative to the
+	 * base address (the writes of the others would bypass the replicas).
+	 */
+	if ((flags & THMAP_NUMA) &&
+	    ((flags & THMAP_SETROOT) != 0 || baseptr != 0)) {
+		free(thmap);
+		return NULL;
+	}
+
+	/*
+	 * Lock-free mode: the cache and TTL modes replace the entries under
+	 * the node locks and the NUMA mode syncs the root replicas under a
+	 * lock, therefore they cannot be combined with it.
+	 */
+	if ((flags & THMAP_LOCKFREE) &&
+	    (flags & (THMAP_NUMA | THMAP_CACHE | THMAP_TTL))) {
+		free(thmap);
+		return NULL;
+	}
+
+	/*
+	 * Snapshot mode: the generation and the writer barrier are private
+	 * to the map object; the entries are snapshotted without the expiry
+	 * times, which change in place.
+	 */
+	if ((flags & THMAP_SNAPSHOT) && (flags &
+	    (THMAP_SETROOT | THMAP_LOCKFREE | THMAP_TTL))) {
+		free(thmap);
+		return NULL;
+	}
+
+	/*
+	 * Single-writer mode: there are no writer locks to spin, park or
+	 * to avoid.
+	 */
+	if ((flags & THMAP_SINGLEWRITER) &&
+	    (flags & (THMAP_PARKLOCK | THMAP_LOCKFREE))) {
+		free(thmap);
+		return NULL;
+	}
+
+	/*
+	 * Huge page mode: the nodes are in the private memory of the process
+	 * and the arenas are not per NUMA node.  Therefore, the map must not
+	 * be shared (either attached or in the memory of the custom allocator,
+	 * e.g. the shared memory) or used with the NUMA mode.
+	 */
+	if ((flags & THMAP_HUGEPAGE) && (ops != NULL || baseptr != 0 ||
+	    (flags & (THMAP_SETROOT | THMAP_NUMA)) != 0)) {
+		free(thmap);
+		return NULL;
+	}
+	if ((flags & THMAP_NUMA) && numa_init(thmap) == -1) {
+		numa_fini(thmap);
+		free(thmap);
+		return NULL;
+	}
+
+	thmap->shards = aligned_alloc(CACHE_LINE_SIZE,
+	    sizeof(thmap_shard_t) * THMAP_NSHARDS);
+	if (!thmap->shards) {
+		numa_fini(thmap);
+		free(thmap);
+		return NULL;
+	}
+	memset(thmap->shards, 0, sizeof(thmap_shard_t) * THMAP_NSHARDS);
+	thmap->slots = calloc(ROOT_SIZE, sizeof(thmap_slotacct_t));
+	if (!thmap->slots) {
+		free(thmap->shards);
+		numa_fini(thmap);
+		free(thmap);
+		return NULL;
+	}
 
 	if ((thmap->flags & THMAP_SETROOT) == 0) {
 		/* Allocate the root level. */
 		root = thmap->ops->alloc(THMAP_ROOT_LEN);
 		if (!root) {
+			free(thmap->slots);
+			free(thmap->shards);
+			numa_fini(thmap);
 			free(thmap);
 			return NULL;
 		}
@@ -903,6 +4947,51 @@ thmap_create(uintptr_t baseptr, const thmap_ops_t *ops, unsigned flags)
 		memset(thmap->root, 0, THMAP_ROOT_LEN);
 		atomic_thread_fence(memory_order_release); /* XXX */
 	}
+	if (flags & THMAP_LOCKFREE) {
+		thmap_inode_t *node;
+
+		/* The permanently empty node for the frozen empty slots. */
+		thmap->lf_empty = thmap->ops->alloc(THMAP_INODE_LEN(thmap));
+		if (!thmap->lf_empty) {
+			thmap_destroy(thmap);
+			return NULL;
+		}
+		node = THMAP_GETPTR(thmap, thmap->lf_empty);
+		memset(node, 0, THMAP_INODE_LEN(thmap));
+		atomic_store_relaxed(&node->state, NODE_DELETED);
+	}
+	return thmap;
+}
+
+/*
+ * thmap_create_vlen: create a map storing the values of the given size
+ * inline, in the leaves, rather than the value pointers.  The size of
+ * zero creates a set, i.e. the keys without the values.
+ *
+ * => The stored values are accessed via the pointers returned by
+ *    thmap_get(), thmap_put() and thmap_del() or copied out using
+ *    thmap_get_copy(); they must not be modified in place, other than
+ *    by thmap_add().
+ * => The maps sharing the root (THMAP_SETROOT) must use the same size.
+ * => In the huge page mode, the leaf must fit a chunk of the arena.
+ */
+thmap_t *
+thmap_create_vlen(uintptr_t baseptr, const thmap_ops_t *ops, unsigned flags,
+    size_t vlen)
+{
+	thmap_t *thmap;
+
+	if ((thmap = thmap_create(baseptr, ops, flags)) == NULL) {
+		return NULL;
+	}
+	leaf_setup(thmap, offsetof(thmap_leaf_t, val) + vlen);
+	if ((flags & THMAP_HUGEPAGE) && HP_OBJ_LEN(THMAP_LEAF_LEN(thmap)) >
+	    HP_CHUNK_SIZE - HP_CHUNK_HDR) {
+		thmap_destroy(thmap);
+		return NULL;
+	}
+	thmap->vlen = vlen;
+	thmap->vinline = true;
 	return thmap;
 }
 
@@ -927,13 +5016,145 @@ void
 thmap_destroy(thmap_t *thmap)
 {
 	uintptr_t root = THMAP_GETOFF(thmap, thmap->root);
+	thmap_region_t *region;
 	void *ref;
 
+	while (thmap->snapshots) {
+		thmap_snapshot_release(thmap->snapshots);
+	}
 	ref = thmap_stage_gc(thmap);
 	thmap_gc(thmap, ref);
 
+	while ((region = atomic_load_relaxed(&thmap->regions)) != NULL) {
+		atomic_store_relaxed(&thmap->regions, region->next);
+		thmap->ops->free(region->addr, region->len);
+		free(region);
+	}
 	if ((thmap->flags & THMAP_SETROOT) == 0) {
 		thmap->ops->free(root, THMAP_ROOT_LEN);
 	}
+	if (thmap->lf_empty) {
+		thmap->ops->free(thmap->lf_empty, THMAP_INODE_LEN(thmap));
+	}
+	hp_fini(thmap);
+	numa_fini(thmap);
+	free(thmap->slots);
+	free(thmap->shards);
 	free(thmap);
 }
+
+/*
+ * thmap_stats: aggregate the contention and retry counters.
+ *
+ * => The result is not a snapshot: the counters might be concurrently
+ *    updated, but each of them is monotonic.
+ */
+void
+thmap_stats(const thmap_t *thmap, thmap_stats_t *stats)
+{
+	memset(stats, 0, sizeof(thmap_stats_t));
+	for (unsigned i = 0; i < THMAP_NSHARDS; i++) {
+		thmap_shard_t *shard = &thmap->shards[i];
+
+		stats->restarts += atomic_load_relaxed(&shard->restarts);
+		stats->retries += atomic_load_relaxed(&shard->retries);
+		stats->root_cas_fails +=
+		    atomic_load_relaxed(&shard->root_cas_fails);
+		stats->lock_spins += atomic_load_relaxed(&shard->lock_spins);
+		stats->lock_parks += atomic_load_relaxed(&shard->lock_parks);
+		stats->splits += atomic_load_relaxed(&shard->splits);
+		stats->collapses += atomic_load_relaxed(&shard->collapses);
+		stats->relocations += atomic_load_relaxed(&shard->relocations);
+		stats->evictions += atomic_load_relaxed(&shard->evictions);
+		stats->expirations += atomic_load_relaxed(&shard->expirations);
+	}
+}
+
+/*
+ * thmap_memory_usage: return the total memory used by the map (excluding
+ * the root level) and, optionally, its breakdown.
+ */
+size_t
+thmap_memory_usage(const thmap_t *thmap, thmap_memusage_t *usage)
+{
+	uint64_t mem[MEM_NTYPES] = { 0, 0, 0, 0 };
+
+	for (unsigned i = 0; i < THMAP_NSHARDS; i++) {
+		thmap_shard_t *shard = &thmap->shards[i];
+
+		for (unsigned t = 0; t < MEM_NTYPES; t++) {
+			mem[t] += atomic_load_relaxed(&shard->mem[t]);
+		}
+	}
+	if (usage) {
+		usage->inodes = mem[MEM_INODE];
+		usage->leaves = mem[MEM_LEAF];
+		usage->keys = mem[MEM_KEY];
+		usage->gc = mem[MEM_GC];
+	}
+	return mem[MEM_INODE] + mem[MEM_LEAF] + mem[MEM_KEY] + mem[MEM_GC];
+}
+
+static void
+count_walk(const void *key, size_t len, void *val, void *arg)
+{
+	size_t *n = arg;
+
+	(void)key; (void)len; (void)val;
+	(*n)++;
+}
+
+/*
+ * thmap_count: return the number of entries in the map.
+ *
+ * => By default, sum up the per-thread counter shards, which are updated
+ *    by the inserts and deletes: constant time, but only an estimate if
+ *    there are concurrent writers (and it includes the expired entries
+ *    which are not yet removed).
+ * => THMAP_COUNT_EXACT: count the entries by walking the map, which is
+ *    exact in the absence of concurrent writers or, in the snapshot mode,
+ *    as of the snapshot taken for the walk.
+ */
+size_t
+thmap_count(thmap_t *thmap, unsigned flags)
+{
+	thmap_snapshot_t *snap;
+	int64_t total = 0;
+	size_t n = 0;
+
+	if (flags & THMAP_COUNT_EXACT) {
+		if ((snap = thmap_snapshot_take(thmap)) != NULL) {
+			thmap_snapshot_walk(snap, count_walk, &n);
+			thmap_snapshot_release(snap);
+		} else {
+			thmap_walk(thmap, count_walk, &n);
+		}
+		return n;
+	}
+	for (unsigned i = 0; i < THMAP_NSHARDS; i++) {
+		total += atomic_load_relaxed(&thmap->shards[i].nitems);
+	}
+	/* The racing deletes may be summed up before their inserts. */
+	return total > 0 ? (size_t)total : 0;
+}
+
+/*
+ * thmap_setlimit: set the memory limit; zero indicates no limit.
+ *
+ * => May be called concurrently with the writers.
+ */
+void
+thmap_setlimit(thmap_t *thmap, size_t limit)
+{
+	atomic_store_relaxed(&thmap->mem_batchlen, MEM_BATCH_LEN(limit));
+	atomic_store_relaxed(&thmap->mem_limit, limit);
+
+	/* Propagate the batches, which might exceed the new length. */
+	for (unsigned i = 0; i < THMAP_NSHARDS; i++) {
+		const int64_t batch = atomic_exchange_explicit(
+		    &thmap->shards[i].mem_batch, 0, memory_order_relaxed);
+
+		atomic_fetch_add_explicit(&thmap->mem_total, batch,
+		    memory_order_relaxed);
+	}
+}
@@ -13,24 +13,149 @@ __BEGIN_DECLS
 struct thmap;
 typedef struct thmap thmap_t;
 
+struct thmap_snapshot;
+typedef struct thmap_snapshot thmap_snapshot_t;
+
 #define	THMAP_NOCOPY	0x01
 #define	THMAP_SETROOT	0x02
+#define	THMAP_PARKLOCK	0x04
+#define	THMAP_NUMA	0x08
+#define	THMAP_CACHE	0x10
+#define	THMAP_TTL	0x20
+#define	THMAP_LOCKFREE	0x40
+#define	THMAP_SNAPSHOT	0x80
+#define	THMAP_SINGLEWRITER	0x100
+#define	THMAP_HUGEPAGE	0x200
+
+/* The thmap_count() flags. */
+#define	THMAP_COUNT_EXACT	0x01
 
 typedef struct {
 	uintptr_t	(*alloc)(size_t);
 	void		(*free)(uintptr_t, size_t);
+	/* Optional: allocate on the given NUMA node (THMAP_NUMA). */
+	uintptr_t	(*alloc_node)(size_t, unsigned);
 } thmap_ops_t;
 
+typedef struct {
+	uint64_t	restarts;	// walk re-starts from the root
+	uint64_t	retries;	// walk retries (slot became a node)
+	uint64_t	root_cas_fails;	// lost races on the root-level slots
+	uint64_t	lock_spins;	// spin iterations on the node locks
+	uint64_t	lock_parks;	// node lock acquisitions after parking
+	uint64_t	splits;		// levels created on the collisions
+	uint64_t	collapses;	// levels removed on the deletions
+	uint64_t	relocations;	// objects relocated by thmap_defrag()
+	uint64_t	evictions;	// entries evicted in the cache mode
+	uint64_t	expirations;	// entries expired in the TTL mode
+} thmap_stats_t;
+
+#define	THMAP_STAT_LEVELS	16
+
+typedef struct {
+	uint64_t	inodes;		// intermediate nodes
+	uint64_t	leaves;		// leaves (entries)
+	uint64_t	key_bytes;	// total length of the keys
+	uint64_t	total_bytes;	// memory used by the structure
+	uint64_t	bytes_per_entry;
+	/* Per level (the last one also accounts all deeper levels). */
+	uint64_t	depth[THMAP_STAT_LEVELS];	 // leaves
+	uint64_t	level_inodes[THMAP_STAT_LEVELS]; // intermediate nodes
+	uint64_t	level_slots[THMAP_STAT_LEVELS];	 // occupied slots
+} thmap_structure_t;
+
+typedef struct {
+	size_t		inodes;		// intermediate nodes
+	size_t		leaves;		// leaves
+	size_t		keys;		// key copies
+	size_t		gc;		// pending G/C
+} thmap_memusage_t;
+
+/*
+ * Stepwise lookup state: the key, its length and the result are public;
+ * the remaining members are private.
+ */
+typedef struct {
+	const void *	key;
+	size_t		len;
+	void *		val;
+	uintptr_t	node;
+	unsigned	slot;
+	unsigned	step;
+	unsigned	rslot;
+	unsigned	level;
+	unsigned	hashidx;
+	uint32_t	hashval;
+} thmap_lookup_t;
+
+typedef void (*thmap_walk_func_t)(const void *, size_t, void *, void *);
+typedef void (*thmap_diff_func_t)(const void *, size_t, void *, void *,
+    void *);
+typedef void *(*thmap_merge_func_t)(const void *, size_t, void *, void *,
+    void *);
+typedef void (*thmap_evict_func_t)(const void *, size_t, void *, void *);
+
 thmap_t *	thmap_create(uintptr_t, const thmap_ops_t *, unsigned);
+thmap_t *	thmap_create_vlen(uintptr_t, const thmap_ops_t *, unsigned,
+		    size_t);
 void		thmap_destroy(thmap_t *);
 
 void *		thmap_get(thmap_t *, const void *, size_t);
+int		thmap_get_copy(thmap_t *, const void *, size_t, void *);
 void *		thmap_put(thmap_t *, const void *, size_t, void *);
 void *		thmap_del(thmap_t *, const void *, size_t);
+int		thmap_add(thmap_t *, const void *, size_t, int64_t, int64_t *);
+
+void		thmap_lookup_start(thmap_t *, thmap_lookup_t *,
+		    const void *, size_t);
+int		thmap_lookup_step(thmap_t *, thmap_lookup_t *);
+
+void		thmap_walk(const thmap_t *, thmap_walk_func_t, void *);
 
 void *		thmap_stage_gc(thmap_t *);
 void		thmap_gc(thmap_t *, void *);
 
+int		thmap_compact(thmap_t *);
+int		thmap_defrag(thmap_t *, unsigned);
+
+void		thmap_stats(const thmap_t *, thmap_stats_t *);
+void		thmap_stat_structure(const thmap_t *, thmap_structure_t *);
+
+size_t		thmap_memory_usage(const thmap_t *, thmap_memusage_t *);
+size_t		thmap_count(thmap_t *, unsigned);
+void		thmap_setlimit(thmap_t *, size_t);
+
+int		thmap_setcache(thmap_t *, size_t, size_t);
+unsigned	thmap_cache_evict(thmap_t *, unsigned);
+void		thmap_setevict(thmap_t *, thmap_evict_func_t, void *);
+
+void *		thmap_put_ttl(thmap_t *, const void *, size_t, void *,
+		    uint64_t);
+int		thmap_setexpire(thmap_t *, const void *, size_t, uint64_t);
+unsigned	thmap_expire(thmap_t *, uint64_t, unsigned);
+
+void		thmap_numa_setnode(int);
+
+unsigned	thmap_prefix(const void *, size_t);
+int		thmap_split(thmap_t *, unsigned, thmap_t *);
+int		thmap_detach(thmap_t *, unsigned, uintptr_t *);
+int		thmap_graft(thmap_t *, unsigned, uintptr_t);
+
+int		thmap_merge(thmap_t *, const thmap_t *, thmap_merge_func_t,
+		    void *);
+int		thmap_merge_prefix(thmap_t *, const thmap_t *, unsigned,
+		    thmap_merge_func_t, void *);
+int		thmap_diff(const thmap_t *, const thmap_t *,
+		    thmap_diff_func_t, void *);
+int		thmap_diff_prefix(const thmap_t *, const thmap_t *, unsigned,
+		    thmap_diff_func_t, void *);
+
+thmap_snapshot_t *thmap_snapshot_take(thmap_t *);
+void *		thmap_snapshot_get(thmap_snapshot_t *, const void *, size_t);
+void		thmap_snapshot_walk(thmap_snapshot_t *, thmap_walk_func_t,
+		    void *);
+void		thmap_snapshot_release(thmap_snapshot_t *);
+
 int		thmap_setroot(thmap_t *, uintptr_t);
 uintptr_t	thmap_getroot(const thmap_t *);
 
@@ -0,0 +1,631 @@
+/*
+ * Copyright (c) 2018 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * C++ API: a type-safe, header-only wrapper of the thmap C API.  The
+ * namespace is thmapxx, since "thmap" is the tag of the C structure.
+ *
+ *	thmapxx::map<Key, Value, KeyTraits = thmapxx::key_traits<Key>>
+ *
+ * - The object owns the map (RAII) and is move-only.  On destruction,
+ *   the remaining entries are deleted and all memory is reclaimed, i.e.
+ *   there must be no concurrent access at that point.
+ *
+ * - Keys: the core hashes and compares the key bytes, therefore a key type
+ *   is described by the KeyTraits, providing data(), size() and make()
+ *   (construct the key from the bytes).  The trivially copyable keys with
+ *   no padding bits (integers, pointers, enums, packed structures) are
+ *   used directly as a fixed-length byte sequence; std::basic_string and
+ *   std::basic_string_view are supported too.
+ *
+ * - Values: pointers are stored as is (nullptr cannot be stored); the
+ *   trivially copyable values smaller than a pointer are stored inline
+ *   (tagged, so that they are never NULL); the larger trivially copyable
+ *   values (e.g. uint64_t, double or small structures) are stored in the
+ *   leaves, i.e. the map is created using thmap_create_vlen(); other values
+ *   are boxed, i.e. allocated on the heap, in which case the box of the
+ *   deleted entry is reclaimed with the map's G/C (see stage_gc() and gc()).
+ *
+ * The concurrency semantics are the same as of the C API.
+ *
+ * With C++20, the lookups can also be performed as coroutines which
+ * suspend before each memory access of the descent (the accessed node is
+ * prefetched), see get_async() and thmapxx::scheduler below.
+ */
+
+#ifndef _THMAP_HPP_
+#define _THMAP_HPP_
+
+#include <sys/cdefs.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <climits>
+#include <cassert>
+#include <atomic>
+#include <new>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+#define	THMAPXX_COROUTINES
+#endif
+
+#include "thmap.h"
+
+namespace thmapxx {
+
+/*
+ * Key traits.
+ */
+
+template <typename Key>
+inline constexpr bool is_fixed_key_v =
+    std::is_trivially_copyable_v<Key> &&
+    std::has_unique_object_representations_v<Key>;
+
+template <typename Key, typename = void>
+struct key_traits;
+
+template <typename Key>
+struct key_traits<Key, std::enable_if_t<is_fixed_key_v<Key>>> {
+	static const void *data(const Key &key) noexcept { return &key; }
+	static constexpr size_t size(const Key &) noexcept { return sizeof(Key); }
+	static Key make(const void *p, size_t) noexcept {
+		Key key;
+		std::memcpy(&key, p, sizeof(Key));
+		return key;
+	}
+};
+
+template <typename C, typename T, typename A>
+struct key_traits<std::basic_string<C, T, A>> {
+	using key_type = std::basic_string<C, T, A>;
+
+	static const void *data(const key_type &key) noexcept {
+		return key.data();
+	}
+	static size_t size(const key_type &key) noexcept {
+		return key.size() * sizeof(C);
+	}
+	static key_type make(const void *p, size_t len) {
+		return key_type(static_cast<const C *>(p), len / sizeof(C));
+	}
+};
+
+template <typename C, typename T>
+struct key_traits<std::basic_string_view<C, T>> {
+	using key_type = std::basic_string_view<C, T>;
+
+	static const void *data(const key_type &key) noexcept {
+		return key.data();
+	}
+	static size_t size(const key_type &key) noexcept {
+		return key.size() * sizeof(C);
+	}
+	/* Note: refers to the key copy owned by the map. */
+	static key_type make(const void *p, size_t len) noexcept {
+		return key_type(static_cast<const C *>(p), len / sizeof(C));
+	}
+};
+
+/*
+ * Value encoding: see the description at the top.
+ */
+
+template <typename Value>
+struct value_codec {
+	static constexpr bool is_pointer = std::is_pointer_v<Value>;
+	static constexpr bool is_inline = !is_pointer &&
+	    std::is_trivially_copyable_v<Value> &&
+	    sizeof(Value) < sizeof(void *);
+	static constexpr bool is_leaf = !is_pointer && !is_inline &&
+	    std::is_trivially_copyable_v<Value>;
+	static constexpr bool is_boxed = !is_pointer && !is_inline && !is_leaf;
+
+	struct box {
+		Value	value;
+		box *	next;
+	};
+
+	static void *encode(const Value &val) {
+		if constexpr (is_pointer) {
+			return const_cast<void *>(static_cast<const void *>(val));
+		} else if constexpr (is_inline) {
+			unsigned char b[sizeof(Value)];
+			uintptr_t bits = 0;
+
+			std::memcpy(b, &val, sizeof(Value));
+			for (size_t i = 0; i < sizeof(Value); i++) {
+				bits |= static_cast<uintptr_t>(b[i]) << (CHAR_BIT * i);
+			}
+			return reinterpret_cast<void *>((bits << CHAR_BIT) | 1);
+		} else if constexpr (is_leaf) {
+			/* Copied into the leaf by the map. */
+			const void *p = &val;
+			return const_cast<void *>(p);
+		} else {
+			return new box{val, nullptr};
+		}
+	}
+
+	static Value decode(void *p) {
+		if constexpr (is_pointer) {
+			return static_cast<Value>(p);
+		} else if constexpr (is_inline) {
+			const uintptr_t bits = reinterpret_cast<uintptr_t>(p) >> CHAR_BIT;
+			unsigned char b[sizeof(Value)];
+			Value val;
+
+			for (size_t i = 0; i < sizeof(Value); i++) {
+				b[i] = static_cast<unsigned char>(bits >> (CHAR_BIT * i));
+			}
+			std::memcpy(&val, b, sizeof(Value));
+			return val;
+		} else if constexpr (is_leaf) {
+			Value val;
+
+			/* Note: the leaf does not guarantee the alignment. */
+			std::memcpy(&val, p, sizeof(Value));
+			return val;
+		} else {
+			return static_cast<box *>(p)->value;
+		}
+	}
+};
+
+#if defined(THMAPXX_COROUTINES)
+
+/*
+ * Coroutine task: a lazily started coroutine producing a value of type T.
+ * The tasks compose, i.e. a task can co_await another task; when the inner
+ * task suspends, the control returns to the resumer of the outermost task
+ * (e.g. the scheduler), which later resumes the innermost one.
+ */
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+struct promise_base {
+	promise_base *			root = this;
+	std::coroutine_handle<>		current;	// innermost (root only)
+	std::coroutine_handle<>		continuation;	// awaiting task
+	std::exception_ptr		error;
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+
+	auto final_suspend() noexcept {
+		struct final_awaiter {
+			bool await_ready() noexcept { return false; }
+			std::coroutine_handle<> await_suspend(
+			    std::coroutine_handle<>) noexcept {
+				if (promise->continuation) {
+					promise->root->current =
+					    promise->continuation;
+					return promise->continuation;
+				}
+				return std::noop_coroutine();
+			}
+			void await_resume() noexcept {}
+			promise_base *promise;
+		};
+		return final_awaiter{this};
+	}
+
+	void unhandled_exception() noexcept {
+		error = std::current_exception();
+	}
+};
+
+template <typename T>
+struct promise : promise_base {
+	std::optional<T> value;
+
+	task<T> get_return_object() noexcept;
+	template <typename U>
+	void return_value(U &&val) { value.emplace(std::forward<U>(val)); }
+	T result() {
+		if (error) {
+			std::rethrow_exception(error);
+		}
+		return std::move(*value);
+	}
+};
+
+template <>
+struct promise<void> : promise_base {
+	task<void> get_return_object() noexcept;
+	void return_void() noexcept {}
+	void result() {
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+};
+
+} // namespace detail
+
+template <typename T>
+class task {
+public:
+	using promise_type = detail::promise<T>;
+	using handle_type = std::coroutine_handle<promise_type>;
+
+	explicit task(handle_type h) noexcept : h_(h) {
+		h_.promise().current = h_;
+	}
+	task(task &&other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+	task &operator=(task &&other) noexcept {
+		if (this != &other) {
+			if (h_) {
+				h_.destroy();
+			}
+			h_ = std::exchange(other.h_, nullptr);
+		}
+		return *this;
+	}
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+	~task() { if (h_) h_.destroy(); }
+
+	/*
+	 * done, resume: check for completion and run the task until its
+	 * next suspension point (the outermost task only).
+	 */
+	bool done() const noexcept { return h_.done(); }
+	void resume() { h_.promise().current.resume(); }
+
+	/*
+	 * result: return the value (or re-throw the exception) of the
+	 * completed task.
+	 */
+	T result() { assert(done()); return h_.promise().result(); }
+
+	/*
+	 * Awaiting a task runs it in the context of the awaiting one.
+	 */
+	struct awaiter {
+		bool await_ready() noexcept { return false; }
+		template <typename P>
+		std::coroutine_handle<> await_suspend(
+		    std::coroutine_handle<P> caller) noexcept {
+			promise_type &p = h.promise();
+
+			p.root = caller.promise().root;
+			p.continuation = caller;
+			p.root->current = h;
+			return h;
+		}
+		T await_resume() { return h.promise().result(); }
+		handle_type h;
+	};
+
+	awaiter operator co_await() && noexcept { return awaiter{h_}; }
+
+private:
+	handle_type h_;
+};
+
+namespace detail {
+
+template <typename T>
+inline task<T>
+promise<T>::get_return_object() noexcept
+{
+	return task<T>(task<T>::handle_type::from_promise(*this));
+}
+
+inline task<void>
+promise<void>::get_return_object() noexcept
+{
+	return task<void>(task<void>::handle_type::from_promise(*this));
+}
+
+} // namespace detail
+
+/*
+ * Round-robin scheduler: resumes each of the spawned tasks in turn, until
+ * all of them complete.  The tasks are not owned and must outlive run().
+ */
+class scheduler {
+public:
+	template <typename T>
+	void spawn(task<T> &t) {
+		tasks_.push_back({ &t, [](void *p) {
+			task<T> *tp = static_cast<task<T> *>(p);
+			if (!tp->done()) {
+				tp->resume();
+			}
+			return tp->done();
+		}});
+	}
+
+	/*
+	 * poll: resume each pending task once; return true if any remain.
+	 */
+	bool poll() {
+		for (size_t i = 0; i < tasks_.size();) {
+			if (tasks_[i].step(tasks_[i].task)) {
+				tasks_[i] = tasks_.back();
+				tasks_.pop_back();
+				continue;
+			}
+			i++;
+		}
+		return !tasks_.empty();
+	}
+
+	void run() { while (poll()) continue; }
+	size_t pending() const noexcept { return tasks_.size(); }
+
+private:
+	struct entry {
+		void *	task;
+		bool	(*step)(void *);
+	};
+	std::vector<entry> tasks_;
+};
+
+#endif
+
+/*
+ * The map.
+ */
+
+template <typename Key, typename Value, typename KeyTraits = key_traits<Key>>
+class map {
+	using codec = value_codec<Value>;
+	using box = typename codec::box;
+
+	static constexpr bool fixed_key = is_fixed_key_v<Key> &&
+	    std::is_same_v<KeyTraits, key_traits<Key>>;
+
+public:
+	using key_type = Key;
+	using mapped_type = Value;
+
+	/*
+	 * G/C reference: the memory staged for the reclamation.
+	 */
+	class gc_ref {
+		friend class map;
+		void *	ref = nullptr;
+		box *	boxes = nullptr;
+	};
+
+	explicit map(unsigned flags = 0) : map(0, nullptr, flags) {}
+
+	map(uintptr_t baseptr, const thmap_ops_t *ops, unsigned flags) :
+	    flags_(flags) {
+		if constexpr (codec::is_leaf) {
+			map_ = thmap_create_vlen(baseptr, ops, flags,
+			    sizeof(Value));
+		} else {
+			map_ = thmap_create(baseptr, ops, flags);
+		}
+		if (map_ == nullptr) {
+			throw std::bad_alloc();
+		}
+	}
+
+	map(const map &) = delete;
+	map &operator=(const map &) = delete;
+
+	map(map &&other) noexcept :
+	    map_(std::exchange(other.map_, nullptr)),
+	    flags_(other.flags_),
+	    retired_(other.retired_.exchange(nullptr)) {}
+
+	map &operator=(map &&other) noexcept {
+		if (this != &other) {
+			destroy();
+			map_ = std::exchange(other.map_, nullptr);
+			flags_ = other.flags_;
+			retired_.store(other.retired_.exchange(nullptr));
+		}
+		return *this;
+	}
+
+	~map() { destroy(); }
+
+	/*
+	 * get: lookup the value given the key.
+	 */
+	std::optional<Value> get(const Key &key) const {
+		const auto [k, len] = key_bytes(key);
+		void *p = thmap_get(map_, k, len);
+
+		if (p == nullptr) {
+			return std::nullopt;
+		}
+		return codec::decode(p);
+	}
+
+#if defined(THMAPXX_COROUTINES)
+	/*
+	 * get_async: lookup as a coroutine, see thmap_lookup_step().  It
+	 * suspends after prefetching each node on the path; the caller
+	 * (e.g. the scheduler) is expected to run other lookups meanwhile.
+	 *
+	 * => The key is copied into the coroutine frame.
+	 * => The lookup must complete before the G/C reclaims the memory.
+	 */
+	task<std::optional<Value>> get_async(Key key) const {
+		const auto [k, len] = key_bytes(key);
+		thmap_lookup_t lk;
+
+		thmap_lookup_start(map_, &lk, k, len);
+		co_await std::suspend_always{};
+		while (thmap_lookup_step(map_, &lk)) {
+			co_await std::suspend_always{};
+		}
+		if (lk.val == nullptr) {
+			co_return std::nullopt;
+		}
+		co_return codec::decode(lk.val);
+	}
+#endif
+
+	bool contains(const Key &key) const {
+		const auto [k, len] = key_bytes(key);
+		return thmap_get(map_, k, len) != nullptr;
+	}
+
+	/*
+	 * size: the number of entries; see thmap_count().
+	 */
+	size_t size(bool exact = false) const {
+		return thmap_count(map_, exact ? THMAP_COUNT_EXACT : 0);
+	}
+
+	/*
+	 * put: insert the value given the key.
+	 *
+	 * => If the key is already present, return the associated value.
+	 * => Otherwise, on successful insert, return the given value.
+	 * => Throws std::bad_alloc if the entry could not be allocated
+	 *    (or the memory limit would be exceeded).
+	 */
+	Value put(const Key &key, const Value &val) {
+		const auto [k, len] = key_bytes(key);
+		void *p = codec::encode(val), *ret;
+
+		if constexpr (codec::is_pointer) {
+			assert(p != nullptr);
+		}
+		ret = thmap_put(map_, k, len, p);
+		if constexpr (codec::is_boxed) {
+			if (ret != p) {
+				/* Not published: can be freed immediately. */
+				delete static_cast<box *>(p);
+			}
+		}
+		if (ret == nullptr) {
+			throw std::bad_alloc();
+		}
+		return codec::decode(ret);
+	}
+
+	/*
+	 * erase: remove the entry given the key and return its value.
+	 */
+	std::optional<Value> erase(const Key &key) {
+		const auto [k, len] = key_bytes(key);
+		void *p = thmap_del(map_, k, len);
+
+		if (p == nullptr) {
+			return std::nullopt;
+		}
+		std::optional<Value> val(codec::decode(p));
+		if constexpr (codec::is_boxed) {
+			retire(static_cast<box *>(p));
+		}
+		return val;
+	}
+
+	/*
+	 * for_each: call f(key, value) for every entry; see thmap_walk().
+	 */
+	template <typename F>
+	void for_each(F &&f) const {
+		auto cb = [](const void *k, size_t len, void *p, void *arg) {
+			(*static_cast<std::remove_reference_t<F> *>(arg))(
+			    KeyTraits::make(k, len), codec::decode(p));
+		};
+		thmap_walk(map_, cb, const_cast<void *>(
+		    static_cast<const void *>(&f)));
+	}
+
+	/*
+	 * clear: remove all entries.  Concurrent lookups and updates are
+	 * safe, but the entries inserted concurrently might remain.
+	 */
+	void clear() {
+		for (const Key &key : keys()) {
+			erase(key);
+		}
+	}
+
+	/*
+	 * stage_gc, gc: stage the memory of the deleted entries for the
+	 * reclamation and reclaim it once there are no readers which could
+	 * be referencing it; see thmap_stage_gc() and thmap_gc().
+	 */
+	gc_ref stage_gc() {
+		gc_ref r;
+
+		r.boxes = retired_.exchange(nullptr, std::memory_order_acquire);
+		r.ref = thmap_stage_gc(map_);
+		return r;
+	}
+
+	void gc(gc_ref r) {
+		thmap_gc(map_, r.ref);
+		while (r.boxes) {
+			box *next = r.boxes->next;
+			delete r.boxes;
+			r.boxes = next;
+		}
+	}
+
+	thmap_t *native_handle() const noexcept { return map_; }
+
+private:
+	thmap_t *		map_;
+	unsigned		flags_;
+	std::atomic<box *>	retired_ {nullptr};
+
+	static std::pair<const void *, size_t> key_bytes(const Key &key) {
+		if constexpr (fixed_key) {
+			return { &key, sizeof(Key) };
+		} else {
+			return { KeyTraits::data(key), KeyTraits::size(key) };
+		}
+	}
+
+	std::vector<Key> keys() const {
+		std::vector<Key> v;
+		auto cb = [](const void *k, size_t len, void *, void *arg) {
+			static_cast<std::vector<Key> *>(arg)->push_back(
+			    KeyTraits::make(k, len));
+		};
+		thmap_walk(map_, cb, &v);
+		return v;
+	}
+
+	void retire(box *b) {
+		b->next = retired_.load(std::memory_order_relaxed);
+		while (!retired_.compare_exchange_weak(b->next, b,
+		    std::memory_order_release, std::memory_order_relaxed))
+			continue;
+	}
+
+	void destroy() {
+		if (map_ == nullptr) {
+			return;
+		}
+		/* The shared map (attached to the existing root) is kept. */
+		if ((flags_ & THMAP_SETROOT) == 0) {
+			clear();
+		}
+		gc(stage_gc());
+		thmap_destroy(map_);
+		map_ = nullptr;
+	}
+};
+
+} // namespace thmapxx
+
+#endif
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2018 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Operation trace capture: a wrapper library for LD_PRELOAD, which
+ * records the thmap_get(), thmap_put() and thmap_del() operations with
+ * the key bytes and the timestamps, then calls the real functions.
+ * The application must use the shared thmap library.  Usage:
+ *
+ *	THMAP_TRACE=/tmp/app.trace LD_PRELOAD=./libthmap_trace.so ./app
+ *
+ * If THMAP_TRACE is not set, then the calls are just passed through.
+ * The records are buffered per thread and appended to the file in chunks
+ * (see trace.h for the format); the buffers are flushed when they fill
+ * up, on the thread exit and on the process exit.  The trace can be
+ * replayed using t_replay.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <time.h>
+
+#include "thmap.h"
+#include "utils.h"
+#include "trace.h"
+
+#define	TRACE_BUFSIZE	(64 * 1024)
+
+typedef struct tbuf {
+	struct tbuf *	next;
+	uint32_t	tid;
+	uint64_t	base;
+	uint64_t	last;
+	size_t		len;
+	size_t		size;
+	uint8_t *	data;	// the chunk header and the records
+} tbuf_t;
+
+typedef void *(*get_func_t)(thmap_t *, const void *, size_t);
+typedef void *(*put_func_t)(thmap_t *, const void *, size_t, void *);
+
+static int			trace_fd = -1;
+static pthread_mutex_t		trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t		trace_key;
+static tbuf_t *			trace_bufs;
+static atomic_uint		trace_ntids;
+static __thread tbuf_t *	trace_tbuf;
+
+static get_func_t		real_get;
+static put_func_t		real_put;
+static get_func_t		real_del;
+
+static uint64_t
+clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * tbuf_flush: append the buffered records as a chunk.
+ */
+static void
+tbuf_flush(tbuf_t *tb)
+{
+	trace_chunk_t hdr;
+	ssize_t ret;
+
+	if (tb->len == sizeof(trace_chunk_t)) {
+		return;
+	}
+	hdr.len = tb->len - sizeof(trace_chunk_t);
+	hdr.tid = tb->tid;
+	hdr.base = tb->base;
+	memcpy(tb->data, &hdr, sizeof(hdr));
+
+	/* O_APPEND: the chunk is written as a whole. */
+	ret = write(trace_fd, tb->data, tb->len);
+	(void)ret;
+	tb->len = sizeof(trace_chunk_t);
+}
+
+static void
+tbuf_destroy(void *arg)
+{
+	tbuf_t *tb = arg, **tbp;
+
+	pthread_mutex_lock(&trace_lock);
+	tbuf_flush(tb);
+	for (tbp = &trace_bufs; *tbp != tb; tbp = &(*tbp)->next)
+		continue;
+	*tbp = tb->next;
+	pthread_mutex_unlock(&trace_lock);
+
+	trace_tbuf = NULL;
+	free(tb->data);
+	free(tb);
+}
+
+static tbuf_t *
+tbuf_create(void)
+{
+	tbuf_t *tb;
+
+	if ((tb = calloc(1, sizeof(tbuf_t))) == NULL) {
+		return NULL;
+	}
+	if ((tb->data = malloc(TRACE_BUFSIZE)) == NULL) {
+		free(tb);
+		return NULL;
+	}
+	tb->size = TRACE_BUFSIZE;
+	tb->len = sizeof(trace_chunk_t);
+	tb->tid = atomic_fetch_add(&trace_ntids, 1);
+
+	pthread_mutex_lock(&trace_lock);
+	tb->next = trace_bufs;
+	trace_bufs = tb;
+	pthread_mutex_unlock(&trace_lock);
+
+	pthread_setspecific(trace_key, tb);
+	trace_tbuf = tb;
+	return tb;
+}
+
+static void
+trace_record(unsigned op, const void *key, size_t len)
+{
+	const size_t need = TRACE_VARINT_MAX * 2 + 1 + len;
+	tbuf_t *tb;
+	uint64_t now;
+	uint8_t *p;
+
+	if (trace_fd == -1) {
+		return;
+	}
+	if ((tb = trace_tbuf) == NULL && (tb = tbuf_create()) == NULL) {
+		return;
+	}
+	now = clock_ns();
+
+	if (tb->len + need > tb->size) {
+		pthread_mutex_lock(&trace_lock);
+		tbuf_flush(tb);
+		pthread_mutex_unlock(&trace_lock);
+	}
+	if (tb->len + need > tb->size) {
+		/* Large key: grow the buffer. */
+		const size_t size = tb->len + need;
+
+		if ((p = realloc(tb->data, size)) == NULL) {
+			return;
+		}
+		tb->data = p;
+		tb->size = size;
+	}
+	if (tb->len == sizeof(trace_chunk_t)) {
+		tb->base = tb->last = now;
+	}
+
+	p = tb->data + tb->len;
+	p += trace_putv(p, now - tb->last);
+	*p++ = op;
+	p += trace_putv(p, len);
+	memcpy(p, key, len);
+	p += len;
+
+	tb->len = p - tb->data;
+	tb->last = now;
+}
+
+static void
+trace_fini(void)
+{
+	pthread_mutex_lock(&trace_lock);
+	for (tbuf_t *tb = trace_bufs; tb; tb = tb->next) {
+		tbuf_flush(tb);
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+__attribute__((constructor)) static void
+trace_init(void)
+{
+	const char *path = getenv("THMAP_TRACE");
+
+	real_get = (get_func_t)dlsym(RTLD_NEXT, "thmap_get");
+	real_put = (put_func_t)dlsym(RTLD_NEXT, "thmap_put");
+	real_del = (get_func_t)dlsym(RTLD_NEXT, "thmap_del");
+	if (!real_get || !real_put || !real_del) {
+		fprintf(stderr, "thmap_trace: %s\n", dlerror());
+		abort();
+	}
+	if (path == NULL) {
+		return;
+	}
+	if ((trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+	    0644)) == -1) {
+		perror("thmap_trace: open");
+		return;
+	}
+	if (write(trace_fd, TRACE_MAGIC, TRACE_MAGIC_LEN) != TRACE_MAGIC_LEN ||
+	    pthread_key_create(&trace_key, tbuf_destroy) != 0) {
+		close(trace_fd);
+		trace_fd = -1;
+		return;
+	}
+	atexit(trace_fini);
+}
+
+void *
+thmap_get(thmap_t *thmap, const void *key, size_t len)
+{
+	trace_record(TRACE_OP_GET, key, len);
+	return real_get(thmap, key, len);
+}
+
+void *
+thmap_put(thmap_t *thmap, const void *key, size_t len, void *val)
+{
+	trace_record(TRACE_OP_PUT, key, len);
+	return real_put(thmap, key, len, val);
+}
+
+void *
+thmap_del(thmap_t *thmap, const void *key, size_t len)
+{
+	trace_record(TRACE_OP_DEL, key, len);
+	return real_del(thmap, key, len);
+}
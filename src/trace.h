@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2018 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+#ifndef	_TRACE_H_
+#define	_TRACE_H_
+
+/*
+ * Operation trace format (see thmap_trace.c and t_replay.c).
+ *
+ * The file starts with TRACE_MAGIC, followed by the chunks.  Each chunk
+ * is written by a single traced thread: a trace_chunk_t header followed
+ * by the records, taking trace_chunk_t::len bytes.  Each record is:
+ *
+ *	varint	time since the previous record (or the chunk base), in ns
+ *	uint8	operation (TRACE_OP_*)
+ *	varint	key length
+ *	bytes	key
+ *
+ * The varints are LEB128 (7 bits per byte, least significant first).
+ * The integers in the chunk header are in the host byte order.
+ */
+
+#define	TRACE_MAGIC		"THMTRC01"
+#define	TRACE_MAGIC_LEN		8
+
+#define	TRACE_OP_GET		1
+#define	TRACE_OP_PUT		2
+#define	TRACE_OP_DEL		3
+
+#define	TRACE_VARINT_MAX	10
+
+typedef struct {
+	uint32_t	len;	// length of the records in bytes
+	uint32_t	tid;	// traced thread ID
+	uint64_t	base;	// monotonic timestamp (ns) of the chunk
+} trace_chunk_t;
+
+static inline size_t
+trace_putv(uint8_t *p, uint64_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+/*
+ * trace_getv: decode the varint; returns the number of bytes consumed
+ * or zero if it is truncated or malformed.
+ */
+static inline size_t
+trace_getv(const uint8_t *p, const uint8_t *end, uint64_t *vp)
+{
+	uint64_t v = 0;
+	size_t n = 0;
+
+	while (p + n < end && n < TRACE_VARINT_MAX) {
+		const uint8_t b = p[n];
+
+		v |= (uint64_t)(b & 0x7f) << (7 * n);
+		n++;
+		if ((b & 0x80) == 0) {
+			*vp = v;
+			return n;
+		}
+	}
+	return 0;
+}
+
+#endif
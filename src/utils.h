@@ -41,6 +41,10 @@
 #define	__aligned(x)		__attribute__((__aligned__(x)))
 #endif
 
+#ifndef __prefetch
+#define	__prefetch(x)		__builtin_prefetch(x)
+#endif
+
 /*
  * Minimum, maximum and rounding macros.
  */